@@ -0,0 +1,104 @@
+#include "ext2_imager.h"
+
+/* Appends a file from the native OS to the end of a file on the EXT2 disk,
+ * writing only the new data, however big the file on the disk already is.
+ *	If either path does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
+ *  If the path is a directory, return EISDIR.
+ *  If the file would grow past 4G, return EFBIG.
+ * Argument: If -q is provided, use that io_uring queue depth (0 for none).
+ */
+int ext2_append(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
+	char *path, *spath;
+	uint index, depth = EXT2_URING_DEPTH;
+	int fd, arg, ret;
+	struct stat st;
+	
+	/* Check arguments */
+	for (arg = 2; arg < argc - 2; arg++) {
+		if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc - 2) {
+			depth = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 4 || arg != argc - 2) {
+		/* Wrong usage */
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_append <image> \
+[-q <depth>] <path on native OS> <absolute path on EXT2>\n");
+		return EXIT_FAILURE;
+	}
+	spath = argv[argc - 2];
+	path = argv[argc - 1];
+	if (stat(spath, &st) != 0 || !S_ISREG(st.st_mode)) {
+		/* Error, or not a regular file */
+		fprintf(err, "No such source file or directory %s\n", spath);
+		return ENOENT;
+	}
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
+		return EXIT_FAILURE;
+	}
+	if (strlen(path) == 0 || path[0] != '/') {
+		fprintf(err, "Target path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
+		return EINVAL;
+	}
+	if ((index = get_inode_at_path(img, path)) == 0) {
+		fprintf(err, "No such file or directory\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
+	}
+	if ((unsigned long long)st.st_size > UINT_MAX) {
+		fprintf(err, "%s is too big to append\n", spath);
+		unload_disk(img, false);
+		return EFBIG;
+	}
+	if ((fd = open(spath, O_RDONLY)) < 0) {
+		print_error(err, "open");
+		unload_disk(img, false);
+		return EXIT_FAILURE;
+	}
+	
+	if (!append_file(img, index, fd, (uint)st.st_size, depth)) {
+		ret = errno;
+		if (ret == EISDIR) {
+			fprintf(err, "Path is a directory\n");
+		} else if (ret == ENOSPC) {
+			fprintf(err, "No space found on disk\n");
+		} else if (ret == EFBIG) {
+			fprintf(err, "File would be too big\n");
+		} else {
+			fprintf(err, "Failed to append %s\n", spath);
+		}
+		close(fd);
+		unload_disk(img, true);
+		return ret;
+	}
+	
+	/* Cleanup */
+	if (close(fd) < 0) {
+		print_error(err, "close");
+		unload_disk(img, true);
+		return EXIT_FAILURE;
+	}
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_append(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
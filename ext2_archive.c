@@ -0,0 +1,597 @@
+#define _GNU_SOURCE /* For copy_file_range */
+#include "ext2_imager.h"
+#include <sys/file.h>
+
+/* A block stored in the archive, found by its hash */
+typedef struct {
+	unsigned long long hash;	/* 0 for an empty slot */
+	unsigned long long id;		/* Block number in the blocks file */
+	uint src;	/* If stored by this run, 1 + its block in the image */
+} entry;
+
+/* An archive being added to, locked for as long as it is open */
+typedef struct {
+	int blocks_fd, hashes_fd;
+	unsigned long long stored;		/* Blocks in the blocks file */
+	entry *table;
+	unsigned long long capacity;	/* Slots, a power of 2 */
+
+	/* New blocks and their hashes, not written yet */
+	ubyte *batch;
+	unsigned long long *batch_hashes;
+	uint batched;
+} archive;
+
+/* An image being hashed */
+typedef struct {
+	image *img;
+	unsigned long long *hashes;	/* Per block, 0 if not archived */
+	uint next;					/* Next chunk to hash, taken atomically */
+	uint chunks;
+} hasher;
+
+/* Archives store blocks of EXT2_BLOCK_SIZE whatever the image's block
+ * size, so images of every size share them. Gets how many of those an
+ * image holds.
+ */
+static uint get_units(image *img) {
+	return img->sb->s_blocks_count << (img->block_bits - EXT2_MIN_BLOCK_BITS);
+}
+
+/* Gets archive block index of an image, a slice of one of its blocks. */
+static const ubyte *get_unit(image *img, uint index) {
+	return img->disk + (size_t)index * EXT2_BLOCK_SIZE;
+}
+
+/* Returns the hash of an archive block of an image, or 0 if it is not
+ * archived, being in a free or all zero image block (those come back
+ * as holes).
+ */
+static unsigned long long hash_block(image *img, uint index) {
+	uint block = index >> (img->block_bits - EXT2_MIN_BLOCK_BITS);
+	unsigned long long hash;
+
+	if (block >= img->sb->s_first_data_block && !get_block_bitmap(img, block)) {
+		return 0;
+	}
+	if (is_zero_block(img, get_block(img, block))) {
+		return 0;
+	}
+	hash = hash_data(get_unit(img, index), EXT2_BLOCK_SIZE, 0);
+	return (hash == 0 ? 1 : hash);
+}
+
+/* Hashes chunks until none are left. */
+static void *hash_chunks(void *arg) {
+	hasher *h = arg;
+	uint chunk, index, end;
+
+	while ((chunk = __atomic_fetch_add(&h->next, 1, __ATOMIC_RELAXED)) < h->chunks) {
+		end = (chunk + 1) * EXT2_ARCHIVE_CHUNK;
+		if (end > get_units(h->img)) {
+			end = get_units(h->img);
+		}
+		for (index = chunk * EXT2_ARCHIVE_CHUNK; index < end; index++) {
+			h->hashes[index] = hash_block(h->img, index);
+		}
+	}
+	return NULL;
+}
+
+/* Hashes every block of an image on num_threads threads.
+ * Return the hashes, or NULL if out of memory.
+ */
+static unsigned long long *hash_image(image *img, uint num_threads) {
+	hasher h;
+	pthread_t *threads;
+	uint i;
+
+	memset(&h, 0, sizeof(h));
+	h.img = img;
+	h.chunks = DIV_UP(get_units(img), EXT2_ARCHIVE_CHUNK);
+	if (num_threads == 0) {
+		num_threads = 1;
+	}
+	if (num_threads > h.chunks) {
+		num_threads = h.chunks;
+	}
+	if ((h.hashes = calloc(get_units(img), sizeof(*h.hashes))) == NULL
+			|| (threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		perror("calloc");
+		free(h.hashes);
+		return NULL;
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, hash_chunks, &h) != 0) {
+			break; /* Those started do the rest */
+		}
+	}
+	if (i == 0) {
+		hash_chunks(&h);
+	}
+	while (i > 0) {
+		pthread_join(threads[--i], NULL);
+	}
+	free(threads);
+	return h.hashes;
+}
+
+/* Writes len bytes of buf at off. Return true on success. */
+static bool write_at(int fd, const void *buf, size_t len, off_t off) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("pwrite");
+			return false;
+		}
+		buf = (const ubyte *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* Reads len bytes at off into buf. Return true on success. */
+static bool read_at(int fd, void *buf, size_t len, off_t off) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pread(fd, buf, len, off)) <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				perror("pread");
+			}
+			return false;
+		}
+		buf = (ubyte *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* Puts a block in the first free slot for its hash. The table must
+ * have room.
+ */
+static void insert_entry(archive *a, unsigned long long hash,
+								unsigned long long id, uint src) {
+	unsigned long long slot = hash & (a->capacity - 1);
+
+	while (a->table[slot].hash != 0) {
+		slot = (slot + 1) & (a->capacity - 1);
+	}
+	a->table[slot].hash = hash;
+	a->table[slot].id = id;
+	a->table[slot].src = src;
+}
+
+/* Doubles the table, so it is at most half full.
+ * Return false if out of memory.
+ */
+static bool grow_table(archive *a) {
+	entry *old = a->table;
+	unsigned long long i, capacity = a->capacity;
+
+	if ((a->table = calloc(capacity * 2, sizeof(entry))) == NULL) {
+		perror("calloc");
+		a->table = old;
+		return false;
+	}
+	a->capacity = capacity * 2;
+	for (i = 0; i < capacity; i++) {
+		if (old[i].hash != 0) {
+			insert_entry(a, old[i].hash, old[i].id, old[i].src);
+		}
+	}
+	free(old);
+	return true;
+}
+
+/* Writes the batched blocks and their hashes to the end of the archive.
+ * Return true on success.
+ */
+static bool flush_batch(archive *a) {
+	unsigned long long first = a->stored - a->batched;
+	bool ok;
+
+	ok = write_at(a->blocks_fd, a->batch, (size_t)a->batched * EXT2_BLOCK_SIZE,
+						(off_t)(first * EXT2_BLOCK_SIZE))
+			&& write_at(a->hashes_fd, a->batch_hashes,
+						a->batched * sizeof(*a->batch_hashes),
+						(off_t)(first * sizeof(*a->batch_hashes)));
+	a->batched = 0;
+	return ok;
+}
+
+/* Returns true if the archived block in e holds the same bytes as block.
+ * Blocks from this image are compared in place, and others read back.
+ */
+static bool is_same_entry(archive *a, image *img, entry *e, const ubyte *block) {
+	ubyte buf[EXT2_BLOCK_SIZE];
+
+	if (e->src != 0) {
+		return memcmp(get_unit(img, e->src - 1), block, EXT2_BLOCK_SIZE) == 0;
+	}
+	return read_at(a->blocks_fd, buf, EXT2_BLOCK_SIZE, (off_t)(e->id * EXT2_BLOCK_SIZE))
+				&& memcmp(buf, block, EXT2_BLOCK_SIZE) == 0;
+}
+
+/* Finds block index of the image in the archive, storing it if it is
+ * not there yet. Hashes only pick candidates, and the bytes decide.
+ * Return false on failure.
+ */
+static bool find_or_store(archive *a, image *img, uint index,
+								unsigned long long hash, unsigned long long *id) {
+	const ubyte *block = get_unit(img, index);
+	unsigned long long slot;
+
+	if ((a->stored + 1) * 2 > a->capacity && !grow_table(a)) {
+		return false;
+	}
+	for (slot = hash & (a->capacity - 1); a->table[slot].hash != 0;
+							slot = (slot + 1) & (a->capacity - 1)) {
+		if (a->table[slot].hash == hash && is_same_entry(a, img, &a->table[slot], block)) {
+			*id = a->table[slot].id;
+			return true;
+		}
+	}
+
+	/* New, so batch it up to be written */
+	*id = a->stored++;
+	insert_entry(a, hash, *id, index + 1);
+	memcpy(a->batch + (size_t)a->batched * EXT2_BLOCK_SIZE, block, EXT2_BLOCK_SIZE);
+	a->batch_hashes[a->batched++] = hash;
+	return a->batched < EXT2_ARCHIVE_BATCH || flush_batch(a);
+}
+
+/* Opens a file in the archive directory. */
+static int open_in(char *dir, char *name, int flags) {
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return open(path, flags, 0644);
+}
+
+/* Opens the archive in dir, creating it if needed, locks it against
+ * other writers, and loads the hashes of the blocks in it.
+ * Return false on failure.
+ */
+static bool open_archive(archive *a, char *dir) {
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned long long *hashes, i;
+
+	memset(a, 0, sizeof(*a));
+	a->blocks_fd = a->hashes_fd = -1;
+	snprintf(path, sizeof(path), "%s/%s", dir, EXT2_ARCHIVE_IMAGES);
+	if ((mkdir(dir, 0755) < 0 && errno != EEXIST)
+			|| (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+		perror("mkdir");
+		return false;
+	}
+	if ((a->blocks_fd = open_in(dir, EXT2_ARCHIVE_BLOCKS, O_RDWR | O_CREAT)) < 0
+			|| (a->hashes_fd = open_in(dir, EXT2_ARCHIVE_HASHES, O_RDWR | O_CREAT)) < 0) {
+		perror("open");
+		return false;
+	}
+	if (flock(a->blocks_fd, LOCK_EX) < 0 || fstat(a->hashes_fd, &st) < 0) {
+		perror("flock");
+		return false;
+	}
+
+	/* A block is only there once both it and its hash were written */
+	a->stored = st.st_size / sizeof(*hashes);
+	if (fstat(a->blocks_fd, &st) < 0) {
+		perror("fstat");
+		return false;
+	}
+	if ((unsigned long long)st.st_size / EXT2_BLOCK_SIZE < a->stored) {
+		a->stored = st.st_size / EXT2_BLOCK_SIZE;
+	}
+	for (a->capacity = 1024; a->capacity < a->stored * 2; a->capacity *= 2);
+	if ((a->table = calloc(a->capacity, sizeof(entry))) == NULL
+			|| (hashes = malloc(a->stored * sizeof(*hashes) + 1)) == NULL) {
+		perror("malloc");
+		return false;
+	}
+	if (!read_at(a->hashes_fd, hashes, a->stored * sizeof(*hashes), 0)) {
+		free(hashes);
+		return false;
+	}
+	for (i = 0; i < a->stored; i++) {
+		insert_entry(a, hashes[i], i, 0);
+	}
+	free(hashes);
+	if ((a->batch = malloc(EXT2_ARCHIVE_BATCH * EXT2_BLOCK_SIZE)) == NULL
+			|| (a->batch_hashes = malloc(EXT2_ARCHIVE_BATCH * sizeof(*hashes))) == NULL) {
+		perror("malloc");
+		return false;
+	}
+	return true;
+}
+
+/* Closes an archive, unlocking it. */
+static void close_archive(archive *a) {
+	if (a->blocks_fd >= 0) {
+		close(a->blocks_fd);
+	}
+	if (a->hashes_fd >= 0) {
+		close(a->hashes_fd);
+	}
+	free(a->table);
+	free(a->batch);
+	free(a->batch_hashes);
+}
+
+/* Writes the manifest of an image under name, replacing any before it.
+ * It is written aside and renamed into place, so it only appears once
+ * complete. Return true on success.
+ */
+static bool write_manifest(char *dir, char *name, archive_header *header,
+								export_run *runs, unsigned long long *ids) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	off_t off = 0;
+	int fd;
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", dir, EXT2_ARCHIVE_IMAGES, name);
+	snprintf(tmp, sizeof(tmp), "%s/%s/.%s", dir, EXT2_ARCHIVE_IMAGES, name);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return false;
+	}
+	ok = write_at(fd, header, sizeof(*header), off);
+	off += sizeof(*header);
+	ok = ok && write_at(fd, runs, header->runs * sizeof(*runs), off);
+	off += header->runs * sizeof(*runs);
+	ok = ok && write_at(fd, ids, header->refs * sizeof(*ids), off);
+	if (close(fd) < 0 || !ok) {
+		unlink(tmp);
+		return false;
+	}
+	if (rename(tmp, path) < 0) {
+		perror("rename");
+		return false;
+	}
+	return true;
+}
+
+/* Adds the blocks of img to the archive, filling in its manifest.
+ * Return false on failure.
+ */
+static bool archive_blocks(archive *a, image *img, unsigned long long *hashes,
+								archive_header *header, export_run *runs,
+								unsigned long long *ids) {
+	uint index;
+
+	for (index = 0; index < get_units(img); index++) {
+		if (hashes[index] == 0) {
+			continue;
+		}
+		if (!find_or_store(a, img, index, hashes[index], &ids[header->refs++])) {
+			return false;
+		}
+		if (header->runs > 0 && runs[header->runs - 1].start
+								+ runs[header->runs - 1].count == index) {
+			runs[header->runs - 1].count++;
+		} else {
+			runs[header->runs].start = index;
+			runs[header->runs++].count = 1;
+		}
+	}
+	return a->batched == 0 || flush_batch(a);
+}
+
+/* Adds an image to the archive in dir, under the name of its file.
+ * Return EXIT_SUCCESS, or the error.
+ */
+static int add_image(char *dir, char *file, uint num_threads) {
+	archive a;
+	archive_header header;
+	image *img;
+	unsigned long long *hashes, *ids = NULL, before;
+	export_run *runs = NULL;
+	uint index, refs = 0;
+	int ret = EIO;
+
+	if ((img = load_simple_disk(file)) == NULL) {
+		fprintf(stderr, "Failed to load the disk.\n");
+		return EXIT_FAILURE;
+	}
+	/* Hash in parallel first, so the archive is only locked to store */
+	if ((hashes = hash_image(img, num_threads)) == NULL) {
+		unload_disk(img, false);
+		return EXIT_FAILURE;
+	}
+	for (index = 0; index < get_units(img); index++) {
+		refs += (hashes[index] != 0);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, EXT2_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.block_size = EXT2_BLOCK_SIZE;
+	header.blocks = get_units(img);
+	header.size = img->size;
+
+	if ((runs = malloc((refs + 1) * sizeof(*runs))) == NULL
+			|| (ids = malloc((refs + 1) * sizeof(*ids))) == NULL) {
+		perror("malloc");
+		ret = EXIT_FAILURE;
+	} else if (open_archive(&a, dir)) {
+		before = a.stored;
+		if (archive_blocks(&a, img, hashes, &header, runs, ids)
+				&& write_manifest(dir, find_last_token(file), &header, runs, ids)) {
+			printf("%s: %u blocks in use, %llu new to the archive\n",
+						find_last_token(file), header.refs, a.stored - before);
+			ret = EXIT_SUCCESS;
+		}
+		close_archive(&a);
+	} else {
+		close_archive(&a);
+	}
+
+	/* Cleanup */
+	free(hashes);
+	free(runs);
+	free(ids);
+	if (!unload_disk(img, false)) {
+		fprintf(stderr, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+/* Copies count blocks from the archive starting at id into the image
+ * at index, sharing extents with the archive where the filesystem can.
+ * Return true on success.
+ */
+static bool copy_blocks(int src, unsigned long long id, int dest, uint index,
+								uint count) {
+	ubyte *buf;
+	loff_t in = (loff_t)id * EXT2_BLOCK_SIZE, out = (loff_t)index * EXT2_BLOCK_SIZE;
+	size_t len = (size_t)count * EXT2_BLOCK_SIZE;
+	ssize_t copied;
+	bool ok;
+
+	while (len > 0) {
+		if ((copied = copy_file_range(src, &in, dest, &out, len, 0)) > 0) {
+			len -= copied;
+			continue;
+		}
+		if (copied < 0 && errno == EINTR) {
+			continue;
+		}
+		if (copied == 0) {
+			return false; /* Archive cut short */
+		}
+		break; /* Not supported here, copy by hand */
+	}
+	if (len > 0 && (buf = malloc(len)) != NULL) {
+		ok = read_at(src, buf, len, in) && write_at(dest, buf, len, out);
+		free(buf);
+		return ok;
+	}
+	return len == 0;
+}
+
+/* Rebuilds the image called name in the archive in dir as target, a
+ * sparse file holding only the archived blocks.
+ *	If there is no such image, return ENOENT.
+ *	If its manifest is malformed, return EINVAL.
+ */
+static int extract_image(char *dir, char *name, char *target) {
+	char path[PATH_MAX];
+	archive_header header;
+	export_run *runs = NULL;
+	unsigned long long *ids = NULL;
+	uint i, j, n, ref = 0;
+	int manifest, blocks, fd, ret = EXIT_SUCCESS;
+
+	snprintf(path, sizeof(path), "%s/%s", EXT2_ARCHIVE_IMAGES, name);
+	if (strchr(name, '/') != NULL || (manifest = open_in(dir, path, O_RDONLY)) < 0) {
+		fprintf(stderr, "No image %s in the archive\n", name);
+		return ENOENT;
+	}
+	if (!read_at(manifest, &header, sizeof(header), 0)
+			|| memcmp(header.magic, EXT2_ARCHIVE_MAGIC, sizeof(header.magic)) != 0
+			|| header.block_size != EXT2_BLOCK_SIZE
+			|| (runs = malloc((header.runs + 1) * sizeof(*runs))) == NULL
+			|| (ids = malloc((header.refs + 1) * sizeof(*ids))) == NULL
+			|| !read_at(manifest, runs, header.runs * sizeof(*runs), sizeof(header))
+			|| !read_at(manifest, ids, header.refs * sizeof(*ids),
+							sizeof(header) + header.runs * sizeof(*runs))) {
+		fprintf(stderr, "Manifest of %s is corrupt\n", name);
+		close(manifest);
+		free(runs);
+		free(ids);
+		return EINVAL;
+	}
+	close(manifest);
+	if ((blocks = open_in(dir, EXT2_ARCHIVE_BLOCKS, O_RDONLY)) < 0
+			|| (fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		if (blocks >= 0) {
+			close(blocks);
+		}
+		free(runs);
+		free(ids);
+		return EXIT_FAILURE;
+	}
+
+	/* Start from holes, and copy in blocks stored one after the other
+	 * together */
+	if (ftruncate(fd, (off_t)header.size) < 0) {
+		perror("ftruncate");
+		ret = EIO;
+	}
+	for (i = 0; i < header.runs && ret == EXIT_SUCCESS; i++) {
+		if (runs[i].start >= header.blocks || runs[i].count > header.blocks - runs[i].start
+				|| runs[i].count > header.refs - ref) {
+			ret = EINVAL;
+			break;
+		}
+		for (j = 0; j < runs[i].count && ret == EXIT_SUCCESS; j += n) {
+			for (n = 1; j + n < runs[i].count && ids[ref + n] == ids[ref] + n; n++);
+			if (!copy_blocks(blocks, ids[ref], fd, runs[i].start + j, n)) {
+				ret = EIO;
+			}
+			ref += n;
+		}
+	}
+	if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, "Failed to extract %s\n", name);
+	}
+
+	/* Cleanup */
+	close(blocks);
+	free(runs);
+	free(ids);
+	if (close(fd) < 0) {
+		perror("close");
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+/* Adds an EXT2 image to an archive directory, storing each distinct
+ * block in use once across every image in it. Free and all zero blocks
+ * are left out.
+ * Argument: If -x is provided, rebuild the image of that name instead.
+ *			If -j is provided, hash blocks with that many threads.
+ */
+int ext2_archive(int argc, char **argv) {
+	uint num_threads = (uint)sysconf(_SC_NPROCESSORS_ONLN);
+	char *extract = NULL;
+	int arg;
+
+	/* Check arguments */
+	for (arg = 2; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "-x") == 0 && arg + 1 < argc - 1) {
+			extract = argv[++arg];
+		} else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc - 1) {
+			num_threads = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 1) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_archive <archive> \
+[-j <threads>] <image>\n\
+	or: ./ext2_archive <archive> -x <name> <image>\n");
+		return EXIT_FAILURE;
+	}
+	if (extract != NULL) {
+		return extract_image(argv[1], extract, argv[argc - 1]);
+	}
+	return add_image(argv[1], argv[argc - 1], num_threads);
+}
+
+int main (int argc, char **argv) {
+	return ext2_archive(argc, argv);
+}
\ No newline at end of file
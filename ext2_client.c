@@ -0,0 +1,80 @@
+#include "ext2_imager.h"
+
+/* Sends a command to a running ext2_imagerd, found through the socket
+ * path in EXT2_IMAGERD_SOCKET. Our stdout and stderr are passed along
+ * so that the daemon writes to them directly.
+ * Return the command's exit status, or -1 if there is no daemon and the
+ * command should run locally instead.
+ */
+int run_on_daemon(int argc, char **argv) {
+	char *socket_path = getenv(EXT2_IMAGERD_ENV);
+	char buf[EXT2_IMAGERD_MSG];
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	size_t len, arg_len;
+	int sock, i, status;
+	
+	if (socket_path == NULL || strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	
+	/* The working directory, then each argument, null separated */
+	if (getcwd(buf, sizeof(buf)) == NULL) {
+		return -1;
+	}
+	len = strlen(buf) + 1;
+	for (i = 0; i < argc; i++) {
+		arg_len = strlen(argv[i]) + 1;
+		if (len + arg_len > sizeof(buf)) {
+			return -1; /* Too long to send */
+		}
+		memcpy(buf + len, argv[i], arg_len);
+		len += arg_len;
+	}
+	
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		/* No daemon running */
+		close(sock);
+		return -1;
+	}
+	
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	
+	fflush(stdout);
+	fflush(stderr);
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		close(sock);
+		return -1;
+	}
+	if (recv(sock, &status, sizeof(status), 0) != sizeof(status)) {
+		/* It may or may not have run, so don't run it again */
+		fprintf(stderr, "ext2_imagerd did not reply\n");
+		status = EXIT_FAILURE;
+	}
+	close(sock);
+	return status;
+}
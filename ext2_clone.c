@@ -0,0 +1,115 @@
+#include "ext2_imager.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* Clones an image as a new file sharing all of its extents, or with -f
+ * a copy of its data where the filesystem can't share them.
+ * Return 0 on success, ENOTSUP if it can't be shared without -f, or
+ * errno for any other failure.
+ */
+static int clone_file(char *image, char *clone, bool copy) {
+	struct stat st;
+	int src, dest, ret = 0;
+	
+	if ((src = open(image, O_RDONLY)) < 0 || fstat(src, &st) < 0) {
+		ret = errno;
+		perror("open");
+		if (src >= 0) {
+			close(src);
+		}
+		return ret;
+	}
+	if ((dest = open(clone, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		ret = errno;
+		perror("open");
+		close(src);
+		return ret;
+	}
+	if (ioctl(dest, FICLONE, src) == 0) {
+		printf("Cloned %s as %s, sharing its extents\n", image, clone);
+	} else if (!copy) {
+		ret = ENOTSUP;
+	} else if (ftruncate(dest, st.st_size) == 0 && copy_file_data(src, dest, st.st_size)) {
+		printf("Copied %s to %s\n", image, clone);
+	} else {
+		ret = errno;
+		perror("copy_file_data");
+	}
+	close(src);
+	if (close(dest) < 0 && ret == 0) {
+		ret = errno;
+	}
+	if (ret != 0) {
+		unlink(clone);
+	}
+	return ret;
+}
+
+/* Snapshots an EXT2 image cheaply before changing it. The clone shares
+ * the image's extents where the host filesystem supports reflinks, and
+ * is otherwise an overlay: a sparse file that the tools open in place of
+ * the image, holding only the blocks changed through it.
+ *	If the image does not exist, return ENOENT.
+ *	If the clone exists, return EEXIST.
+ *	If the overlay is in use, return EBUSY.
+ *	If the image changed since the overlay was made, return ESTALE.
+ * Argument: If -o is provided, always make an overlay.
+ *			If -f is provided, copy the image where reflinks can't be
+ *			made, instead of making an overlay.
+ *			If -c is provided, write an overlay's blocks into its image.
+ *			If -d is provided, drop an overlay's changes.
+ */
+int ext2_clone(int argc, char **argv) {
+	bool overlay = false, copy = false;
+	int arg, ret;
+	
+	/* Check arguments */
+	if (argc == 3 && (strcmp(argv[2], "-c") == 0 || strcmp(argv[2], "-d") == 0)) {
+		if (argv[2][1] == 'c' ? commit_overlay(argv[1]) : discard_overlay(argv[1])) {
+			return EXIT_SUCCESS;
+		}
+		ret = errno;
+		if (ret == ESTALE) {
+			fprintf(stderr, "The image under %s changed since it was made\n", argv[1]);
+		} else if (ret == EBUSY) {
+			fprintf(stderr, "%s is in use\n", argv[1]);
+		} else if (ret == EINVAL) {
+			fprintf(stderr, "%s is not an overlay\n", argv[1]);
+		} else {
+			perror(argv[1]);
+		}
+		return ret;
+	}
+	for (arg = 2; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "-o") == 0) {
+			overlay = true;
+		} else if (strcmp(argv[arg], "-f") == 0) {
+			copy = true;
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 1 || (overlay && copy)) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_clone <image> \
+[-o | -f] <clone>\n\
+	or: ./ext2_clone <overlay> -c | -d\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (!overlay && (ret = clone_file(argv[1], argv[argc - 1], copy)) != ENOTSUP) {
+		return ret;
+	}
+	if (!create_overlay(argv[1], argv[argc - 1])) {
+		ret = errno;
+		perror(argv[argc - 1]);
+		return ret;
+	}
+	printf("Made %s an overlay of %s; commit it with -c or drop it with -d\n", 
+				argv[argc - 1], argv[1]);
+	return EXIT_SUCCESS;
+}
+
+int main (int argc, char **argv) {
+	return ext2_clone(argc, argv);
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#include "ext2_imager.h"
+
+/* The commands run in-process, by ext2_imagerd and ext2_fleet. Linked
+ * only into those, with the commands built with -DEXT2_IMAGERD.
+ */
+static const command COMMANDS[] = {
+	{"ext2_ls", ext2_ls},
+	{"ext2_cp", ext2_cp},
+	{"ext2_mkdir", ext2_mkdir},
+	{"ext2_ln", ext2_ln},
+	{"ext2_rm", ext2_rm},
+	{"ext2_rm_bonus", ext2_rm_bonus},
+	{"ext2_append", ext2_append},
+	{"ext2_truncate", ext2_truncate}
+};
+
+/* Finds the command run by the program at path. Return NULL if none. */
+const command *find_command(char *path) {
+	char *name = strrchr(path, '/');
+	uint i;
+	
+	name = (name == NULL ? path : name + 1);
+	for (i = 0; i < sizeof(COMMANDS) / sizeof(command); i++) {
+		if (strcmp(COMMANDS[i].name, name) == 0) {
+			return &COMMANDS[i];
+		}
+	}
+	return NULL;
+}
\ No newline at end of file
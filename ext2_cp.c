@@ -1,103 +1,295 @@
 #include "ext2_imager.h"
 
+/* Copies a file from the EXT2 disk out to the native OS.
+ *	If the path does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
+ *  If the path is a directory, return EISDIR.
+ */
+static int copy_out(image *img, char *path, char *tpath, uint depth, FILE *err) {
+	uint index;
+	inode *i;
+	int fd;
+	
+	if (strlen(path) == 0 || path[0] != '/') {
+		fprintf(err, "Source path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
+		return EINVAL;
+	}
+	if ((index = get_inode_at_path(img, path)) == 0) {
+		fprintf(err, "No such file or directory\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
+	}
+	i = get_valid_inode(img, index);
+	if (IS(i->i_mode, EXT2_S_IFDIR)) {
+		fprintf(err, "Path is a directory\n");
+		unload_disk(img, false);
+		return EISDIR;
+	}
+	
+	if ((fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		print_error(err, "open");
+		unload_disk(img, false);
+		return EXIT_FAILURE;
+	}
+	if (!read_file_data_async(img, i, fd, depth)) {
+		fprintf(err, "Failed to write %s\n", tpath);
+		close(fd);
+		unload_disk(img, false);
+		return EIO;
+	}
+	
+	/* Cleanup */
+	if (close(fd) < 0) {
+		print_error(err, "close");
+		unload_disk(img, false);
+		return EXIT_FAILURE;
+	}
+	if (!unload_disk(img, false)) {
+		fprintf(err, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Updates a file on the EXT2 disk in place to match one on the native OS,
+ * writing only the blocks that differ.
+ *  If the path is a directory, return EISDIR.
+ */
+static int update_in_place(image *img, uint index, int fd, uint len, char *spath,
+							FILE *err) {
+	int ret;
+	
+	if (update_file(img, index, fd, len) < 0) {
+		ret = errno;
+		if (ret == EISDIR) {
+			fprintf(err, "Path is a directory\n");
+		} else if (ret == ENOSPC) {
+			fprintf(err, "No space found on disk\n");
+		} else {
+			fprintf(err, "Failed to update from %s\n", spath);
+		}
+		close(fd);
+		unload_disk(img, true);
+		return ret;
+	}
+	if (close(fd) < 0) {
+		print_error(err, "close");
+		unload_disk(img, true);
+		return EXIT_FAILURE;
+	}
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Copies a host file read in already by load_host_file() onto the EXT2
+ * disk, as name in directory parent.
+ */
+static int copy_in_host_file(image *img, uint parent, const host_file *h, char *name,
+								FILE *err) {
+	uint num_blocks = DIV_UP(h->len, img->block_size);
+	inode *i;
+	
+	if ((i = new_inode(img, parent, num_blocks, EXT2_S_IFREG, name)) == NULL) {
+		/* No space */
+		fprintf(err, "No space found on disk\n");
+		unload_disk(img, false);
+		return ENOSPC;
+	}
+	if (!write_file_data(img, i, num_blocks, h->len, h->data)) {
+		/* Another writer took the space, so take the file back out */
+		fprintf(err, "No space found on disk\n");
+		remove_entry(img, get_inode_index(img, i), name, get_valid_inode(img, parent));
+		unload_disk(img, true);
+		return ENOSPC;
+	}
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
 /* Copies a file from the native OS onto a location on the EXT2 disk.
+ * The file is copied from memory if it was read in by load_host_file(),
+ * as ext2_fleet does for the files it copies onto every image.
  *	If either path does not exist, return ENOENT.
+ *	If the source file is 4G or bigger, return EFBIG.
+ * Argument: If -x is provided, copy a file from the EXT2 disk out instead.
+ *			If -q is provided, use that io_uring queue depth (0 for none).
+ *			If -d is provided, hard link to a file with the same contents
+ *			instead of copying, if the disk has one.
+ *			If -u is provided and the file already exists, update it in
+ *			place, rewriting only the blocks that changed.
  */
-int main (int argc, char **argv) {
+int ext2_cp(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
+	const host_file *source;
 	char *path, *spath, *last_token;
-	ubyte *file;
-	uint parent;
+	uint parent, existing;
 	inode *i;
 	uint len, num_blocks;
-	int fd;
+	uint depth = EXT2_URING_DEPTH;
+	unsigned long long hash;
+	bool extract = false, dedup = false, update = false;
+	int fd, arg, ret;
 	struct stat st;
 	
 	/* Check arguments */
-	if (argc != 4) {
+	for (arg = 2; arg < argc - 2; arg++) {
+		if (strcmp(argv[arg], "-x") == 0) {
+			extract = true;
+		} else if (strcmp(argv[arg], "-d") == 0) {
+			dedup = true;
+		} else if (strcmp(argv[arg], "-u") == 0) {
+			update = true;
+		} else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc - 2) {
+			depth = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 4 || arg != argc - 2) {
 		/* Wrong usage */
-		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_cp <image> \
-<path on native OS> <absolute path on EXT2>\n");
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_cp <image> \
+[-d] [-u] [-q <depth>] <path on native OS> <absolute path on EXT2>\n\
+	or: ./ext2_cp <image> -x [-q <depth>] \
+<absolute path on EXT2> <path on native OS>\n");
 		return EXIT_FAILURE;
 	}
-	if (!load_simple_disk(argv[1])) {
-		fprintf(stderr, "Failed to load the disk.\n");
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
 		return EXIT_FAILURE;
 	}
+	if (extract) {
+		return copy_out(img, argv[argc - 2], argv[argc - 1], depth, err);
+	}
 	/* Load source file */
 	spath = argv[argc - 2];
-	if (stat(spath, &st) != 0 || !S_ISREG(st.st_mode)) {
+	source = (dedup || update ? NULL : find_host_file(spath));
+	if (source == NULL && (stat(spath, &st) != 0 || !S_ISREG(st.st_mode))) {
 		/* Error, or not a regular file */
-		fprintf(stderr, "No such source file or directory %s\n", spath);
+		fprintf(err, "No such source file or directory %s\n", spath);
+		unload_disk(img, false);
 		return EINVAL;
 	}
+	if (source == NULL && (unsigned long long)st.st_size > UINT_MAX) {
+		fprintf(err, "%s is too big to copy\n", spath);
+		unload_disk(img, false);
+		return EFBIG;
+	}
 	/* Check target file */
 	path = argv[argc - 1];
 	if (strlen(path) == 0 || path[0] != '/') {
-		fprintf(stderr, "Target path must be absolute (so must start with /)\n");
-		unload_disk(false);
+		fprintf(err, "Target path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	
-	parent = get_inode_at_path(path);
+	parent = get_inode_at_path(img, path);
 	last_token = find_last_token(spath);
-	if (parent == 0 || !IS(get_valid_inode(parent)->i_mode, EXT2_S_IFDIR)) {
+	if (parent == 0 || !IS(get_valid_inode(img, parent)->i_mode, EXT2_S_IFDIR)) {
 		/* Intermediate path does not exist or is not directory */
-		fprintf(stderr, "Invalid directory path\n");
-		unload_disk(false);
-		return ENOENT;
+		fprintf(err, "Invalid directory path\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
 	}
 	
-	if (find_direct_child(parent, last_token) != 0) {
+	existing = find_direct_child(img, parent, last_token);
+	if (existing != 0 && update) {
+		if ((fd = open(spath, O_RDONLY)) < 0) {
+			print_error(err, "open");
+			unload_disk(img, false);
+			return EXIT_FAILURE;
+		}
+		return update_in_place(img, existing, fd, st.st_size, spath, err);
+	}
+	if (existing != 0) {
 		/* Exists */
-		fprintf(stderr, "File %s already exists\n", last_token);
-		unload_disk(false);
+		fprintf(err, "File %s already exists\n", last_token);
+		unload_disk(img, false);
 		return EEXIST;
 	}
 	
 	if (strlen(last_token) > EXT2_NAME_LEN) {
 		/* Too long */
-		fprintf(stderr, "Name %s is too long\n", last_token);
-		unload_disk(false);
+		fprintf(err, "Name %s is too long\n", last_token);
+		unload_disk(img, false);
 		return ENAMETOOLONG;
 	}
 	
 	/* Now get source */
+	if (source != NULL) {
+		return copy_in_host_file(img, parent, source, last_token, err);
+	}
 	if ((fd = open(spath, O_RDONLY)) < 0) {
-		perror("open");
+		print_error(err, "open");
+		unload_disk(img, false);
 		return EXIT_FAILURE;
 	}
 	
-	len = lseek(fd, 0, SEEK_END);
-	if ((file = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
-		perror("mmap");
-		return EXIT_FAILURE;
+	len = st.st_size;
+	
+	/* Link to an identical file instead, if there is one */
+	if (dedup && link_duplicate(img, parent, fd, len, last_token, &hash) != 0) {
+		close(fd);
+		if (!unload_disk(img, true)) {
+			fprintf(err, "Failed to unload the disk.\n");
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
 	}
 
 	/* Write data */
-	num_blocks = DIV_UP(len, EXT2_BLOCK_SIZE);
-	if ((i = new_inode(parent, num_blocks, EXT2_S_IFREG, last_token)) == NULL) {
+	num_blocks = DIV_UP(len, img->block_size);
+	if ((i = new_inode(img, parent, get_host_data_blocks(img, fd, num_blocks), 
+								EXT2_S_IFREG, last_token)) == NULL) {
 		/* No space */
-		fprintf(stderr, "No space found on disk\n");
+		fprintf(err, "No space found on disk\n");
 		
-		munmap(file, len);
 		close(fd);
-		unload_disk(false);
+		unload_disk(img, false);
 		return ENOSPC;
 	}
-	write_file_data(i, num_blocks, len, (char *)file);
+	if (!write_file_data_async(img, i, num_blocks, len, fd, depth)) {
+		/* Take the file back out, whether space ran out or reading failed */
+		ret = (errno == ENOSPC ? ENOSPC : EIO);
+		fprintf(err, (ret == ENOSPC ? "No space found on disk\n" : "Failed to read %s\n"), 
+					spath);
+		remove_entry(img, get_inode_index(img, i), last_token, get_valid_inode(img, parent));
+		close(fd);
+		unload_disk(img, true);
+		return ret;
+	}
+	if (dedup) {
+		remember_file(img, i, hash);
+	}
 	
 	/* Cleanup */
-    if (munmap(file, len) < 0) {
-		perror("munmap");
-		return EXIT_FAILURE;
-    }
-    if (close(fd) < 0) {
-		perror("close");
+	if (close(fd) < 0) {
+		print_error(err, "close");
+		unload_disk(img, true);
 		return EXIT_FAILURE;
-    }
-	if (!unload_disk(true)) {
-		fprintf(stderr, "Failed to unload the disk.\n");
+	}
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_cp(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,416 @@
+#include "ext2_imager.h"
+
+/* Two images being compared */
+typedef struct {
+	image *a, *b;
+	ubyte *changed;	/* One bit per block after the first data block */
+	uint *owner;	/* Inode each changed block belongs to, or 0 */
+	uint blocks;	/* Blocks after the first data block */
+	uint next;		/* Next chunk to compare, taken atomically */
+	uint chunks;
+} diff;
+
+/* Gets whether block, counted from the first data block, differs. */
+static bool is_changed(diff *d, uint bit) {
+	return (d->changed[bit / BITS_PER_BYTE] & (1 << (bit % BITS_PER_BYTE))) != 0;
+}
+
+/* Compares one chunk of blocks. Blocks allocated in only one image
+ * differ without being read; blocks free in both are skipped 64 at a
+ * time by looking at the bitmaps a word at a time.
+ */
+static void compare_chunk(diff *d, uint chunk) {
+	super_block *sb = d->a->sb;
+	uint start = chunk * EXT2_DIFF_CHUNK, end = start + EXT2_DIFF_CHUNK;
+	uint g = start / sb->s_blocks_per_group;
+	const ubyte *bitmap_a = get_block(d->a, d->a->gd[g].bg_block_bitmap);
+	const ubyte *bitmap_b = get_block(d->b, d->b->gd[g].bg_block_bitmap);
+	unsigned long long word_a, word_b, both, differ;
+	uint bit, i, block;
+
+	if (end > d->blocks) {
+		end = d->blocks;
+	}
+	for (bit = start; bit < end; bit += 64) {
+		memcpy(&word_a, bitmap_a + (bit % sb->s_blocks_per_group) / BITS_PER_BYTE, 8);
+		memcpy(&word_b, bitmap_b + (bit % sb->s_blocks_per_group) / BITS_PER_BYTE, 8);
+		if (end - bit < 64) {
+			/* Padding past the last block is marked used, ignore it */
+			word_a &= (1ULL << (end - bit)) - 1;
+			word_b &= (1ULL << (end - bit)) - 1;
+		}
+		differ = word_a ^ word_b;
+		for (both = word_a & word_b; both != 0; both &= both - 1) {
+			i = __builtin_ctzll(both);
+			block = sb->s_first_data_block + bit + i;
+			if (!is_same_block(d->a, get_block(d->a, block), get_block(d->b, block))) {
+				differ |= 1ULL << i;
+			}
+		}
+		/* Chunks start on a word, so no other thread writes this one */
+		memcpy(d->changed + bit / BITS_PER_BYTE, &differ, 8);
+	}
+}
+
+/* Compares chunks until none are left. */
+static void *compare_chunks(void *arg) {
+	diff *d = arg;
+	uint chunk;
+
+	while ((chunk = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) < d->chunks) {
+		compare_chunk(d, chunk);
+	}
+	return NULL;
+}
+
+/* Counts the changed blocks under a block pointer, indirect blocks
+ * included, and gives unowned ones to inode ino.
+ */
+static uint count_changed(diff *d, image *img, uint block, uint level, uint ino) {
+	uint bit, i, ret = 0;
+	uint *ptrs;
+
+	if (block <= img->sb->s_first_data_block || block >= img->sb->s_blocks_count) {
+		return 0; /* A hole, or not a block */
+	}
+	bit = block - img->sb->s_first_data_block;
+	if (is_changed(d, bit) && d->owner[bit] != ino) {
+		ret++;
+		if (d->owner[bit] == 0) {
+			d->owner[bit] = ino;
+		}
+	}
+	if (level > 0) {
+		ptrs = (uint *)get_block(img, block);
+		for (i = 0; i < img->ptrs_per_block; i++) {
+			ret += count_changed(d, img, ptrs[i], level - 1, ino);
+		}
+	}
+	return ret;
+}
+
+/* Gets whether the inode at index points to blocks of its own, from the
+ * summary of an image, so the inode is not read when it has none. Fast
+ * symlinks, devices, fifos, sockets and empty files have none.
+ */
+static bool has_blocks(image *img, uint index) {
+	ushort mode = img->summary->mode[index];
+	uint size = img->summary->size[index];
+
+	if (IS_TYPE(mode, EXT2_S_IFLNK)) {
+		return size >= EXT2_MIN_BLOCK_DATA;
+	}
+	return (IS_TYPE(mode, EXT2_S_IFREG) || IS_TYPE(mode, EXT2_S_IFDIR))
+			&& (size > 0 || img->summary->first_block[index] != 0);
+}
+
+/* Counts the changed blocks of an inode in one image. */
+static uint count_inode_changed(diff *d, image *img, inode *node, uint ino) {
+	uint i, ret = 0;
+
+	if (!has_blocks(img, ino)) {
+		return 0; /* Just the inode, which is not read */
+	}
+	for (i = 0; i < EXT2_NUM_PTRS_PER_INODE; i++) {
+		ret += count_changed(d, img, node->i_block[i],
+						(i < EXT2_NUM_SINGLE ? 0 : i - EXT2_NUM_SINGLE + 1), ino);
+	}
+	return ret;
+}
+
+/* Gets whether the inode table block holding inode index differs, so
+ * the inode may differ between the images.
+ */
+static bool is_inode_changed(diff *d, uint index) {
+	super_block *sb = d->a->sb;
+	uint g = (index - 1) / sb->s_inodes_per_group;
+	uint block = d->a->gd[g].bg_inode_table + ((index - 1) % sb->s_inodes_per_group)
+					/ (d->a->block_size / sb->s_inode_size);
+
+	return d->a->gd[g].bg_inode_table != d->b->gd[g].bg_inode_table
+			|| is_changed(d, block - sb->s_first_data_block);
+}
+
+/* Records the path of each entry it is given, for walk_tree(), in the
+ * paths it is passed. Hard links keep the first path found, and are not
+ * gone into again.
+ */
+static tree_step find_path(tree_walk *w, tree_visit visit, uint dir, 
+								dir_entry *entry, void *arg) {
+	char **paths = arg;
+	size_t len;
+	char *path;
+
+	(void)dir;
+	if (visit != EXT2_VISIT_ENTRY) {
+		return EXT2_WALK_CONTINUE;
+	}
+	if (paths[entry->inode] != NULL || is_special_dir(entry)) {
+		return EXT2_WALK_SKIP;
+	}
+	len = strlen(w->path) + 1 + entry->name_len + 1;
+	if ((path = malloc(len)) == NULL) {
+		perror("malloc");
+		return EXT2_WALK_STOP;
+	}
+	snprintf(path, len, "%s/%.*s", (strcmp(w->path, "/") == 0 ? "" : w->path),
+				entry->name_len, entry->name);
+	paths[entry->inode] = path;
+	return EXT2_WALK_CONTINUE;
+}
+
+/* Gets the paths of every inode of an image. Return NULL on failure. */
+static char **get_paths(image *img) {
+	char **paths = calloc(img->sb->s_inodes_count + 1, sizeof(char *));
+
+	if (paths == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	paths[EXT2_ROOT_INO] = strdup("/");
+	walk_tree(img, EXT2_ROOT_INO, "/", false, find_path, paths);
+	return paths;
+}
+
+/* Frees what get_paths() returned. */
+static void free_paths(image *img, char **paths) {
+	uint i;
+
+	for (i = 0; paths != NULL && i <= img->sb->s_inodes_count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+}
+
+/* Returns true if two inodes differ in anything but access time. */
+static bool inode_differs(inode *a, inode *b) {
+	inode x = *a, y = *b;
+
+	x.i_atime = y.i_atime = 0;
+	return memcmp(&x, &y, sizeof(inode)) != 0;
+}
+
+/* Prints one file that changed. */
+static void print_file(char kind, char **paths, uint index, uint blocks) {
+	if (paths[index] != NULL) {
+		printf("%c %s", kind, paths[index]);
+	} else {
+		printf("%c <inode %u>", kind, index);
+	}
+	if (blocks > 0) {
+		printf(" (%u block%s)", blocks, (blocks == 1 ? "" : "s"));
+	}
+	printf("\n");
+}
+
+/* Prints runs of changed blocks, with what they belong to. */
+static void print_blocks(diff *d, char **paths_a, char **paths_b) {
+	uint first = d->a->sb->s_first_data_block;
+	uint bit, end, owner;
+	const char *what;
+
+	for (bit = 0; bit < d->blocks; bit = end) {
+		if (!is_changed(d, bit)) {
+			end = bit + 1;
+			continue;
+		}
+		owner = d->owner[bit];
+		for (end = bit + 1; end < d->blocks && is_changed(d, end)
+					&& d->owner[end] == owner; end++);
+
+		if (owner == 0) {
+			what = "metadata";
+		} else if ((what = paths_b[owner]) == NULL && (what = paths_a[owner]) == NULL) {
+			what = "unlinked inode";
+		}
+		if (end - bit == 1) {
+			printf("block %u: %s\n", first + bit, what);
+		} else {
+			printf("blocks %u-%u: %s\n", first + bit, first + end - 1, what);
+		}
+	}
+}
+
+/* Compares every block of the images with num_threads threads, filling
+ * in d->changed. Return false on failure.
+ */
+static bool compare_images(diff *d, uint num_threads) {
+	pthread_t *threads;
+	uint i;
+
+	d->blocks = d->a->sb->s_blocks_count - d->a->sb->s_first_data_block;
+	d->chunks = DIV_UP(d->blocks, EXT2_DIFF_CHUNK);
+	if (num_threads == 0) {
+		num_threads = 1;
+	}
+	if (num_threads > d->chunks) {
+		num_threads = d->chunks;
+	}
+	d->changed = calloc(DIV_UP(d->blocks, 64), 8);
+	d->owner = calloc(d->blocks, sizeof(uint));
+	if (d->changed == NULL || d->owner == NULL
+			|| (threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		perror("calloc");
+		return false;
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, compare_chunks, d) != 0) {
+			break; /* Those started do the rest */
+		}
+	}
+	if (i == 0) {
+		compare_chunks(d);
+	}
+	while (i > 0) {
+		pthread_join(threads[--i], NULL);
+	}
+	free(threads);
+	return true;
+}
+
+/* Prints every file added (A), deleted (D) or modified (M), and adds
+ * up how many changed blocks belong to files in file_blocks.
+ * Return the number of files printed.
+ */
+static uint print_files(diff *d, char **paths_a, char **paths_b, uint *file_blocks) {
+	inode *node_a, *node_b;
+	uint index, n, ret = 0;
+	bool used_a, used_b;
+
+	for (index = 1; index <= d->a->sb->s_inodes_count; index++) {
+		if (index < d->a->sb->s_first_ino && index != EXT2_ROOT_INO) {
+			continue; /* Reserved */
+		}
+		used_a = is_inode_live(d->a, index);
+		used_b = is_inode_live(d->b, index);
+		if (!used_a && !used_b) {
+			continue;
+		}
+		if (used_a && used_b && !is_inode_changed(d, index)) {
+			/* The same inode in both, so only the blocks it points to can differ */
+			node_b = get_inode(d->b, index);
+			n = count_inode_changed(d, d->b, node_b, index)
+					+ count_inode_changed(d, d->a, node_b, index);
+			if (n > 0) {
+				print_file('M', paths_b, index, n);
+				ret++;
+			}
+			*file_blocks += n;
+			continue;
+		}
+		node_a = get_inode(d->a, index);
+		node_b = get_inode(d->b, index);
+		if (used_a && used_b && node_a->i_ctime == node_b->i_ctime) {
+			n = count_inode_changed(d, d->b, node_b, index)
+					+ count_inode_changed(d, d->a, node_a, index);
+			if (n > 0 || inode_differs(node_a, node_b)) {
+				print_file('M', paths_b, index, n);
+				ret++;
+			}
+			*file_blocks += n;
+			continue;
+		}
+		/* Otherwise it was freed, created, or both */
+		if (used_a) {
+			*file_blocks += count_inode_changed(d, d->a, node_a, index);
+			print_file('D', paths_a, index, 0);
+			ret++;
+		}
+		if (used_b) {
+			*file_blocks += count_inode_changed(d, d->b, node_b, index);
+			print_file('A', paths_b, index, 0);
+			ret++;
+		}
+	}
+	return ret;
+}
+
+/* Compares two EXT2 images, printing the files that were added (A),
+ * deleted (D) or modified (M) going from the first to the second, and
+ * how many blocks differ.
+ *	If the images differ, return 1.
+ *	If the images have different layouts, return EINVAL.
+ * Argument: If -b is provided, also list the blocks that differ.
+ *			If -j is provided, compare with that many threads.
+ */
+int ext2_diff(int argc, char **argv) {
+	diff d;
+	char **paths_a = NULL, **paths_b = NULL;
+	uint i, files, file_blocks = 0, total = 0;
+	uint num_threads = (uint)sysconf(_SC_NPROCESSORS_ONLN);
+	bool list_blocks = false;
+	int arg, ret = EXIT_FAILURE;
+
+	/* Check arguments */
+	for (arg = 1; arg < argc - 2; arg++) {
+		if (strcmp(argv[arg], "-b") == 0) {
+			list_blocks = true;
+		} else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc - 2) {
+			num_threads = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 2) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_diff [-b] \
+[-j <threads>] <image> <other image>\n");
+		return EXIT_FAILURE;
+	}
+	memset(&d, 0, sizeof(d));
+	if ((d.a = load_simple_disk(argv[argc - 2])) == NULL
+			|| (d.b = load_simple_disk(argv[argc - 1])) == NULL) {
+		fprintf(stderr, "Failed to load the disk.\n");
+		if (d.a != NULL) {
+			unload_disk(d.a, false);
+		}
+		return EXIT_FAILURE;
+	}
+	if (!build_inode_summary(d.a) || !build_inode_summary(d.b)) {
+		fprintf(stderr, "Failed to load the disk.\n");
+		unload_disk(d.a, false);
+		unload_disk(d.b, false);
+		return EXIT_FAILURE;
+	}
+	if (d.a->sb->s_blocks_count != d.b->sb->s_blocks_count
+			|| d.a->sb->s_blocks_per_group != d.b->sb->s_blocks_per_group
+			|| d.a->sb->s_inodes_count != d.b->sb->s_inodes_count
+			|| d.a->sb->s_inodes_per_group != d.b->sb->s_inodes_per_group) {
+		fprintf(stderr, "Images have different layouts\n");
+		unload_disk(d.a, false);
+		unload_disk(d.b, false);
+		return EINVAL;
+	}
+
+	/* Compare blocks, then map them back to the files holding them */
+	if (compare_images(&d, num_threads) 
+			&& (paths_a = get_paths(d.a)) != NULL 
+			&& (paths_b = get_paths(d.b)) != NULL) {
+		files = print_files(&d, paths_a, paths_b, &file_blocks);
+		for (i = 0; i < d.blocks; i++) {
+			total += is_changed(&d, i);
+		}
+		if (list_blocks) {
+			print_blocks(&d, paths_a, paths_b);
+		}
+		printf("%u file%s changed, %u of %u blocks differ (%u in files)\n",
+					files, (files == 1 ? "" : "s"), total,
+					d.a->sb->s_blocks_count, file_blocks);
+		ret = (total > 0 || files > 0 ? 1 : EXIT_SUCCESS);
+	}
+
+	/* Cleanup */
+	free_paths(d.a, paths_a);
+	free_paths(d.b, paths_b);
+	free(d.changed);
+	free(d.owner);
+	if (!unload_disk(d.a, false) || !unload_disk(d.b, false)) {
+		fprintf(stderr, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+int main (int argc, char **argv) {
+	return ext2_diff(argc, argv);
+}
\ No newline at end of file
@@ -0,0 +1,302 @@
+#include "ext2_imager.h"
+#include <zlib.h>
+
+/* A packed chunk, waiting to be written in order */
+typedef struct {
+	ubyte *buf;		/* export_chunk, runs and data */
+	size_t len;		/* 0 if the chunk holds no blocks */
+	bool done;
+} slot;
+
+/* An image being exported */
+typedef struct {
+	image *img;
+	int fd;
+	bool compress;
+	uint chunks;
+	uint next;			/* Next chunk to pack */
+	uint written;		/* Chunks written so far */
+	uint window;		/* Slots, so chunks packed ahead of writing */
+	slot *slots;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} export;
+
+/* Writes len bytes of buf. Return true on success. */
+static bool write_all(int fd, const void *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			return false;
+		}
+		buf = (const ubyte *)buf + n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Returns true if block index holds data worth exporting: it is in use
+ * (or before the first data block, so outside the bitmaps) and not all
+ * zero, since import leaves a hole wherever nothing is written.
+ */
+static bool is_exported(image *img, uint index) {
+	if (index >= img->sb->s_first_data_block && !get_block_bitmap(img, index)) {
+		return false;
+	}
+	return !is_zero_block(img, get_block(img, index));
+}
+
+/* Packs one chunk into its slot: the runs of exported blocks in it,
+ * then their data, compressed if asked and if that makes it smaller.
+ * Return false if out of memory.
+ */
+static bool pack_chunk(export *e, uint chunk, slot *s) {
+	uint start = chunk * EXT2_EXPORT_CHUNK, end = start + EXT2_EXPORT_CHUNK;
+	export_run runs[EXT2_EXPORT_CHUNK];
+	export_chunk header;
+	uint index, i, head;
+	uLongf length;
+	ubyte *raw;
+
+	if (end > e->img->sb->s_blocks_count) {
+		end = e->img->sb->s_blocks_count;
+	}
+	memset(&header, 0, sizeof(header));
+	for (index = start; index < end; index++) {
+		if (!is_exported(e->img, index)) {
+			continue;
+		}
+		if (header.runs > 0 && runs[header.runs - 1].start
+								+ runs[header.runs - 1].count == index) {
+			runs[header.runs - 1].count++;
+		} else {
+			runs[header.runs].start = index;
+			runs[header.runs++].count = 1;
+		}
+		header.raw_length += e->img->block_size;
+	}
+	s->len = 0;
+	if (header.runs == 0) {
+		return true; /* Nothing to write */
+	}
+
+	/* Lay out the header and runs, with room for raw or compressed data */
+	head = sizeof(header) + header.runs * sizeof(export_run);
+	length = (e->compress ? compressBound(header.raw_length) : header.raw_length);
+	if ((s->buf = malloc(head + length + header.raw_length)) == NULL) {
+		perror("malloc");
+		return false;
+	}
+	memcpy(s->buf + sizeof(header), runs, header.runs * sizeof(export_run));
+	raw = s->buf + head + (e->compress ? length : 0);
+	for (i = 0; i < header.runs; i++) {
+		memcpy(raw, get_block(e->img, runs[i].start), (size_t)runs[i].count << e->img->block_bits);
+		raw += (size_t)runs[i].count << e->img->block_bits;
+	}
+	raw -= header.raw_length;
+	header.length = header.raw_length;
+	if (e->compress && compress2(s->buf + head, &length, raw, header.raw_length,
+								Z_BEST_SPEED) == Z_OK && length < header.raw_length) {
+		header.length = length;
+	} else if (raw != s->buf + head) {
+		memmove(s->buf + head, raw, header.raw_length);
+	}
+	memcpy(s->buf, &header, sizeof(header));
+	s->len = head + header.length;
+	return true;
+}
+
+/* Packs chunks until none are left, staying at most a window ahead of
+ * the chunks written.
+ */
+static void *pack_chunks(void *arg) {
+	export *e = arg;
+	uint chunk;
+	slot *s;
+	bool ok;
+
+	pthread_mutex_lock(&e->lock);
+	while (!e->failed && (chunk = e->next) < e->chunks) {
+		if (chunk >= e->written + e->window) {
+			pthread_cond_wait(&e->cond, &e->lock);
+			continue;
+		}
+		e->next++;
+		s = &e->slots[chunk % e->window];
+		pthread_mutex_unlock(&e->lock);
+		ok = pack_chunk(e, chunk, s);
+		pthread_mutex_lock(&e->lock);
+		s->done = true;
+		e->failed |= !ok;
+		pthread_cond_broadcast(&e->cond);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/* Writes chunks in order as they are packed. Return true on success. */
+static bool write_chunks(export *e) {
+	slot *s;
+	bool ok = true;
+
+	pthread_mutex_lock(&e->lock);
+	while (ok && e->written < e->chunks) {
+		s = &e->slots[e->written % e->window];
+		if (e->failed) {
+			ok = false;
+		} else if (!s->done) {
+			pthread_cond_wait(&e->cond, &e->lock);
+		} else {
+			pthread_mutex_unlock(&e->lock);
+			ok = (s->len == 0 || write_all(e->fd, s->buf, s->len));
+			free(s->buf);
+			s->buf = NULL;
+			pthread_mutex_lock(&e->lock);
+			s->done = false;
+			e->written++;
+			pthread_cond_broadcast(&e->cond);
+		}
+	}
+	/* Stop the packers if writing failed */
+	e->failed |= !ok;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+	return ok;
+}
+
+/* Writes an export of the image to e->fd, packing chunks on num_threads
+ * threads while this one writes them out. Return true on success.
+ */
+static bool export_image(export *e, uint num_threads) {
+	export_header header;
+	export_chunk end;
+	pthread_t *threads;
+	uint i;
+	bool ok;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, EXT2_EXPORT_MAGIC, sizeof(header.magic));
+	header.block_size = e->img->block_size;
+	header.blocks = e->img->sb->s_blocks_count;
+	header.size = e->img->size;
+	if (!write_all(e->fd, &header, sizeof(header))) {
+		return false;
+	}
+
+	e->chunks = DIV_UP(e->img->sb->s_blocks_count, EXT2_EXPORT_CHUNK);
+	if (num_threads == 0) {
+		num_threads = 1;
+	}
+	e->window = num_threads * EXT2_EXPORT_WINDOW;
+	if ((e->slots = calloc(e->window, sizeof(slot))) == NULL
+			|| (threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		perror("calloc");
+		free(e->slots);
+		return false;
+	}
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, pack_chunks, e) != 0) {
+			break; /* Those started do the rest */
+		}
+	}
+	if (i == 0) {
+		/* No threads, so pack a chunk at a time and write it */
+		e->window = 1;
+		for (ok = true; ok && e->written < e->chunks; e->written++) {
+			ok = pack_chunk(e, e->written, &e->slots[0])
+					&& (e->slots[0].len == 0
+						|| write_all(e->fd, e->slots[0].buf, e->slots[0].len));
+			free(e->slots[0].buf);
+			e->slots[0].buf = NULL;
+		}
+	} else {
+		ok = write_chunks(e);
+	}
+	while (i > 0) {
+		pthread_join(threads[--i], NULL);
+	}
+	for (i = 0; i < e->window; i++) {
+		free(e->slots[i].buf);
+	}
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->lock);
+	free(e->slots);
+	free(threads);
+
+	/* An empty chunk marks the end */
+	memset(&end, 0, sizeof(end));
+	return ok && write_all(e->fd, &end, sizeof(end));
+}
+
+/* Exports the blocks in use on an EXT2 image, so it can be moved and
+ * restored with ext2_import. Free and all zero blocks are left out.
+ * A target of - writes to standard output.
+ * Argument: If -z is provided, compress each chunk with zlib.
+ *			If -j is provided, pack chunks with that many threads.
+ */
+int ext2_export(int argc, char **argv) {
+	export e;
+	char *target;
+	uint num_threads = (uint)sysconf(_SC_NPROCESSORS_ONLN);
+	int arg;
+	bool compress = false, ok;
+
+	/* Check arguments */
+	for (arg = 2; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "-z") == 0) {
+			compress = true;
+		} else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc - 1) {
+			num_threads = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 1) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_export <image> \
+[-z] [-j <threads>] <export file, or - for standard output>\n");
+		return EXIT_FAILURE;
+	}
+	memset(&e, 0, sizeof(e));
+	e.compress = compress;
+	if ((e.img = load_simple_disk(argv[1])) == NULL) {
+		fprintf(stderr, "Failed to load the disk.\n");
+		return EXIT_FAILURE;
+	}
+	target = argv[argc - 1];
+	if (strcmp(target, "-") == 0) {
+		e.fd = STDOUT_FILENO;
+	} else if ((e.fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		unload_disk(e.img, false);
+		return EXIT_FAILURE;
+	}
+
+	ok = export_image(&e, num_threads);
+	if (!ok) {
+		fprintf(stderr, "Failed to export %s\n", argv[1]);
+	}
+
+	/* Cleanup */
+	if (e.fd != STDOUT_FILENO && close(e.fd) < 0) {
+		perror("close");
+		ok = false;
+	}
+	if (!unload_disk(e.img, false)) {
+		fprintf(stderr, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return (ok ? EXIT_SUCCESS : EIO);
+}
+
+int main (int argc, char **argv) {
+	return ext2_export(argc, argv);
+}
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include "ext2_imager.h"
+
+/* One line of an operation script: a command and its arguments,
+ * less the image, parsed once for every image.
+ */
+typedef struct {
+	const command *cmd;
+	uint line;
+	int argc;
+	char *argv[EXT2_FLEET_ARGS];
+} fleet_op;
+
+/* A script being applied to a list of images */
+typedef struct {
+	fleet_op *ops;
+	uint num_ops;
+	char **images;
+	uint num_images;
+	uint next;		/* Next image to work on, taken atomically */
+	int *status;	/* Per image, the exit status of the op that failed */
+	uint *failed;	/* Per image, the op that failed, or num_ops */
+	char **output;	/* Per image, what its commands printed */
+	size_t *output_len;
+} fleet;
+
+/* Reads the lines of a file, or of standard input for -, into a NULL
+ * terminated array of strings without their newlines.
+ * Return NULL on failure.
+ */
+static char **read_lines(char *path, uint *num_lines) {
+	FILE *f = (strcmp(path, "-") == 0 ? stdin : fopen(path, "r"));
+	char **lines = NULL, **bigger, *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	uint size = 0;
+
+	*num_lines = 0;
+	if (f == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+	while ((len = getline(&line, &cap, f)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		if (*num_lines + 1 >= size) {
+			size = (size == 0 ? 64 : size * 2);
+			if ((bigger = realloc(lines, size * sizeof(char *))) == NULL) {
+				perror("realloc");
+				break;
+			}
+			lines = bigger;
+		}
+		if ((lines[(*num_lines)++] = strdup(line)) == NULL) {
+			perror("strdup");
+			(*num_lines)--;
+			break;
+		}
+	}
+	free(line);
+	if (lines != NULL) {
+		lines[*num_lines] = NULL;
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	if (len >= 0) {
+		return NULL; /* Stopped early */
+	}
+	return (lines != NULL ? lines : calloc(1, sizeof(char *)));
+}
+
+/* Parses every line of a script into an op, leaving out blank lines and
+ * those starting with #. Commands are named as the tools are, with or
+ * without the ext2_ in front.
+ * Return false if a line names no known command or has too many words.
+ */
+static bool parse_script(fleet *f, char **lines, uint num_lines) {
+	char name[EXT2_NAME_LEN + 1], *word, *save;
+	fleet_op *op;
+	uint line;
+
+	if ((f->ops = calloc(num_lines + 1, sizeof(fleet_op))) == NULL) {
+		perror("calloc");
+		return false;
+	}
+	for (line = 0; line < num_lines; line++) {
+		op = &(f->ops[f->num_ops]);
+		op->line = line + 1;
+		op->argc = 2; /* The command and the image go first */
+		for (word = strtok_r(lines[line], " \t", &save); word != NULL;
+					word = strtok_r(NULL, " \t", &save)) {
+			if (op->argc == 2 && word[0] == '#') {
+				break; /* A comment */
+			}
+			if (op->argc == EXT2_FLEET_ARGS) {
+				fprintf(stderr, "Line %u has too many arguments\n", op->line);
+				return false;
+			}
+			op->argv[op->argc++] = word;
+		}
+		if (op->argc == 2) {
+			continue; /* Nothing on it */
+		}
+		snprintf(name, sizeof(name), "ext2_%s", op->argv[2]);
+		if ((op->cmd = find_command(op->argv[2])) == NULL
+				&& (op->cmd = find_command(name)) == NULL) {
+			fprintf(stderr, "Line %u: unknown command %s\n", op->line, op->argv[2]);
+			return false;
+		}
+		/* Arguments follow the image, as for the tool */
+		op->argv[0] = (char *)op->cmd->name;
+		memmove(&(op->argv[2]), &(op->argv[3]), (op->argc - 3) * sizeof(char *));
+		op->argc--;
+		f->num_ops++;
+	}
+	return true;
+}
+
+/* Reads the host files that cp ops copy in once, so every image copies
+ * them from memory. Those with -x, -d or -u are left to read the file as
+ * they would, as are files that cannot be read: each image's cp then
+ * fails on its own.
+ */
+static void load_sources(fleet *f) {
+	fleet_op *op;
+	uint i;
+	int arg;
+
+	for (i = 0; i < f->num_ops; i++) {
+		op = &(f->ops[i]);
+		if (op->cmd->run != ext2_cp || op->argc < 4) {
+			continue;
+		}
+		for (arg = 2; arg < op->argc - 2; arg++) {
+			if (strcmp(op->argv[arg], "-x") == 0 || strcmp(op->argv[arg], "-d") == 0
+					|| strcmp(op->argv[arg], "-u") == 0) {
+				break;
+			}
+		}
+		if (arg == op->argc - 2) {
+			load_host_file(op->argv[op->argc - 2]);
+		}
+	}
+}
+
+/* Runs every op of the script on one image, in order, stopping at the
+ * first that fails. Each op gets its own copy of the arguments, as the
+ * commands may change them. What the commands print is kept for the
+ * image, to be printed with how it went.
+ */
+static void run_script(fleet *f, uint n) {
+	char *argv[EXT2_FLEET_ARGS + 1];
+	FILE *out = open_memstream(&(f->output[n]), &(f->output_len[n]));
+	fleet_op *op;
+	uint i;
+	int arg;
+
+	f->failed[n] = f->num_ops;
+	for (i = 0; i < f->num_ops; i++) {
+		op = &(f->ops[i]);
+		argv[0] = (char *)op->cmd->name;
+		argv[1] = f->images[n];
+		for (arg = 2; arg < op->argc; arg++) {
+			if ((argv[arg] = strdup(op->argv[arg])) == NULL) {
+				break;
+			}
+		}
+		argv[arg] = NULL;
+		/* If the output cannot be kept, it goes straight out instead */
+		f->status[n] = (arg < op->argc ? ENOMEM 
+						: op->cmd->run(op->argc, argv, (out != NULL ? out : stdout),
+										(out != NULL ? out : stderr)));
+		while (arg > 2) {
+			free(argv[--arg]);
+		}
+		if (f->status[n] != EXIT_SUCCESS) {
+			f->failed[n] = i;
+			break;
+		}
+	}
+	if (out != NULL) {
+		fclose(out);
+	}
+}
+
+/* Works on images until there are none left. */
+static void *run_images(void *arg) {
+	fleet *f = arg;
+	uint n;
+
+	while ((n = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED)) < f->num_images) {
+		run_script(f, n);
+	}
+	return NULL;
+}
+
+/* Applies the script to every image with num_threads threads, one image
+ * per thread at a time. Return false on failure.
+ */
+static bool run_fleet(fleet *f, uint num_threads) {
+	pthread_t *threads;
+	uint i;
+
+	if (num_threads == 0) {
+		num_threads = 1;
+	}
+	if (num_threads > f->num_images) {
+		num_threads = f->num_images;
+	}
+	f->status = calloc(f->num_images, sizeof(int));
+	f->failed = calloc(f->num_images, sizeof(uint));
+	f->output = calloc(f->num_images, sizeof(char *));
+	f->output_len = calloc(f->num_images, sizeof(size_t));
+	if (f->status == NULL || f->failed == NULL 
+			|| f->output == NULL || f->output_len == NULL
+			|| (threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		perror("calloc");
+		return false;
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, run_images, f) != 0) {
+			break; /* Those started do the rest */
+		}
+	}
+	if (i == 0) {
+		run_images(f);
+	}
+	while (i > 0) {
+		pthread_join(threads[--i], NULL);
+	}
+	free(threads);
+	return true;
+}
+
+/* Applies an operation script to a list of EXT2 images, with a pool of
+ * threads working on one image each at a time. Each line of the script
+ * is a command as it would be run on one image, less the image:
+ *		mkdir /etc/app
+ *		cp app.conf /etc/app
+ *		rm_bonus -r /var/cache
+ * The script is parsed once, and host files it copies in are read once
+ * into memory that every image copies from. Prints how each image went, in
+ * the order listed, each followed by what its commands printed.
+ *	If any image failed, return 1.
+ *	If the script or list cannot be read, return EINVAL.
+ * Argument: If -j is provided, work on that many images at once.
+ */
+int main (int argc, char **argv) {
+	fleet f;
+	char **script, **images;
+	uint num_lines, n, failed = 0;
+	uint num_threads = (uint)sysconf(_SC_NPROCESSORS_ONLN);
+	fleet_op *op;
+	int arg;
+
+	/* Check arguments */
+	for (arg = 1; arg < argc - 2; arg++) {
+		if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc - 2) {
+			num_threads = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 2) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_fleet \
+[-j <threads>] <operation script> <image list, or - for stdin>\n");
+		return EXIT_FAILURE;
+	}
+	memset(&f, 0, sizeof(f));
+	if ((script = read_lines(argv[argc - 2], &num_lines)) == NULL
+			|| !parse_script(&f, script, num_lines)) {
+		fprintf(stderr, "Failed to read the script %s.\n", argv[argc - 2]);
+		return EINVAL;
+	}
+	if ((images = read_lines(argv[argc - 1], &n)) == NULL) {
+		fprintf(stderr, "Failed to read the image list %s.\n", argv[argc - 1]);
+		return EINVAL;
+	}
+	/* Leave out blank lines */
+	f.images = images;
+	for (f.num_images = 0; n > 0; n--, images++) {
+		if (strlen(*images) > 0) {
+			f.images[f.num_images++] = *images;
+		}
+	}
+
+	load_sources(&f);
+	if (!run_fleet(&f, num_threads)) {
+		return EXIT_FAILURE;
+	}
+	free_host_files();
+	for (n = 0; n < f.num_images; n++) {
+		if (f.failed[n] == f.num_ops) {
+			printf("ok %s\n", f.images[n]);
+		} else {
+			op = &(f.ops[f.failed[n]]);
+			printf("FAILED %s: line %u: %s exited with %d (%s)\n", f.images[n],
+						op->line, op->cmd->name, f.status[n],
+						(f.status[n] == EXIT_FAILURE ? "error" : strerror(f.status[n])));
+			failed++;
+		}
+		/* Then what its commands printed */
+		if (f.output[n] != NULL) {
+			fwrite(f.output[n], 1, f.output_len[n], stdout);
+			free(f.output[n]);
+		}
+	}
+	printf("%u of %u images updated\n", f.num_images - failed, f.num_images);
+	return (failed > 0 ? 1 : EXIT_SUCCESS);
+}
\ No newline at end of file
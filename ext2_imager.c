@@ -1,16 +1,21 @@
+#define _GNU_SOURCE /* For open file description locks, copy_file_range */
 #include "ext2_imager.h"
+#include <sys/file.h>
 
 /* Constants */
 const char DELIMITER[2] = "/";
 const uint TYPES[EXT2_NUM_TYPES] = {EXT2_NUM_SINGLE, EXT2_NUM_DOUBLE,
 								EXT2_NUM_TRIPLE, EXT2_NUM_QUAD};
 
-/* Constant variables */
-ubyte *disk = NULL;
-super_block *sb = NULL;
-group_desc *gd = NULL;
-int fd = -1;
-uint curr_time = -1;
+/* Disks kept mapped between loads, when retaining */
+image *retained[EXT2_MAX_RETAINED];
+uint num_retained = 0;
+bool retaining = false;
+pthread_mutex_t retained_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Host files read once, see load_host_file() */
+host_file *host_files = NULL;
+uint num_host_files = 0;
 
 /* Constant methods */				
 
@@ -28,245 +33,1403 @@ static ubyte to_dir_type(ushort type) {
 	}
 }
 
-/* Opens the disk image file and maps it into memory.
- * Also initializes the superblock and group descriptors.
+/* Frees an inode summary, along with every array in it. */
+static void free_inode_summary(inode_summary *s) {
+	if (s != NULL) {
+		free(s->live);
+		free(s->mode);
+		free(s->size);
+		free(s->links);
+		free(s->first_block);
+		free(s);
+	}
+}
+
+/* Reads or writes all of len bytes at off, however many calls it takes.
+ * Return true on success.
+ */
+static bool transfer_at(int fd, void *buf, size_t len, off_t off, bool write) {
+	ssize_t n;
+	
+	while (len > 0) {
+		n = (write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n == 0) {
+				errno = EIO;
+			}
+			return false;
+		}
+		buf = (ubyte *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* Copies the parts of the first size bytes of src holding data to the
+ * same offsets in dest, with copy_file_range() so the filesystem can
+ * share extents, or by hand where it can't. Holes are left as they are.
+ * Return true on success.
+ */
+bool copy_file_data(int src, int dest, off_t size) {
+	ubyte *buf;
+	loff_t in, out;
+	off_t data, hole = 0;
+	ssize_t copied;
+	size_t len;
+	bool ok = true;
+	
+	while (ok && hole < size) {
+		if ((data = lseek(src, hole, SEEK_DATA)) < 0) {
+			if (errno != ENXIO) {
+				data = hole; /* No hole support, so all data */
+			} else {
+				break; /* The rest is a hole */
+			}
+		}
+		if (data >= size) {
+			break;
+		}
+		if ((hole = lseek(src, data, SEEK_HOLE)) < 0 || hole > size) {
+			hole = size;
+		}
+		in = out = data;
+		for (len = hole - data; len > 0; len -= copied) {
+			if ((copied = copy_file_range(src, &in, dest, &out, len, 0)) <= 0) {
+				if (copied < 0 && errno == EINTR) {
+					copied = 0;
+					continue;
+				}
+				break; /* Not supported here, copy by hand */
+			}
+		}
+		if (len > 0) {
+			ok = ((buf = malloc(len)) != NULL && transfer_at(src, buf, len, in, false)
+					&& transfer_at(dest, buf, len, out, true));
+			free(buf);
+		}
+	}
+	return ok;
+}
+
+/* Reads the header of an overlay from the end of the open file fd,
+ * of file_size bytes. Return false if the file is not an overlay.
+ */
+static bool read_overlay_header(int fd, off_t file_size, overlay_header *h) {
+	return file_size > EXT2_OVERLAY_HEADER 
+			&& transfer_at(fd, h, sizeof(overlay_header), 
+							file_size - EXT2_OVERLAY_HEADER, false)
+			&& memcmp(h->magic, EXT2_OVERLAY_MAGIC, sizeof(h->magic)) == 0
+			&& h->size == (unsigned long long)(file_size - EXT2_OVERLAY_HEADER)
+			&& memchr(h->base, '\0', sizeof(h->base)) != NULL;
+}
+
+/* Reads the superblock of the image open as fd.
+ * Return true on success.
+ */
+static bool read_super_block(int fd, super_block *sb) {
+	return transfer_at(fd, sb, sizeof(super_block), EXT2_SB_OFFSET, false);
+}
+
+/* Opens the base image of an overlay, checking it has not changed since
+ * the overlay was made, since the overlay only holds what differs. That
+ * is told by the write time and mount count in its superblock, which
+ * reads leave alone, unlike the file's mtime, which access times move.
+ * Return the file descriptor, or -1 with errno set.
+ */
+static int open_overlay_base(overlay_header *h, int flags) {
+	super_block sb;
+	struct stat st;
+	int fd;
+	
+	if ((fd = open(h->base, flags)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (unsigned long long)st.st_size != h->size
+			|| !read_super_block(fd, &sb) 
+			|| sb.s_wtime != h->wtime || sb.s_mnt_count != h->writes) {
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	return fd;
+}
+
+/* Maps an overlay: its base image privately, so changes stay in memory,
+ * with the blocks already changed read in from the overlay on top.
+ * Return the mapping, or MAP_FAILED with errno set.
+ */
+static ubyte *map_overlay(int fd, overlay_header *h) {
+	ubyte *disk;
+	off_t data, hole = 0, end = (off_t)h->size;
+	int base;
+	
+	if ((base = open_overlay_base(h, O_RDONLY)) < 0) {
+		return MAP_FAILED;
+	}
+	disk = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, base, 0);
+	close(base);
+	while (disk != MAP_FAILED && hole < end 
+			&& (data = lseek(fd, hole, SEEK_DATA)) >= 0 && data < end) {
+		if ((hole = lseek(fd, data, SEEK_HOLE)) < 0 || hole > end) {
+			hole = end;
+		}
+		if (!transfer_at(fd, disk + data, hole - data, data, false)) {
+			munmap(disk, h->size);
+			disk = MAP_FAILED;
+		}
+	}
+	return disk;
+}
+
+/* Writes the pages of an overlay changed in memory out to the overlay.
+ * They are found in /proc/self/pagemap: private pages that were written
+ * to are no longer backed by the base image, so only they are written,
+ * in runs, however big the image is.
+ * Return true on success.
+ */
+static bool flush_overlay(image *img) {
+	unsigned long long entries[EXT2_OVERLAY_PAGEMAP];
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), pages = DIV_UP(img->size, page);
+	size_t first, n, k, start, end;
+	bool ok = true;
+	int fd;
+	
+	if ((fd = open("/proc/self/pagemap", O_RDONLY)) < 0) {
+		return false;
+	}
+	for (first = 0; ok && first < pages; first += n) {
+		n = (pages - first < EXT2_OVERLAY_PAGEMAP ? pages - first : EXT2_OVERLAY_PAGEMAP);
+		if (!transfer_at(fd, entries, n * sizeof(unsigned long long),
+					(off_t)(((unsigned long)img->disk / page + first) 
+								* sizeof(unsigned long long)), false)) {
+			ok = false;
+			break;
+		}
+		for (k = 0; ok && k < n; k++) {
+			if (!IS_PAGE_CHANGED(entries[k])) {
+				continue;
+			}
+			for (start = k; k + 1 < n && IS_PAGE_CHANGED(entries[k + 1]); k++);
+			start = (first + start) * page;
+			end = (first + k + 1) * page;
+			if (end > img->size) {
+				end = img->size;
+			}
+			ok = transfer_at(img->fd, img->disk + start, end - start, start, true);
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+/* Unmaps and closes a disk, and frees its handle.
  * Return true on success.
  */
-bool load_simple_disk(char *file) {
-	if ((fd = open(file, O_RDWR)) < 0) {
-		perror("open");
+static bool free_disk(image *img) {
+	bool ret = true;
+	
+	pthread_mutex_destroy(&(img->links_lock));
+	pthread_mutex_destroy(&(img->dups_lock));
+	pthread_mutex_destroy(&(img->summary_lock));
+	free(img->locks);
+	free(img->dups);
+	free(img->dup_buckets);
+	free_inode_summary(img->summary);
+	if (img->overlay && !flush_overlay(img)) {
+		print_error(img->err, "flush_overlay");
+		ret = false;
+	}
+    if (munmap(img->disk, img->size) < 0) {
+		print_error(img->err, "munmap");
+		ret = false;
+    }
+    if (close(img->fd) < 0) {
+		print_error(img->err, "close");
+		ret = false;
+    }
+	free(img);
+	return ret;
+}
+
+/* Gets whether a retained disk still has the size and layout it was
+ * mapped with, given the image file's st. One made again in place, as by
+ * ext2_mkfs, may not, and its handle would then point past the mapping.
+ */
+static bool is_disk_unchanged(image *img, struct stat *st) {
+	return st->st_size == img->file_size 
+			&& img->sb->s_magic == EXT2_SUPER_MAGIC
+			&& img->sb->s_log_block_size == img->block_bits - EXT2_MIN_BLOCK_BITS
+			&& img->sb->s_blocks_count == img->blocks_count
+			&& img->sb->s_inodes_count == img->inodes_count;
+}
+
+/* Keeps disks mapped after unload_disk(), so that loading the same
+ * image again returns the same handle. Used by long-running processes
+ * like ext2_imagerd. Turning it off releases every retained disk.
+ */
+void retain_disks(bool retain) {
+	uint i;
+	
+	pthread_mutex_lock(&retained_lock);
+	if (!retain) {
+		for (i = 0; i < num_retained; i++) {
+			free_disk(retained[i]);
+		}
+		num_retained = 0;
+	}
+	retaining = retain;
+	pthread_mutex_unlock(&retained_lock);
+}
+
+/* Reads the regular host file at path into memory once, so commands
+ * copying it onto many images find it with find_host_file() instead of
+ * reading it again for each. Used by ext2_fleet, before the threads that
+ * copy from it start, as it is not locked.
+ * Return false on failure, with errno set.
+ */
+bool load_host_file(char *path) {
+	host_file *bigger, *h;
+	struct stat st;
+	int fd;
+	bool ret;
+	
+	if (find_host_file(path) != NULL) {
+		return true;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
 		return false;
 	}
-    disk = mmap(NULL, EXT2_SIMPLE * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE, 
-								MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-		perror("mmap");
+	if (fstat(fd, &st) != 0) {
+		close(fd);
 		return false;
+	}
+	if (!S_ISREG(st.st_mode) || (unsigned long long)st.st_size > UINT_MAX) {
+		errno = (S_ISREG(st.st_mode) ? EFBIG : EINVAL);
+		close(fd);
+		return false;
+	}
+	if ((bigger = realloc(host_files, (num_host_files + 1) * sizeof(host_file))) == NULL) {
+		close(fd);
+		return false;
+	}
+	host_files = bigger;
+	h = &host_files[num_host_files];
+	h->len = st.st_size;
+	h->path = strdup(path);
+	h->data = malloc(h->len > 0 ? h->len : 1);
+	ret = (h->path != NULL && h->data != NULL && transfer_at(fd, h->data, h->len, 0, false));
+	close(fd);
+	if (!ret) {
+		free(h->path);
+		free(h->data);
+		return false;
+	}
+	num_host_files++;
+	return true;
+}
+
+/* Finds a host file read by load_host_file(). Return NULL if none. */
+const host_file *find_host_file(char *path) {
+	uint i;
+	
+	for (i = 0; i < num_host_files; i++) {
+		if (strcmp(host_files[i].path, path) == 0) {
+			return &host_files[i];
+		}
+	}
+	return NULL;
+}
+
+/* Frees every host file read by load_host_file(). */
+void free_host_files(void) {
+	uint i;
+	
+	for (i = 0; i < num_host_files; i++) {
+		free(host_files[i].path);
+		free(host_files[i].data);
+	}
+	free(host_files);
+	host_files = NULL;
+	num_host_files = 0;
+}
+
+/* Opens the disk image file and maps it into memory, as load_disk()
+ * does, printing to stdout and stderr.
+ * Return the handle for the disk, or NULL on failure.
+ */
+image *load_simple_disk(char *file) {
+	return load_disk(file, stdout, stderr);
+}
+
+/* Opens the disk image file and maps it into memory.
+ * Also initializes the superblock and group descriptors. An overlay
+ * made by create_overlay() is opened in place of its base image. What
+ * the library prints about the disk, from listings to errors, goes to
+ * out and err, until it is unloaded.
+ * Return the handle for the disk, or NULL on failure.
+ */
+image *load_disk(char *file, FILE *out, FILE *err) {
+	TRACE_SPAN(EXT2_TRACE_LOAD);
+	image *img;
+	overlay_header header;
+	struct stat st;
+	uint i;
+	
+	pthread_mutex_lock(&retained_lock);
+	if (retaining) {
+		if (stat(file, &st) < 0) {
+			print_error(err, "stat");
+			pthread_mutex_unlock(&retained_lock);
+			return NULL;
+		}
+		for (i = 0; i < num_retained; i++) {
+			img = retained[i];
+			if (img->dev != st.st_dev || img->ino != st.st_ino) {
+				continue;
+			}
+			if (is_disk_unchanged(img, &st)) {
+				/* Others may have changed it since, so forget what was found */
+				clear_link_cache(img);
+				free_inode_summary(img->summary);
+				img->summary = NULL;
+				img->out = out;
+				img->err = err;
+				img->curr_time = (uint)time(NULL);
+				pthread_mutex_unlock(&retained_lock);
+				return img;
+			}
+			/* Made again in place since, so map it again */
+			free_disk(img);
+			memmove(retained + i, retained + i + 1, 
+						(num_retained - i - 1) * sizeof(image *));
+			num_retained--;
+			break;
+		}
+	}
+	
+	if ((img = calloc(1, sizeof(image))) == NULL) {
+		print_error(err, "calloc");
+		pthread_mutex_unlock(&retained_lock);
+		return NULL;
+	}
+	img->out = out;
+	img->err = err;
+	if ((img->fd = open(file, O_RDWR)) < 0 || fstat(img->fd, &st) < 0) {
+		print_error(err, "open");
+		if (img->fd >= 0) {
+			close(img->fd);
+		}
+		free(img);
+		pthread_mutex_unlock(&retained_lock);
+		return NULL;
+	}
+	/* Map the whole file, sparse parts included */
+	img->size = st.st_size;
+	if (read_overlay_header(img->fd, st.st_size, &header)) {
+		/* Used by one process at a time, since its changes are private */
+		img->overlay = true;
+		img->size = header.size;
+		img->disk = (flock(img->fd, LOCK_EX) < 0 ? MAP_FAILED 
+						: map_overlay(img->fd, &header));
+	} else if (img->size < EXT2_SB_OFFSET + EXT2_SB_SIZE) {
+		img->disk = MAP_FAILED;
+		errno = EINVAL;
+	} else {
+		img->disk = mmap(NULL, img->size, PROT_READ | PROT_WRITE, 
+								MAP_SHARED, img->fd, 0);
+	}
+    if(img->disk == MAP_FAILED) {
+		print_error(err, "mmap");
+		close(img->fd);
+		free(img);
+		pthread_mutex_unlock(&retained_lock);
+		return NULL;
     }
 	
-	sb = (super_block *)(disk + EXT2_SB_OFFSET);
-	gd = (group_desc *)(disk + EXT2_SB_OFFSET + EXT2_SB_SIZE);
+	img->sb = (super_block *)(img->disk + EXT2_SB_OFFSET);
+	if (img->sb->s_log_block_size <= EXT2_MAX_LOG_BLOCK_SIZE) {
+		img->block_bits = EXT2_MIN_BLOCK_BITS + img->sb->s_log_block_size;
+		img->block_size = 1U << img->block_bits;
+		img->ptr_bits = img->block_bits - 2; /* 4 byte pointers */
+		img->ptrs_per_block = 1U << img->ptr_bits;
+	}
+	if (img->sb->s_magic != EXT2_SUPER_MAGIC || img->block_size == 0
+			|| img->sb->s_blocks_per_group == 0 || img->sb->s_inodes_per_group == 0
+			|| ((size_t)img->sb->s_blocks_count << img->block_bits) > img->size) {
+		fprintf(err, "%s is not an EXT2 image with %d to %d byte blocks\n", 
+					file, EXT2_BLOCK_SIZE, EXT2_MAX_BLOCK_SIZE);
+		free_disk(img);
+		pthread_mutex_unlock(&retained_lock);
+		return NULL;
+	}
+	/* Group descriptors follow the block holding the superblock */
+	img->gd = (group_desc *)get_block(img, img->sb->s_first_data_block + 1);
+	img->groups = DIV_UP(img->sb->s_blocks_count - img->sb->s_first_data_block, 
+							img->sb->s_blocks_per_group);
+	img->dev = st.st_dev;
+	img->ino = st.st_ino;
+	img->file_size = st.st_size;
+	img->blocks_count = img->sb->s_blocks_count;
+	img->inodes_count = img->sb->s_inodes_count;
+	img->curr_time = (uint)time(NULL);
+	pthread_mutex_init(&(img->links_lock), NULL);
+	pthread_mutex_init(&(img->dups_lock), NULL);
+	pthread_mutex_init(&(img->summary_lock), NULL);
+	
+	/* One lock word per inode, for directories being read or changed */
+	if ((img->locks = calloc(img->sb->s_inodes_count + 1, sizeof(uint))) == NULL) {
+		print_error(err, "calloc");
+		free_disk(img);
+		pthread_mutex_unlock(&retained_lock);
+		return NULL;
+	}
+	
+	if (retaining) {
+		if (num_retained == EXT2_MAX_RETAINED) {
+			/* Make room by dropping the oldest, which must not be in use */
+			free_disk(retained[0]);
+			memmove(retained, retained + 1, 
+						(EXT2_MAX_RETAINED - 1) * sizeof(image *));
+			num_retained--;
+		}
+		img->retained = true;
+		retained[num_retained++] = img;
+	}
+	pthread_mutex_unlock(&retained_lock);
+	return img;
+}
+
+/* Makes an overlay of the image base at path: a sparse file the size of
+ * the image, with a header after it, that the tools open in place of the
+ * image. Blocks changed through it are kept in it and the base is left
+ * alone, until commit_overlay() or discard_overlay(). Takes no space or
+ * time beyond the header, however big the image is.
+ * Return false on failure, with errno set.
+ */
+bool create_overlay(char *base, char *path) {
+	overlay_header header, other;
+	super_block sb;
+	struct stat st;
+	int fd;
+	bool nested, read;
+	
+	memset(&header, 0, sizeof(header));
+	if (realpath(base, header.base) == NULL || (fd = open(header.base, O_RDONLY)) < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	nested = read_overlay_header(fd, st.st_size, &other);
+	read = read_super_block(fd, &sb);
+	close(fd);
+	if (!S_ISREG(st.st_mode) || nested || !read) {
+		/* Overlays of overlays are not supported */
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(header.magic, EXT2_OVERLAY_MAGIC, sizeof(header.magic));
+	header.size = st.st_size;
+	header.wtime = sb.s_wtime;
+	header.writes = sb.s_mnt_count;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		return false;
+	}
+	if (ftruncate(fd, (off_t)header.size) < 0 
+			|| !transfer_at(fd, &header, sizeof(header), (off_t)header.size, true)) {
+		close(fd);
+		unlink(path);
+		return false;
+	}
+	return close(fd) == 0;
+}
+
+/* Opens the overlay at path and locks it, so no one has it loaded.
+ * Return the file descriptor, or -1 with errno set: EINVAL if it is
+ * not an overlay, EBUSY if it is in use.
+ */
+static int open_overlay(char *path, overlay_header *h) {
+	struct stat st;
+	int fd;
 	
-	curr_time = (uint)time(NULL);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		close(fd);
+		errno = (errno == EWOULDBLOCK ? EBUSY : errno);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !read_overlay_header(fd, st.st_size, h)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
+
+/* Writes the blocks changed in the overlay at path into its base image,
+ * copying only those, then removes the overlay.
+ * Return false on failure, with errno set: EINVAL if it is not an
+ * overlay, EBUSY if it is in use, ESTALE if its base changed since.
+ */
+bool commit_overlay(char *path) {
+	overlay_header header;
+	int fd, base;
+	bool ok;
 	
-	return true;
+	if ((fd = open_overlay(path, &header)) < 0) {
+		return false;
+	}
+	if ((base = open_overlay_base(&header, O_RDWR)) < 0) {
+		close(fd);
+		return false;
+	}
+	ok = copy_file_data(fd, base, (off_t)header.size) && fsync(base) == 0;
+	close(base);
+	if (ok) {
+		ok = (unlink(path) == 0);
+	}
+	close(fd);
+	return ok;
+}
+
+/* Removes the overlay at path, dropping its changes.
+ * Return false on failure, with errno set as for commit_overlay().
+ */
+bool discard_overlay(char *path) {
+	overlay_header header;
+	int fd;
+	bool ok;
+	
+	if ((fd = open_overlay(path, &header)) < 0) {
+		return false;
+	}
+	ok = (unlink(path) == 0);
+	close(fd);
+	return ok;
 }
 
 /* Return true if we have space for inodes and blocks. */
-bool has_space(uint inodes, uint blocks) {
-	assert (disk != NULL);
+bool has_space(image *img, uint inodes, uint blocks) {
+	assert (img->disk != NULL);
 	
-	return gd->bg_free_blocks_count >= blocks && 
-				gd->bg_free_inodes_count >= inodes;
+	return img->sb->s_free_blocks_count >= blocks && 
+				img->sb->s_free_inodes_count >= inodes;
 }
 
 /* Returns a pointer to the block specified by index. */
-ubyte *get_block(uint index) {
-	assert (disk != NULL);
+ubyte *get_block(image *img, uint index) {
+	assert (img->disk != NULL);
+	
+	return (img->disk + ((size_t)index << img->block_bits));
+}
+
+/* Atomically sets or clears a bit in a bitmap, so that threads
+ * changing other bits of the same byte don't undo each other.
+ * Return whether the bit was set before.
+ */
+static bool set_bit(ubyte *bitmap, uint bit, bool set) {
+	ubyte mask = 1 << (bit % BITS_PER_BYTE);
+	ubyte old;
 	
-	return (disk + (index * EXT2_BLOCK_SIZE));
+	if (set) {
+		old = __atomic_fetch_or(&bitmap[bit / BITS_PER_BYTE], mask, __ATOMIC_ACQ_REL);
+	} else {
+		old = __atomic_fetch_and(&bitmap[bit / BITS_PER_BYTE], ~mask, __ATOMIC_ACQ_REL);
+	}
+	return (old & mask) != 0;
+}
+
+/* Finds a clear bit from bit start up to count in a bitmap, and sets it.
+ * Full words are skipped without looking at their bits.
+ * Return the bit plus 1, or 0 if all are set.
+ */
+static uint claim_free_bit(ubyte *bitmap, uint start, uint count) {
+	uint bit, word;
+	
+	for (bit = start; bit < count; bit++) {
+		if (bit % 32 == 0 && bit + 32 <= count) {
+			memcpy(&word, bitmap + bit / BITS_PER_BYTE, sizeof(uint));
+			if (word == UINT_MAX) {
+				bit += 31;
+				continue;
+			}
+		}
+		/* Another thread may take it first, then keep looking */
+		if ((bitmap[bit / BITS_PER_BYTE] & (1 << (bit % BITS_PER_BYTE))) == 0
+				&& !set_bit(bitmap, bit, true)) {
+			return bit + 1;
+		}
+	}
+	return 0;
+}
+
+/* Adds delta to one of the 16-bit or 32-bit counters of the disk. */
+#define ADD_COUNT(c, delta)	__atomic_add_fetch(&(c), (delta), __ATOMIC_RELAXED)
+
+/* Gets the descriptor of the group holding a block. */
+static group_desc *get_block_group(image *img, uint index) {
+	return img->gd + (index - img->sb->s_first_data_block) / img->sb->s_blocks_per_group;
+}
+
+/* Gets the descriptor of the group holding an inode. */
+static group_desc *get_inode_group(image *img, uint index) {
+	return img->gd + (index - 1) / img->sb->s_inodes_per_group;
 }
 
 /* Gets whether a block is used or not.
  * Return true if it is (in the bitmap), false otherwise.
  */
-bool get_block_bitmap(uint index) {
+bool get_block_bitmap(image *img, uint index) {
 	ubyte *bitmap;
 	
 	/* Make sure initialized and correct block index */
-	assert(disk != NULL && index > 0 && index <= sb->s_blocks_count);
+	assert(img->disk != NULL && index >= img->sb->s_first_data_block
+			&& index < img->sb->s_blocks_count);
 	
-	bitmap = get_block(gd->bg_block_bitmap);
-	index--; /* Starts from 1 */
+	bitmap = get_block(img, get_block_group(img, index)->bg_block_bitmap);
+	/* Bits start from the first data block of the group */
+	index = (index - img->sb->s_first_data_block) % img->sb->s_blocks_per_group;
 	return (bitmap[index / BITS_PER_BYTE] & (1 << (index % BITS_PER_BYTE))) != 0;
 }
 
 /* Sets whether a block is used or not, in the bitmap. */
-void set_block_bitmap(uint index, bool set) {
+void set_block_bitmap(image *img, uint index, bool set) {
 	ubyte *bitmap;
 	
 	/* Make sure initialized and correct block index */
-	assert(disk != NULL && index > 0 && index <= sb->s_blocks_count);
+	assert(img->disk != NULL && index >= img->sb->s_first_data_block
+			&& index < img->sb->s_blocks_count);
 	
-	bitmap = get_block(gd->bg_block_bitmap);
-	index--; /* Starts from 1 */
-	if (set) {
-		bitmap[index / BITS_PER_BYTE] |= (1 << (index % BITS_PER_BYTE));
-	} else {
-		bitmap[index / BITS_PER_BYTE] &= ~(1 << (index % BITS_PER_BYTE));
-	}
+	bitmap = get_block(img, get_block_group(img, index)->bg_block_bitmap);
+	set_bit(bitmap, (index - img->sb->s_first_data_block) 
+							% img->sb->s_blocks_per_group, set);
 }
 
 /* Returns a pointer to the valid block specified by index. */
-ubyte *get_valid_block(uint index) {
-	assert (get_block_bitmap(index));
+ubyte *get_valid_block(image *img, uint index) {
+	assert (get_block_bitmap(img, index));
 	
-	return get_block(index);
+	return get_block(img, index);
 }
 
 /* Gets whether a inode is used or not.
  * Return true if it is (in the bitmap), false otherwise.
  */
-bool get_inode_bitmap(uint index) {
+bool get_inode_bitmap(image *img, uint index) {
 	ubyte *bitmap;
 	
 	/* Make sure initialized and correct inode index */
-	assert(disk != NULL && index > 0 && index <= sb->s_inodes_count);
+	assert(img->disk != NULL && index > 0 && index <= img->sb->s_inodes_count);
 	
-	bitmap = get_block(gd->bg_inode_bitmap);
-	index--;
+	bitmap = get_block(img, get_inode_group(img, index)->bg_inode_bitmap);
+	index = (index - 1) % img->sb->s_inodes_per_group;
 	return (bitmap[index / BITS_PER_BYTE] & (1 << (index % BITS_PER_BYTE))) != 0;
 }
 
 /* Sets whether a inode is used or not, in the bitmap. */
-void set_inode_bitmap(uint index, bool set) {
+void set_inode_bitmap(image *img, uint index, bool set) {
 	ubyte *bitmap;
 	
 	/* Make sure initialized and correct inode index */
-	assert(disk != NULL && index > 0 && index <= sb->s_inodes_count);
+	assert(img->disk != NULL && index > 0 && index <= img->sb->s_inodes_count);
 	
-	bitmap = get_block(gd->bg_inode_bitmap);
-	index--;
-	if (set) {
-		bitmap[index / BITS_PER_BYTE] |= (1 << (index % BITS_PER_BYTE));
-	} else {
-		bitmap[index / BITS_PER_BYTE] &= ~(1 << (index % BITS_PER_BYTE));
-	}
+	bitmap = get_block(img, get_inode_group(img, index)->bg_inode_bitmap);
+	set_bit(bitmap, (index - 1) % img->sb->s_inodes_per_group, set);
 }
 
-/* Finds an unused block index.
+/* Finds an unused block index and marks it used in the bitmap, so that
+ * no other thread can take it. initialize_block() then sets it up.
+ * The first free block from goal onwards is taken, moving on through
+ * the following groups and wrapping around, so that blocks allocated
+ * one after the other end up next to each other.
  * Return 0 if none exist.
  */
-uint find_free_block() {
-	uint i;
+uint find_free_block(image *img, uint goal) {
+	uint n, g, start, bit, first, count;
 	
-	if (!has_space(0, 1)) {
+	if (!has_space(img, 0, 1)) {
 		return 0;
 	}
-	
-	for (i = 1; i <= sb->s_blocks_count; i++) {
-		if (!get_block_bitmap(i)) {
-			return i;
+	if (goal < img->sb->s_first_data_block || goal >= img->sb->s_blocks_count) {
+		goal = img->sb->s_first_data_block;
+	}
+	start = (goal - img->sb->s_first_data_block) % img->sb->s_blocks_per_group;
+	/* Back in the goal's group last, for the blocks before the goal */
+	for (n = 0; n <= img->groups; n++, start = 0) {
+		g = (get_block_group(img, goal) - img->gd + n) % img->groups;
+		if (img->gd[g].bg_free_blocks_count == 0) {
+			continue;
+		}
+		/* The last group may be cut short */
+		first = img->sb->s_first_data_block + g * img->sb->s_blocks_per_group;
+		count = img->sb->s_blocks_count - first;
+		if (count > img->sb->s_blocks_per_group) {
+			count = img->sb->s_blocks_per_group;
+		}
+		if ((bit = claim_free_bit(get_block(img, img->gd[g].bg_block_bitmap), 
+									start, count)) != 0) {
+			return first + bit - 1;
 		}
 	}
 	return 0;
 }
 
-/* Initializes or uninitializes a block for an inode. */
-void initialize_block(uint index, inode *i, bool init) {
-	ubyte *ptr = get_block(index);
-	
-	/* Make sure it was properly set */
-	assert(init != get_block_bitmap(index));
-	
-	memset(ptr, 0, EXT2_BLOCK_SIZE);
-	
-	gd->bg_free_blocks_count += (init ? -1 : 1);
-	sb->s_free_blocks_count += (init ? -1 : 1);
-	set_block_bitmap(index, init);
+/* Return true if size bytes, a multiple of 64, hold only zeros. Inlined
+ * with a constant size for each block size, so the loop is unrolled.
+ */
+static inline __attribute__((always_inline)) bool is_zero_bytes(const ubyte *ptr, 
+																uint size) {
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	uint i;
 	
-	i->i_size += EXT2_BLOCK_SIZE * (init ? 1 : -1);
-	i->i_blocks += 2 * (init ? 1 : -1); /* sectors */
-	i->i_mtime = curr_time;
+	/* OR every 16 bytes together, four vectors at a time */
+	for (i = 0; i < size; i += 4 * sizeof(__m128i)) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(ptr + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(ptr + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(ptr + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(ptr + i + 48)));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+	const unsigned long *words = (const unsigned long *)ptr;
+	unsigned long acc = 0;
+	uint i;
 	
-	if (init) {
-		/* Set a directory entry */
-		((dir_entry *)ptr)->rec_len = EXT2_BLOCK_SIZE;
+	for (i = 0; i < size / sizeof(unsigned long); i++) {
+		acc |= words[i];
 	}
+	return acc == 0;
+#endif
 }
 
-/* Finds an unused inode index.
- * Return 0 if none exist.
+/* Return true if a block holds only zeros. */
+bool is_zero_block(image *img, const ubyte *ptr) {
+	switch (img->block_size) {
+		case 1024:
+			return is_zero_bytes(ptr, 1024);
+		case 2048:
+			return is_zero_bytes(ptr, 2048);
+		default:
+			return is_zero_bytes(ptr, 4096);
+	}
+}
+
+/* Return true if size bytes, a multiple of 64, are the same in a and b.
+ * Inlined with a constant size for each block size, like is_zero_bytes().
  */
-uint find_free_inode() {
+static inline __attribute__((always_inline)) bool is_same_bytes(const ubyte *a, 
+											const ubyte *b, uint size) {
+#ifdef __SSE2__
+	__m128i acc;
 	uint i;
 	
-	if (!has_space(1, 0)) {
-		return 0;
-	}
-	
-	for (i = 1; i <= sb->s_inodes_count; i++) {
-		if (!get_inode_bitmap(i)) {
-			return i;
+	/* XOR 64 bytes at a time, stopping at the first difference */
+	for (i = 0; i < size; i += 4 * sizeof(__m128i)) {
+		acc = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+							_mm_loadu_si128((const __m128i *)(b + i)));
+		acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+							_mm_loadu_si128((const __m128i *)(b + i + 16))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 32)),
+							_mm_loadu_si128((const __m128i *)(b + i + 32))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 48)),
+							_mm_loadu_si128((const __m128i *)(b + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) {
+			return false;
 		}
 	}
-	return 0;
+	return true;
+#else
+	return memcmp(a, b, size) == 0;
+#endif
 }
 
-/* Gets the inode at the index provided. */
-inode *get_inode(uint index) {
-	/* Accessing a bad (reserved) inode */
-	assert(disk != NULL && index > 0 && index <= sb->s_inodes_count
-				&& (index >= sb->s_first_ino || index == EXT2_ROOT_INO));
-	
-	return (inode *)(get_block(gd->bg_inode_table)
-						+ (sb->s_inode_size * (index - 1)));
+/* Return true if two blocks hold the same bytes. */
+bool is_same_block(image *img, const ubyte *a, const ubyte *b) {
+	switch (img->block_size) {
+		case 1024:
+			return is_same_bytes(a, b, 1024);
+		case 2048:
+			return is_same_bytes(a, b, 2048);
+		default:
+			return is_same_bytes(a, b, 4096);
+	}
 }
 
-/* Gets whether the inode is a created entry or not. */
-bool is_inode_valid(inode *ptr) {
-	return ptr->i_ctime > 0 && ptr->i_dtime == 0;
+/* One round of hash_data(), mixing a word into a lane. */
+static unsigned long long hash_round(unsigned long long acc, unsigned long long word) {
+	acc += word * EXT2_HASH_PRIME2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * EXT2_HASH_PRIME1;
 }
 
-/* Gets the valid inode at the index provided. */
-inode *get_valid_inode(uint index) {
-	inode *ret = get_inode(index);
-	if (ret != NULL && get_inode_bitmap(index) && is_inode_valid(ret)) {
-		ret->i_atime = curr_time; /* Access time */
-		return ret;
-	}
-	return NULL;
-}
+/* Returns a 64 bit hash of len bytes of data. It is not cryptographic,
+ * so equal hashes only mean the data is very likely the same. Blocks
+ * are consumed 32 bytes at a time over four independent lanes, with
+ * the rounds and primes of XXH64.
+ */
+unsigned long long hash_data(const void *data, size_t len, unsigned long long seed) {
+	const ubyte *ptr = data, *end = ptr + len;
+	unsigned long long lanes[4], word, h;
+	uint i;
 
-/* Takes any existing blocks referred to by an inode and deallocates them. */
-void unset_inode_block(uint block, inode *i) {
-	initialize_block(block, i, false);
-}
+	if (len >= 32) {
+		lanes[0] = seed + EXT2_HASH_PRIME1 + EXT2_HASH_PRIME2;
+		lanes[1] = seed + EXT2_HASH_PRIME2;
+		lanes[2] = seed;
+		lanes[3] = seed - EXT2_HASH_PRIME1;
+		for (; end - ptr >= 32; ptr += 32) {
+			for (i = 0; i < 4; i++) {
+				memcpy(&word, ptr + i * sizeof(word), sizeof(word));
+				lanes[i] = hash_round(lanes[i], word);
+			}
+		}
+		h = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57))
+			+ ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+		for (i = 0; i < 4; i++) {
+			h = (h ^ hash_round(0, lanes[i])) * EXT2_HASH_PRIME1 + EXT2_HASH_PRIME4;
+		}
+	} else {
+		h = seed + EXT2_HASH_PRIME5;
+	}
+	h += len;
 
-/* Finds the last entry in a path delimited by '/' */
-char *find_last_token(char *path) {
-	return basename(path);
-}
+	/* The tail, a word then a byte at a time */
+	for (; end - ptr >= 8; ptr += 8) {
+		memcpy(&word, ptr, sizeof(word));
+		h ^= hash_round(0, word);
+		h = ((h << 27) | (h >> 37)) * EXT2_HASH_PRIME1 + EXT2_HASH_PRIME4;
+	}
+	for (; ptr < end; ptr++) {
+		h ^= *ptr * EXT2_HASH_PRIME5;
+		h = ((h << 11) | (h >> 53)) * EXT2_HASH_PRIME1;
+	}
 
-/* Checks if the directory entry's name is equal to name. */
-bool check_dir_entry_name(dir_entry *dir, char *name) {
-	return dir->name_len == strlen(name)
-				&& strncmp(dir->name, name, dir->name_len) == 0;
+	/* Make every input bit affect every output bit */
+	h ^= h >> 33;
+	h *= EXT2_HASH_PRIME2;
+	h ^= h >> 29;
+	h *= EXT2_HASH_PRIME3;
+	return h ^ (h >> 32);
 }
 
-/* Checks if the entry provided is a special one. */
-bool is_special_dir(dir_entry *entry) {
-	return check_dir_entry_name(entry, ".") || check_dir_entry_name(entry, "..");
+/* Initializes or uninitializes a block for an inode.
+ * A block being initialized must come from find_free_block().
+ */
+void initialize_block(image *img, uint index, inode *i, bool init) {
+	ubyte *ptr = get_block(img, index);
+	
+	/* Make sure it was properly set */
+	assert(get_block_bitmap(img, index));
+	
+	memset(ptr, 0, img->block_size);
+	
+	ADD_COUNT(get_block_group(img, index)->bg_free_blocks_count, (init ? -1 : 1));
+	ADD_COUNT(img->sb->s_free_blocks_count, (init ? -1 : 1));
+	if (!init) {
+		set_block_bitmap(img, index, false);
+	}
+	
+	i->i_blocks += (img->block_size / EXT2_SECTOR_SIZE) * (init ? 1 : -1); /* sectors */
+	i->i_mtime = img->curr_time;
 }
 
-/* If f is NULL, gets the directory entry with the 
- * filename equal to file in this block.
- *
+/* Picks the group for a new directory, the Orlov way. Directories in
+ * the root are spread out, each to the group with the fewest directories
+ * among those with at least the average free inodes and blocks. Others
+ * stay near their parent, in the first group from it that is not already
+ * crowded with directories or short of space.
+ */
+static uint find_dir_group(image *img, uint parent_group, bool top) {
+	uint avg_inodes = img->sb->s_free_inodes_count / img->groups;
+	uint avg_blocks = img->sb->s_free_blocks_count / img->groups;
+	uint n, g, dirs = 0, best = img->groups;
+	uint max_dirs, min_inodes, min_blocks;
+	group_desc *gd = img->gd;
+	
+	for (g = 0; g < img->groups; g++) {
+		dirs += gd[g].bg_used_dirs_count;
+	}
+	if (top) {
+		for (g = 0; g < img->groups; g++) {
+			if (gd[g].bg_free_inodes_count == 0 || gd[g].bg_free_inodes_count < avg_inodes
+					|| gd[g].bg_free_blocks_count < avg_blocks) {
+				continue;
+			}
+			if (best == img->groups || gd[g].bg_used_dirs_count < gd[best].bg_used_dirs_count
+					|| (gd[g].bg_used_dirs_count == gd[best].bg_used_dirs_count
+						&& gd[g].bg_free_blocks_count > gd[best].bg_free_blocks_count)) {
+				best = g;
+			}
+		}
+		if (best != img->groups) {
+			return best;
+		}
+	} else {
+		max_dirs = dirs / img->groups + img->sb->s_inodes_per_group / 16;
+		min_inodes = avg_inodes - (avg_inodes < img->sb->s_inodes_per_group / 4 
+									? avg_inodes : img->sb->s_inodes_per_group / 4);
+		min_blocks = avg_blocks - (avg_blocks < img->sb->s_blocks_per_group / 4 
+									? avg_blocks : img->sb->s_blocks_per_group / 4);
+		for (n = 0; n < img->groups; n++) {
+			g = (parent_group + n) % img->groups;
+			if (gd[g].bg_used_dirs_count < max_dirs && gd[g].bg_free_inodes_count > 0
+					&& gd[g].bg_free_inodes_count >= min_inodes
+					&& gd[g].bg_free_blocks_count >= min_blocks) {
+				return g;
+			}
+		}
+	}
+	/* Otherwise, anywhere with at least the average free inodes */
+	for (n = 0; n < img->groups; n++) {
+		g = (parent_group + n) % img->groups;
+		if (gd[g].bg_free_inodes_count > 0 && gd[g].bg_free_inodes_count >= avg_inodes) {
+			return g;
+		}
+	}
+	return parent_group;
+}
+
+/* Picks the group for a new file: its parent's, if that has free inodes
+ * and blocks, or else the first that does in groups further and further
+ * away from it.
+ */
+static uint find_file_group(image *img, uint parent_group) {
+	uint n, g;
+	
+	for (n = 0; n < img->groups; n = (n == 0 ? 1 : n * 2)) {
+		g = (parent_group + n) % img->groups;
+		if (img->gd[g].bg_free_inodes_count > 0 && img->gd[g].bg_free_blocks_count > 0) {
+			return g;
+		}
+	}
+	return parent_group;
+}
+
+/* Finds an unused inode index and marks it used in the bitmap, so that
+ * no other thread can take it. initialize_inode() then sets it up.
+ * The group is picked by find_dir_group() or find_file_group(), moving
+ * on to the following groups if it is full by then.
+ * Return 0 if none exist.
+ */
+uint find_free_inode(image *img, uint parent, bool dir) {
+	uint n, g, first, bit;
+	
+	if (!has_space(img, 1, 0)) {
+		return 0;
+	}
+	g = (get_inode_group(img, parent) - img->gd);
+	first = (dir ? find_dir_group(img, g, parent == EXT2_ROOT_INO) 
+				: find_file_group(img, g));
+	for (n = 0; n < img->groups; n++) {
+		g = (first + n) % img->groups;
+		if (img->gd[g].bg_free_inodes_count > 0 
+				&& (bit = claim_free_bit(get_block(img, img->gd[g].bg_inode_bitmap), 
+									0, img->sb->s_inodes_per_group)) != 0) {
+			return g * img->sb->s_inodes_per_group + bit;
+		}
+	}
+	return 0;
+}
+
+/* Gets the inode at the index provided. */
+inode *get_inode(image *img, uint index) {
+	/* Accessing a bad (reserved) inode */
+	assert(img->disk != NULL && index > 0 && index <= img->sb->s_inodes_count
+				&& (index >= img->sb->s_first_ino || index == EXT2_ROOT_INO));
+	
+	return (inode *)(get_block(img, get_inode_group(img, index)->bg_inode_table)
+				+ (img->sb->s_inode_size * ((index - 1) % img->sb->s_inodes_per_group)));
+}
+
+/* Gets the index of an inode from its place in the inode tables.
+ * Return 0 if it is in none of them.
+ */
+uint get_inode_index(image *img, inode *ptr) {
+	size_t table_size = (size_t)img->sb->s_inodes_per_group * img->sb->s_inode_size;
+	ubyte *table;
+	uint g;
+	
+	for (g = 0; g < img->groups; g++) {
+		table = get_block(img, img->gd[g].bg_inode_table);
+		if ((ubyte *)ptr >= table && (ubyte *)ptr < table + table_size) {
+			return g * img->sb->s_inodes_per_group 
+						+ ((ubyte *)ptr - table) / img->sb->s_inode_size + 1;
+		}
+	}
+	return 0;
+}
+
+/* Takes, or with F_UNLCK releases, a lock on the bytes of an inode in
+ * the inode table, which other processes using the image respect.
+ * These are open file description locks, so each loaded handle holds
+ * its own, and closing some other descriptor doesn't drop them.
+ */
+static void lock_inode_range(image *img, uint index, short type) {
+	struct flock fl;
+	int saved = errno;
+	
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (ubyte *)get_inode(img, index) - img->disk;
+	fl.l_len = img->sb->s_inode_size;
+	while (fcntl(img->fd, F_OFD_SETLKW, &fl) < 0) {
+		if (errno != EINTR) {
+			print_error(img->err, "fcntl");
+			break;
+		}
+	}
+	errno = saved; /* Callers may be reporting ELOOP */
+}
+
+/* Takes the lock of an inode, shared for reading its directory entries
+ * or exclusive for changing them. Readers wait while a writer holds or
+ * is waiting for the lock, so writers are not starved.
+ *
+ * Threads of this process agree through the lock word; the process then
+ * holds a matching range lock on the inode for other processes. Only the
+ * first reader in takes the shared range lock, and only the last one out
+ * releases it.
+ */
+void lock_inode(image *img, uint index, bool exclusive) {
+	uint *lock = &(img->locks[index]);
+	uint old;
+	
+	if (exclusive) {
+		/* Announce ourselves, then wait for readers to drain */
+		while (__atomic_fetch_or(lock, EXT2_LOCK_WRITER, __ATOMIC_ACQUIRE) 
+					& EXT2_LOCK_WRITER) {
+			sched_yield();
+		}
+		while (__atomic_load_n(lock, __ATOMIC_ACQUIRE) != EXT2_LOCK_WRITER) {
+			sched_yield();
+		}
+		lock_inode_range(img, index, F_WRLCK);
+		return;
+	}
+	old = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	for (;;) {
+		if (old & (EXT2_LOCK_WRITER | EXT2_LOCK_PENDING)) {
+			sched_yield();
+			old = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		} else if (old == 0) {
+			if (__atomic_compare_exchange_n(lock, &old, 1 | EXT2_LOCK_PENDING, 
+							true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				lock_inode_range(img, index, F_RDLCK);
+				__atomic_fetch_and(lock, ~EXT2_LOCK_PENDING, __ATOMIC_RELEASE);
+				return;
+			}
+		} else if (__atomic_compare_exchange_n(lock, &old, old + 1, true, 
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+}
+
+/* Releases a lock taken with lock_inode(). */
+void unlock_inode(image *img, uint index, bool exclusive) {
+	uint *lock = &(img->locks[index]);
+	uint old;
+	
+	if (exclusive) {
+		lock_inode_range(img, index, F_UNLCK);
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	old = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	for (;;) {
+		if ((old & ~EXT2_LOCK_WRITER) == 1) {
+			/* Last reader, keep new ones out until the range is released */
+			if (__atomic_compare_exchange_n(lock, &old, 
+							(old & EXT2_LOCK_WRITER) | EXT2_LOCK_PENDING, 
+							true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				lock_inode_range(img, index, F_UNLCK);
+				__atomic_fetch_and(lock, ~EXT2_LOCK_PENDING, __ATOMIC_RELEASE);
+				return;
+			}
+		} else if (__atomic_compare_exchange_n(lock, &old, old - 1, true, 
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+}
+
+/* Gets whether the inode is a created entry or not. */
+bool is_inode_valid(inode *ptr) {
+	return ptr->i_ctime > 0 && ptr->i_dtime == 0;
+}
+
+/* Gets whether the inode is a symlink stored inside i_block. */
+bool is_fast_symlink(inode *ptr) {
+	return IS_TYPE(ptr->i_mode, EXT2_S_IFLNK) && ptr->i_size < EXT2_MIN_BLOCK_DATA;
+}
+
+/* Gets the valid inode at the index provided. */
+inode *get_valid_inode(image *img, uint index) {
+	inode *ret = get_inode(img, index);
+	if (ret != NULL && get_inode_bitmap(img, index) && is_inode_valid(ret)) {
+		ret->i_atime = img->curr_time; /* Access time */
+		return ret;
+	}
+	return NULL;
+}
+
+/* Copies what the summary holds of inode i at index into it. */
+static void set_summary(image *img, inode_summary *s, uint index, inode *i) {
+	unsigned long long bit = 1ULL << (index % EXT2_SUMMARY_BITS);
+	
+	if (get_inode_bitmap(img, index) && is_inode_valid(i)) {
+		s->mode[index] = i->i_mode;
+		s->size[index] = i->i_size;
+		s->links[index] = i->i_links_count;
+		s->first_block[index] = i->i_block[0];
+		__atomic_fetch_or(&(s->live[index / EXT2_SUMMARY_BITS]), bit, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_and(&(s->live[index / EXT2_SUMMARY_BITS]), ~bit, __ATOMIC_RELAXED);
+	}
+}
+
+/* Adds every inode in use in group g to the summary. Only inodes set in
+ * the bitmap are read, and the bitmap is read EXT2_SUMMARY_BITS inodes at
+ * a time (or 128 with SSE2), so runs of free inodes cost next to nothing
+ * and inode tables are only touched where something lives.
+ */
+static void summarize_group(image *img, inode_summary *s, uint g) {
+	uint per_group = img->sb->s_inodes_per_group, first = g * per_group + 1;
+	const ubyte *bitmap = get_block(img, img->gd[g].bg_inode_bitmap);
+	unsigned long long word;
+	uint bit, index;
+	
+	for (bit = 0; bit < per_group; bit += EXT2_SUMMARY_BITS) {
+#ifdef __SSE2__
+		if (bit % 128 == 0 && bit + 128 <= per_group
+				&& _mm_movemask_epi8(_mm_cmpeq_epi8(
+						_mm_loadu_si128((const __m128i *)(bitmap + bit / BITS_PER_BYTE)),
+						_mm_setzero_si128())) == 0xFFFF) {
+			bit += 128 - EXT2_SUMMARY_BITS;
+			continue;
+		}
+#endif
+		memcpy(&word, bitmap + bit / BITS_PER_BYTE, sizeof(word));
+		if (per_group - bit < EXT2_SUMMARY_BITS) {
+			word &= (1ULL << (per_group - bit)) - 1;
+		}
+		for (; word != 0; word &= word - 1) {
+			index = first + bit + __builtin_ctzll(word);
+			if (index >= img->sb->s_first_ino || index == EXT2_ROOT_INO) {
+				set_summary(img, s, index, get_inode(img, index));
+			}
+		}
+	}
+}
+
+/* Builds the summary of every inode on the image, if not built yet. It is
+ * then kept up to date by every change made through this handle, but not
+ * by other processes sharing the image, so it is not built for retained
+ * disks. Changes racing with the build itself may be missed, so build
+ * it before the image is shared between threads if scans must be exact.
+ * Return false if out of memory, or the disk is retained.
+ */
+bool build_inode_summary(image *img) {
+	uint count = img->sb->s_inodes_count + 1, g;
+	inode_summary *s;
+	bool ret;
+	
+	pthread_mutex_lock(&(img->summary_lock));
+	if (img->summary == NULL && !img->retained 
+			&& (s = calloc(1, sizeof(inode_summary))) != NULL) {
+		s->live = calloc(DIV_UP(count, EXT2_SUMMARY_BITS), sizeof(unsigned long long));
+		s->mode = malloc(count * sizeof(ushort));
+		s->size = malloc(count * sizeof(uint));
+		s->links = malloc(count * sizeof(ushort));
+		s->first_block = malloc(count * sizeof(uint));
+		if (s->live == NULL || s->mode == NULL || s->size == NULL 
+				|| s->links == NULL || s->first_block == NULL) {
+			free_inode_summary(s);
+		} else {
+			for (g = 0; g < img->groups; g++) {
+				summarize_group(img, s, g);
+			}
+			__atomic_store_n(&(img->summary), s, __ATOMIC_RELEASE);
+		}
+	}
+	ret = (img->summary != NULL);
+	pthread_mutex_unlock(&(img->summary_lock));
+	return ret;
+}
+
+/* Updates the summary of inode i after it changes, if there is one. */
+void update_inode_summary(image *img, inode *i) {
+	inode_summary *s = __atomic_load_n(&(img->summary), __ATOMIC_ACQUIRE);
+	
+	if (s != NULL) {
+		set_summary(img, s, get_inode_index(img, i), i);
+	}
+}
+
+/* Gets whether the inode at index is in use, from the summary if there
+ * is one, without touching the inode table.
+ */
+bool is_inode_live(image *img, uint index) {
+	inode_summary *s = __atomic_load_n(&(img->summary), __ATOMIC_ACQUIRE);
+	
+	if (s == NULL) {
+		return get_inode_bitmap(img, index) && is_inode_valid(get_inode(img, index));
+	}
+	return (__atomic_load_n(&(s->live[index / EXT2_SUMMARY_BITS]), __ATOMIC_RELAXED)
+				>> (index % EXT2_SUMMARY_BITS)) & 1;
+}
+
+/* Gets the mode of the inode at index, from the summary if there is one,
+ * without touching the inode table.
+ */
+ushort get_inode_mode(image *img, uint index) {
+	inode_summary *s = __atomic_load_n(&(img->summary), __ATOMIC_ACQUIRE);
+	
+	if (s == NULL) {
+		return get_inode(img, index)->i_mode;
+	}
+	return __atomic_load_n(&(s->mode[index]), __ATOMIC_RELAXED);
+}
+
+/* Takes any existing blocks referred to by an inode and deallocates them. */
+void unset_inode_block(image *img, uint block, inode *i) {
+	initialize_block(img, block, i, false);
+}
+
+/* Prints what failed, and why from errno, to err, as perror() does. */
+void print_error(FILE *err, const char *what) {
+	char buf[256]; /* Longer than any message */
+	char *why = strerror_r(errno, buf, sizeof(buf));
+	
+	if (what != NULL && what[0] != '\0') {
+		fprintf(err, "%s: %s\n", what, why);
+	} else {
+		fprintf(err, "%s\n", why);
+	}
+}
+
+/* Finds the last entry in a path delimited by '/' */
+char *find_last_token(char *path) {
+	return basename(path);
+}
+
+/* A name being looked for in directories, worked out once per lookup.
+ * head holds what the 8 bytes at the start of rec_len in a matching
+ * entry hold (rec_len, name_len, file_type, then up to 4 bytes of the
+ * name), under mask, which leaves out rec_len, file_type and whatever
+ * follows a short name. So most entries are turned down by one compare.
+ */
+typedef struct {
+	const char *name;
+	uint len;
+	unsigned long long head, mask;
+} name_key;
+
+/* Offset of the bytes name_key.head stands for, in a directory entry */
+#define EXT2_NAME_KEY_OFFSET	4
+#define EXT2_NAME_KEY_BYTES		4	/* Of the name, in head */
+
+/* Works out the key for looking up name. */
+static void make_name_key(const char *name, name_key *key) {
+	ubyte head[sizeof(key->head)] = {0}, mask[sizeof(key->mask)] = {0};
+	uint n;
+	
+	key->name = name;
+	key->len = strlen(name);
+	head[2] = (ubyte)key->len; /* name_len */
+	mask[2] = 0xFF;
+	if (key->len > EXT2_NAME_LEN) {
+		head[3] = 1; /* Outside the mask, so nothing matches */
+	}
+	for (n = 0; n < key->len && n < EXT2_NAME_KEY_BYTES; n++) {
+		head[4 + n] = (ubyte)name[n];
+		mask[4 + n] = 0xFF;
+	}
+	memcpy(&(key->head), head, sizeof(head));
+	memcpy(&(key->mask), mask, sizeof(mask));
+}
+
+/* Return true if len bytes at a and b are the same. Names are short,
+ * so this is inlined rather than calling memcmp(), and long ones are
+ * compared 16 bytes at a time. Never reads past len.
+ */
+static inline bool is_same_name(const char *a, const char *b, uint len) {
+	uint n = 0;
+	
+#ifdef __SSE2__
+	for (; n + sizeof(__m128i) <= len; n += sizeof(__m128i)) {
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + n)),
+							_mm_loadu_si128((const __m128i *)(b + n)))) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+	for (; n < len; n++) {
+		if (a[n] != b[n]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Checks if the directory entry's name is the one key was made for.
+ * Every entry is at least EXT2_DIR_DEFAULT_SIZE + EXT2_NAME_KEY_BYTES 
+ * bytes long, so the head is always within it.
+ */
+static inline bool has_entry_name(dir_entry *dir, const name_key *key) {
+	unsigned long long head;
+	
+	memcpy(&head, (ubyte *)dir + EXT2_NAME_KEY_OFFSET, sizeof(head));
+	return (head & key->mask) == key->head 
+			&& (key->len <= EXT2_NAME_KEY_BYTES 
+				|| is_same_name(dir->name + EXT2_NAME_KEY_BYTES, 
+							key->name + EXT2_NAME_KEY_BYTES, key->len - EXT2_NAME_KEY_BYTES));
+}
+
+/* Checks if the entry provided is a special one. */
+bool is_special_dir(dir_entry *entry) {
+	return entry->name[0] == '.' 
+			&& (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'));
+}
+
+/* If f is NULL, gets the directory entry with the 
+ * filename key was made for in this block.
+ *
  * Otherwise, if f is not NULL, performs function f on the 
- * directory entries. If file is not NULL, only performs f on
- * the entry with filename equal to file.
+ * directory entries. If key is not NULL, only performs f on
+ * the entry with that filename.
  *
  * Also performs g on all blocks pointed to by inode.
  * If get_prev is true, returns the directory entry previous.
  */
-dir_entry *search_inner_block(inode *curr, uint index, void (*g)(uint, inode *), 
-				char *file, uint recurse, void (*f)(dir_entry *, inode *), bool get_prev) {
+dir_entry *search_inner_block(image *img, inode *curr, uint index, 
+				void (*g)(image *, uint, inode *), const name_key *key, uint recurse, 
+				void (*f)(image *, dir_entry *, inode *), bool get_prev) {
 	ubyte *block;
 	uint *ptr, i, temp;
 	dir_entry *ret, *prev = NULL;
 	
-	if (!get_block_bitmap(index)) { /* Invalid block */
+	if (!get_block_bitmap(img, index)) { /* Invalid block */
 		return NULL;
 	}
-	block = get_valid_block(index);
+	block = get_valid_block(img, index);
 	
 	if (recurse == 0) {
 		if (g != NULL) {
-			g(index, curr);
+			g(img, index, curr);
 		}
-		if (IS(curr->i_mode, EXT2_S_IFDIR)) {
+		if (IS_TYPE(curr->i_mode, EXT2_S_IFDIR)) {
 			/* Direct pointers, sequentially read */
-			for (i = 0; i < EXT2_BLOCK_SIZE; i += temp) {
+			for (i = 0; i < img->block_size; i += temp) {
 				ret = (dir_entry *)(block + i);
 				temp = ret->rec_len; /* In case we get wiped */
 				if (temp < (uint)EXT2_DIR_DEFAULT_SIZE + ret->name_len) {
@@ -274,11 +1437,11 @@ dir_entry *search_inner_block(inode *curr, uint index, void (*g)(uint, inode *),
 					return NULL;
 				}
 				
-				/* If valid and follows conditions */
-				if (ret->inode > 0 && get_valid_inode(ret->inode) != NULL 
-						&& (file == NULL || check_dir_entry_name(ret, file))) {
+				/* If follows conditions and valid, the name first as it is cheaper */
+				if ((key == NULL || has_entry_name(ret, key)) 
+						&& ret->inode > 0 && get_valid_inode(img, ret->inode) != NULL) {
 					if (f != NULL) {
-						f(ret, curr);
+						f(img, ret, curr);
 					} else {
 						return (get_prev ? prev : ret);
 					}
@@ -292,17 +1455,21 @@ dir_entry *search_inner_block(inode *curr, uint index, void (*g)(uint, inode *),
 		}
 	} else {
 		/* Indirect pointers, recurse */
-		for (i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint); i++) {
+		for (i = 0; i < img->ptrs_per_block; i++) {
 			ptr = (uint *)(block + (i * sizeof(uint)));
-			if (ptr == NULL || *ptr == 0) { /* All remaining pointers are 0 */
-				return NULL;
+			if (*ptr == 0) { /* A hole, or all remaining pointers are 0 */
+				continue;
 			}
-			ret = search_inner_block(curr, *ptr, g, file, recurse - 1, 
+			ret = search_inner_block(img, curr, *ptr, g, key, recurse - 1, 
 												f, get_prev);
 			if (ret != NULL) {
 				return ret;
 			}
 		}
+		/* The indirect block itself, once its children are done */
+		if (g != NULL) {
+			g(img, index, curr);
+		}
 	}
 	return NULL;
 }
@@ -316,23 +1483,29 @@ dir_entry *search_inner_block(inode *curr, uint index, void (*g)(uint, inode *),
  *
  * Also performs g on all blocks pointed to by inode.
  */
-uint perform_on_children(inode *curr, void (*g)(uint, inode *), char *file,
-						void (*f)(dir_entry *, inode *)) {
+uint perform_on_children(image *img, inode *curr, 
+				void (*g)(image *, uint, inode *), char *file,
+				void (*f)(image *, dir_entry *, inode *)) {
 	uint i, j;
 	uint min, block;
 	dir_entry *ret;
+	name_key key;
 	
 	/* Can't all be NULL */
 	assert(f != NULL || g != NULL || file != NULL);
 	
+	if (file != NULL) {
+		make_name_key(file, &key);
+	}
 	min = 0;
 	for (j = 0; j < EXT2_NUM_TYPES; j++) {
 		for (i = 0; i < TYPES[j]; i++) {
 			block = curr->i_block[i + min];
-			if (block == 0) { /* Remaining are 0 */
-				return 0;
+			if (block == 0) { /* A hole, or remaining are 0 */
+				continue;
 			}
-			ret = search_inner_block(curr, block, g, file, j, f, false);
+			ret = search_inner_block(img, curr, block, g, (file == NULL ? NULL : &key), 
+										j, f, false);
 			if (ret != NULL) { 
 				/* Found filename */
 				return ret->inode;
@@ -347,106 +1520,76 @@ uint perform_on_children(inode *curr, void (*g)(uint, inode *), char *file,
 /* Initializes or uninitializes an inode. 
  * Note that if inode is a directory, the directory entries
  * should be removed BEFORE calling this method.
+ * An inode being initialized must come from find_free_inode().
  */
-void initialize_inode(uint index, bool init) {
-	inode *i = get_inode(index);
+void initialize_inode(image *img, uint index, bool init) {
+	inode *i = get_inode(img, index);
 	
 	/* Make sure it was properly set */
-	assert(init != get_inode_bitmap(index));
-	
-	gd->bg_free_inodes_count += (init ? -1 : 1);
-	sb->s_free_inodes_count += (init ? -1 : 1);
-	set_inode_bitmap(index, init);
-	
-	/* Unset the blocks */
-	if (i->i_size < EXT2_MIN_BLOCK_DATA && IS(i->i_mode, EXT2_S_IFLNK)) {
-		/* Special case */
-		memset(i->i_block, 0, i->i_size);
-	} else {
-		perform_on_children(i, unset_inode_block, NULL, NULL);
-	}
+	assert(get_inode_bitmap(img, index));
 	
 	if (init) {
-		memset(i, 0, sb->s_inode_size);
-		i->i_ctime = curr_time;
+		/* Whatever blocks it had belonged to it when it was freed */
+		ADD_COUNT(get_inode_group(img, index)->bg_free_inodes_count, -1);
+		ADD_COUNT(img->sb->s_free_inodes_count, -1);
+		memset(i, 0, img->sb->s_inode_size);
+		i->i_ctime = img->curr_time;
 		i->i_dtime = 0;
 	} else {
-		if (IS(i->i_mode, EXT2_S_IFDIR)) {
+		/* Unset the blocks */
+		if (is_fast_symlink(i)) {
+			/* Special case */
+			memset(i->i_block, 0, i->i_size);
+		} else if (IS_TYPE(i->i_mode, EXT2_S_IFREG) || IS_TYPE(i->i_mode, EXT2_S_IFDIR)
+					|| IS_TYPE(i->i_mode, EXT2_S_IFLNK)) {
+			/* Device numbers in i_block of special files are not blocks */
+			perform_on_children(img, i, unset_inode_block, NULL, NULL);
+		}
+		if (IS_TYPE(i->i_mode, EXT2_S_IFDIR)) {
 			/* One less used directory */
-			gd->bg_used_dirs_count--;
+			ADD_COUNT(get_inode_group(img, index)->bg_used_dirs_count, -1);
 		}
-		i->i_dtime = curr_time;
-	}
-	i->i_mtime = curr_time;
-	i->i_atime = curr_time;
-}
-
-/* Reads block contents to an index in a C-style string. 
- * Return true if the string has ended.
- */
-bool read_block_contents(uint index, char *dest, uint *start, 
-						uint *remaining, uint recurse) {
-	ubyte *block;
-	uint i, *ptr;
-	uint size = *remaining;
-	
-	if (index == 0 || !get_block_bitmap(index) || size == 0) {
-		return true;
+		i->i_dtime = img->curr_time;
 	}
-
-	block = get_valid_block(index);
-	
-	if (recurse == 0) {
-		if (size > EXT2_BLOCK_SIZE) {
-			size = EXT2_BLOCK_SIZE; /* Amount of bytes to read for this block */
-		}
-		strncpy(dest, (char *)(block + (*start * sizeof(char))), size);
-		*remaining -= size; /* Decrease how many bytes remaining we have */
-		*start += size; /* Advance pointer to write */
-	} else {
-		/* Indirect pointers, recurse */
-		for (i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint); i++) {
-			ptr = (uint *)(block + (i * sizeof(uint)));
-			if (read_block_contents(*ptr, dest, start, remaining, recurse - 1)) {
-				return true;
-			}
-		}
+	i->i_mtime = img->curr_time;
+	i->i_atime = img->curr_time;
+	
+	if (!init) {
+		/* Only once it is torn down, or a new owner could see it */
+		ADD_COUNT(get_inode_group(img, index)->bg_free_inodes_count, 1);
+		ADD_COUNT(img->sb->s_free_inodes_count, 1);
+		set_inode_bitmap(img, index, false);
 	}
-	return *remaining == 0;
+	update_inode_summary(img, i);
 }
 
-
-/* Reads file contents to a C-style string. */
-char *read_file_contents(uint index) {
-	inode *node = get_valid_inode(index);
+/* Reads file contents to a C-style string. Holes read as zeros. */
+char *read_file_contents(image *img, uint index) {
+	inode *node = get_valid_inode(img, index);
+	block_walker w;
+	block_extent e;
 	char *ret;
-	uint i, j;
-	uint min, remaining, start;
+	size_t off, size;
 	
 	/* Is not a directory */
 	assert(!IS(node->i_mode, EXT2_S_IFDIR));
 	
 	ret = malloc(node->i_size + sizeof(char));
 	
-	if (node->i_size < EXT2_MIN_BLOCK_DATA && IS(node->i_mode, EXT2_S_IFLNK)) {
+	if (is_fast_symlink(node)) {
 		/* Special case: short symlinks read directly from block */
 		strncpy(ret, (char *)node->i_block, node->i_size);
 	} else {
-		/* Look through blocks and get the contents */
-		min = 0;
-		start = 0; /* Index of where to write */
-		remaining = node->i_size;
-		for (j = 0; j < EXT2_NUM_TYPES; j++) {
-			for (i = 0; i < TYPES[j]; i++) {
-				/* Stop when we end the string */
-				if (read_block_contents(node->i_block[i + min], ret, 
-									&start, &remaining, j)) {
-					j = EXT2_NUM_TYPES;
-					/* Break outer loop */
-					break;
-				}
+		/* Copy each run of blocks, leaving zeros for the holes between */
+		memset(ret, 0, node->i_size);
+		start_block_walk(img, node, 0, DIV_UP(node->i_size, img->block_size), true, &w);
+		while (next_block_extent(&w, &e)) {
+			off = (size_t)e.lblk << img->block_bits;
+			size = (size_t)e.count << img->block_bits;
+			if (size > node->i_size - off) {
+				size = node->i_size - off; /* Ends partway through the last block */
 			}
-			min += i;
+			memcpy(ret + off, get_block(img, e.block), size);
 		}
 	}
 	ret[node->i_size] = '\0';
@@ -454,7 +1597,7 @@ char *read_file_contents(uint index) {
 }
 
 /* Returns a directory entry that has the extra space needed. */
-dir_entry *get_free_dir_entry(uint index, uint size_needed) {
+dir_entry *get_free_dir_entry(image *img, uint index, uint size_needed) {
 	ubyte *block;
 	uint i;
 	uint space;
@@ -464,8 +1607,8 @@ dir_entry *get_free_dir_entry(uint index, uint size_needed) {
 	size_needed += (EXT2_ALIGN - (size_needed % EXT2_ALIGN));
 	
 	/* Direct pointers, sequentially read */
-	block = get_valid_block(index);
-	for (i = 0; i < EXT2_BLOCK_SIZE; i += ret->rec_len) {
+	block = get_valid_block(img, index);
+	for (i = 0; i < img->block_size; i += ret->rec_len) {
 		ret = (dir_entry *)(block + i);
 		
 		space = EXT2_DIR_DEFAULT_SIZE + ret->name_len; /* Space expected */
@@ -480,91 +1623,33 @@ dir_entry *get_free_dir_entry(uint index, uint size_needed) {
 }
 
 /* Returns true if the block has room for a directory entry. */
-bool has_free_dir_entry(uint index, uint size_needed) {
-	return get_free_dir_entry(index, size_needed) != NULL;
-}
-
-/* Return true if the block given meets conditions of check. */
-bool has_free_entry(uint index, uint size_needed, uint recurse, 
-								bool (*check)(uint, uint)) {
-	ubyte *block;
-	uint i, *ptr;
-	uint block_index;
-
-	block = get_valid_block(index);
-	
-	if (recurse == 0) {
-		if (check != NULL && check(index, size_needed)) {
-			return true;
-		}
-	} else {
-		/* Indirect pointers, recurse */
-		for (i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint); i++) {
-			ptr = (uint *)(block + (i * sizeof(uint)));
-			block_index = *ptr;
-			if (block_index != 0 && !get_block_bitmap(block_index)) {
-				/* Invalid block, we can use this pointer */
-				*ptr = 0;
-				block_index = 0;
-			}
-			if (block_index == 0 
-					|| has_free_entry(block_index, size_needed, recurse - 1, check)) {
-				return true;
-			}
-		}
-	}
-	return false;
-}
-
-/* Returns a pointer to the first i_block entry in an inode
- * which meets the conditions given by check function.
- */
-uint *get_free_block_ptr(inode *curr, uint size_needed, bool (*check)(uint, uint)) {
-	uint i, j;
-	uint min, block;
-
-	min = 0;
-	for (j = 0; j < EXT2_NUM_TYPES; j++) {
-		for (i = 0; i < TYPES[j]; i++) {
-			block = curr->i_block[i + min];
-			if (block != 0 && !get_block_bitmap(block)) {
-				/* Invalid block, we can use this pointer */
-				curr->i_block[i + min] = 0;
-				block = 0;
-			}
-			if (block == 0 || has_free_entry(block, size_needed, j, check)) {
-				return &(curr->i_block[i + min]);
-			}
-		}
-		min += i;
-	}
-	
-	return NULL;
+bool has_free_dir_entry(image *img, uint index, uint size_needed) {
+	return get_free_dir_entry(img, index, size_needed) != NULL;
 }
 
-
 /* Gets a direct block index that contains a directory entry with name. */
-uint search_indirect_block(inode *curr, uint index, char *name, uint recurse) {
+uint search_indirect_block(image *img, inode *curr, uint index, const name_key *key, 
+						uint recurse) {
 	ubyte *block;
 	uint *ptr, i, ret;
 	
-	if (!get_block_bitmap(index)) { /* Invalid block */
+	if (!get_block_bitmap(img, index)) { /* Invalid block */
 		return 0;
 	}
 	
 	if (recurse == 0) {
-		if (search_inner_block(curr, index, NULL, name, 0, NULL, false) != NULL) {
+		if (search_inner_block(img, curr, index, NULL, key, 0, NULL, false) != NULL) {
 			return index;
 		}
 	} else {
-		block = get_valid_block(index);
+		block = get_valid_block(img, index);
 		/* Indirect pointers, recurse */
-		for (i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint); i++) {
+		for (i = 0; i < img->ptrs_per_block; i++) {
 			ptr = (uint *)(block + (i * sizeof(uint)));
-			if (ptr == NULL || *ptr == 0) { /* All remaining pointers are 0 */
-				return 0;
+			if (*ptr == 0) {
+				continue; /* A hole */
 			}
-			ret = search_indirect_block(curr, *ptr, name, recurse - 1);
+			ret = search_indirect_block(img, curr, *ptr, key, recurse - 1);
 			if (ret != 0) {
 				return ret;
 			}
@@ -574,18 +1659,20 @@ uint search_indirect_block(inode *curr, uint index, char *name, uint recurse) {
 }
 
 /* Returns a block index containing the directory entry with name. */
-uint get_block_with_entry(inode *curr, char *name) {
+uint get_block_with_entry(image *img, inode *curr, char *name) {
 	uint i, j;
 	uint min, block;
+	name_key key;
 
+	make_name_key(name, &key);
 	min = 0;
 	for (j = 0; j < EXT2_NUM_TYPES; j++) {
 		for (i = 0; i < TYPES[j]; i++) {
 			block = curr->i_block[i + min];
 			if (block == 0) {
-				return 0; /* Remaining are 0 */
+				continue; /* A hole */
 			}
-			block = search_indirect_block(curr, block, name, j);
+			block = search_indirect_block(img, curr, block, &key, j);
 			if (block != 0) {
 				return block;
 			}
@@ -596,144 +1683,578 @@ uint get_block_with_entry(inode *curr, char *name) {
 	return 0;
 }
 
-/* Finds and allocates a new block and adds it to inode. 
- * Returns the block index if successful. Otherwise, return 0.
+/* Gets the block a new block at logical block lblk of an inode should
+ * be placed at: right after the block before it, or for the first block,
+ * at the start of the inode's group.
  */
-uint add_new_block_to_inode(inode *i) {
-	uint new_block = find_free_block();
-	uint *block_ptr = get_free_block_ptr(i, 0, NULL);
-	if (block_ptr == NULL || new_block == 0) {
-		return 0; /* ENOSPC */
-	}
-	assert(*block_ptr == 0); /* Must be uninitialized */
-	initialize_block(new_block, i, true);
+static uint find_goal_block(image *img, inode *i, uint lblk) {
+	uint *ptr;
 	
-	*block_ptr = new_block;
-	i->i_mtime = curr_time;
+	if (lblk > 0 && (ptr = get_inode_block_ptr(img, i, lblk - 1, false)) != NULL 
+			&& *ptr != 0) {
+		return *ptr + 1;
+	}
+	return img->sb->s_first_data_block 
+			+ (get_inode_group(img, get_inode_index(img, i)) - img->gd) 
+				* img->sb->s_blocks_per_group;
+}
+
+/* Gets the first block of directory dir that may have room for an
+ * entry, as far as this process knows. Return 0 if it is not tracked.
+ */
+static uint get_dir_hint(image *img, uint dir) {
+	unsigned long long hint = __atomic_load_n(&(img->dir_hints[dir % EXT2_DIR_HINTS]), 
+												__ATOMIC_RELAXED);
 	
-	return new_block;
+	return (hint >> 32 == dir ? (uint)hint : 0);
 }
 
-/* Finds the direct child of a parent inode. */
-uint find_direct_child(uint parent, char *file) {
-	inode *in;
-	if (parent == 0 
-			|| (in = get_valid_inode(parent)) == NULL 
-			|| !IS(in->i_mode, EXT2_S_IFDIR)) {
-		return 0;
-	}
-	/* Referring to root? */
-	if (file == NULL || strlen(file) == 0 || strcmp(file, DELIMITER) == 0) {
-		return parent;
-	}
-	return perform_on_children(in, NULL, file, NULL);
+/* Sets the first block of directory dir that may have room. */
+static void set_dir_hint(image *img, uint dir, uint lblk) {
+	__atomic_store_n(&(img->dir_hints[dir % EXT2_DIR_HINTS]), 
+						((unsigned long long)dir << 32) | lblk, __ATOMIC_RELAXED);
 }
 
-/* Gets the parent inode of the absolute path provided. 
- * If some intermediate path does not exist, return NULL.
- * If except is found in the path, return NULL.
+/* Adds blocks to the end of a directory, each one empty entry. Once it
+ * has a block, as many as s_prealloc_dir_blocks are added at once, next
+ * to each other, so a growing directory can keep filling them.
+ * Return the first block added, or 0 if there is no space.
  */
-uint get_parent_inode_at_path_except(char *path, uint except) {
-	char *token;
-	uint curr, parent, temp, temp_parent;
-	inode *out;
-	char copy[strlen(path)];
-	char *path_copy;
-	
-	strcpy(copy, path); /* strtok changes input... */
-	
-	token = strtok(copy, DELIMITER);
-	curr = EXT2_ROOT_INO;
-	parent = curr;
-	
-	while (token != NULL) {
-		/* Dereference what is at "curr" */
-		if (curr == except || curr == 0
-				|| (out = get_valid_inode(curr)) == NULL
-				|| (!IS(out->i_mode, EXT2_S_IFDIR)
-					&& !IS(out->i_mode, EXT2_S_IFLNK))) {
-			return 0;
-		}
-		temp_parent = curr;
-		if (IS(out->i_mode, EXT2_S_IFLNK)) {
-			/* Dereference the path, don't allow infinite loop */
-			if (except != 0) { /* We already are checking a link */
-				return 0; /* Just in case */
-			}
-			path_copy = read_file_contents(curr);
-			temp_parent = get_inode_at_path_except(
-						path_copy, curr);
-			free(path_copy);
-			
-			if (temp_parent == 0 
-				|| (out = get_valid_inode(temp_parent)) == NULL
-				|| !IS(out->i_mode, EXT2_S_IFDIR)) {
-				/* The symlink itself is wrong */
-				return 0;
-			}
-			curr = temp_parent;
+static uint add_dir_blocks(image *img, inode *p) {
+	uint lblk = p->i_size >> img->block_bits, n, index, ret = 0;
+	uint count = (lblk > 0 && img->sb->s_prealloc_dir_blocks > 0 
+					? img->sb->s_prealloc_dir_blocks : 1);
+	
+	for (n = 0; n < count; n++, lblk++) {
+		if (!has_space(img, 0, get_total_blocks(img, lblk + 1) - get_total_blocks(img, lblk))
+				|| (index = add_block_at(img, p, lblk)) == 0) {
+			break; /* Fewer will do, as long as there is one */
 		}
-		temp = find_direct_child(temp_parent, token);
-		if (temp != curr) {
-			parent = curr;
-			curr = temp;
+		((dir_entry *)get_valid_block(img, index))->rec_len = img->block_size;
+		p->i_size += img->block_size;
+		if (ret == 0) {
+			ret = index;
 		}
-		token = strtok(NULL, DELIMITER);
 	}
-	return parent;
+	if (ret != 0) {
+		p->i_mtime = img->curr_time;
+		update_inode_summary(img, p);
+	}
+	return ret;
 }
 
-
-/* Gets the parent inode of the absolute path provided. 
- * If some intermediate path does not exist, return 0
+/* Finds a block of directory p with room for an entry of size bytes.
+ * Blocks before the last one found with room are not looked at again,
+ * unless an entry is removed from them, so filling a directory does not
+ * rescan it on every insert. If none have room, the directory grows.
+ * Return the block, or 0 if there is no space.
  */
-uint get_parent_inode_at_path(char *path) {
-	return get_parent_inode_at_path_except(path, 0);
+static uint find_dir_block(image *img, inode *p, uint size) {
+	uint dir = get_inode_index(img, p);
+	uint lblk, blocks = p->i_size >> img->block_bits;
+	uint *ptr;
+	
+	for (lblk = get_dir_hint(img, dir); lblk < blocks; lblk++) {
+		ptr = get_inode_block_ptr(img, p, lblk, false);
+		if (ptr != NULL && *ptr != 0 && get_block_bitmap(img, *ptr) 
+				&& has_free_dir_entry(img, *ptr, size)) {
+			set_dir_hint(img, dir, lblk);
+			return *ptr;
+		}
+	}
+	set_dir_hint(img, dir, blocks);
+	return add_dir_blocks(img, p);
+}
+
+/* Splits logical block lblk into the i_block entry leading to it, the
+ * levels of indirection below that entry, and the number of data blocks
+ * each pointer at the top level spans, as a shift. lblk becomes the
+ * offset within it. Spans are powers of two, so this only shifts and masks.
+ * Return the i_block entry, or EXT2_NUM_PTRS_PER_INODE if lblk is too big.
+ */
+static uint get_block_level(image *img, uint *lblk, uint *level, uint *bits) {
+	uint min = 0, entry;
+	
+	*bits = 0;
+	for (*level = 0; *level < EXT2_NUM_TYPES; (*level)++) {
+		if ((*lblk >> *bits) < TYPES[*level]) {
+			entry = min + (*lblk >> *bits);
+			*lblk &= (1U << *bits) - 1;
+			return entry;
+		}
+		*lblk -= TYPES[*level] << *bits;
+		min += TYPES[*level];
+		*bits += img->ptr_bits;
+	}
+	return EXT2_NUM_PTRS_PER_INODE; /* EFBIG */
+}
+
+/* Returns a pointer to the i_block or indirect entry holding logical
+ * block lblk of an inode. If alloc is true, missing indirect blocks are
+ * allocated on the way down; otherwise NULL is returned for them.
+ */
+uint *get_inode_block_ptr(image *img, inode *i, uint lblk, bool alloc) {
+	uint level, bits, entry, goal = lblk;
+	uint *ptr;
+	
+	if ((entry = get_block_level(img, &lblk, &level, &bits)) == EXT2_NUM_PTRS_PER_INODE) {
+		return NULL;
+	}
+	ptr = &(i->i_block[entry]);
+	
+	for (; level > 0; level--) {
+		if (*ptr == 0) {
+			/* Right before the data it points to, which goes next */
+			if (!alloc || (*ptr = find_free_block(img, 
+										find_goal_block(img, i, goal))) == 0) {
+				return NULL;
+			}
+			initialize_block(img, *ptr, i, true);
+		}
+		bits -= img->ptr_bits;
+		ptr = (uint *)get_valid_block(img, *ptr) + (lblk >> bits);
+		lblk &= (1U << bits) - 1;
+	}
+	return ptr;
+}
+
+/* Frees the data block at logical block lblk of an inode, along with any
+ * indirect blocks left without pointers, leaving a hole.
+ * Return true if a block was freed.
+ */
+bool unset_block_at(image *img, inode *i, uint lblk) {
+	uint *path[EXT2_NUM_TYPES];
+	uint level, bits, entry, depth;
+	
+	if ((entry = get_block_level(img, &lblk, &level, &bits)) == EXT2_NUM_PTRS_PER_INODE) {
+		return false;
+	}
+	path[0] = &(i->i_block[entry]);
+	for (depth = 0; depth < level; depth++) {
+		if (*path[depth] == 0) {
+			return false; /* Already a hole */
+		}
+		bits -= img->ptr_bits;
+		path[depth + 1] = (uint *)get_valid_block(img, *path[depth]) + (lblk >> bits);
+		lblk &= (1U << bits) - 1;
+	}
+	if (*path[level] == 0) {
+		return false;
+	}
+	unset_inode_block(img, *path[level], i);
+	*path[level] = 0;
+	
+	/* Walk back up, freeing indirect blocks that are now empty */
+	for (depth = level; depth > 0; depth--) {
+		if (!is_zero_block(img, get_block(img, *path[depth - 1]))) {
+			break;
+		}
+		unset_inode_block(img, *path[depth - 1], i);
+		*path[depth - 1] = 0;
+	}
+	return true;
+}
+
+/* Returns a pointer to the entry for logical block lblk of an inode, like
+ * get_inode_block_ptr(), and sets count to how many logical blocks from
+ * lblk on have their entries after it, in i_block or the same indirect
+ * block. NULL means an indirect block on the way is a hole, and so are
+ * those count blocks. A count of 0 means lblk is too big.
+ */
+static uint *get_inode_block_ptrs(image *img, inode *i, uint lblk, uint *count) {
+	uint offset = lblk, level, bits;
+	
+	if (get_block_level(img, &offset, &level, &bits) == EXT2_NUM_PTRS_PER_INODE) {
+		*count = 0;
+		return NULL;
+	}
+	*count = (level == 0 ? EXT2_NUM_SINGLE - lblk 
+				: img->ptrs_per_block - (offset & (img->ptrs_per_block - 1)));
+	return get_inode_block_ptr(img, i, lblk, false);
+}
+
+/* Asks the kernel to start reading len bytes of the image at addr into
+ * memory, so touching them later does not wait on the disk. Only advice.
+ */
+static void advise_bytes(const void *addr, size_t len) {
+	unsigned long mask = (unsigned long)sysconf(_SC_PAGESIZE) - 1;
+	unsigned long start = (unsigned long)addr & ~mask;
+	
+	madvise((void *)start, (unsigned long)addr + len - start, MADV_WILLNEED);
+}
+
+/* Starts a walk over num_blocks logical blocks of an inode, from first.
+ * If read_ahead is true, the data blocks found ahead of the walk are read
+ * ahead too, for callers about to touch them; indirect blocks always are.
+ */
+void start_block_walk(image *img, inode *i, uint first, uint num_blocks, 
+						bool read_ahead, block_walker *w) {
+	memset(w, 0, sizeof(block_walker));
+	w->img = img;
+	w->i = i;
+	w->lblk = first;
+	w->end = first + num_blocks;
+	w->read_ahead = read_ahead;
+}
+
+/* Reads ahead the part of the last extent found that was not yet. */
+static void advise_last_extent(block_walker *w) {
+	block_extent *e;
+	
+	if (w->used == 0) {
+		return;
+	}
+	e = &(w->found[(w->first + w->used - 1) % EXT2_WALK_EXTENTS]);
+	if (w->read_ahead && e->count > w->advised) {
+		advise_bytes(get_block(w->img, e->block + w->advised), 
+						(size_t)(e->count - w->advised) << w->img->block_bits);
+	}
+	w->advised = e->count;
+}
+
+/* Finds extents until EXT2_WALK_AHEAD blocks are ahead of the walk, 
+ * EXT2_WALK_EXTENTS extents are, or there are no blocks left.
+ */
+static void fill_block_walk(block_walker *w) {
+	block_extent *e;
+	uint block, next;
+	uint *ptr;
+	
+	while (w->lblk < w->end && w->ahead < EXT2_WALK_AHEAD) {
+		if (w->ptrs_left == 0) {
+			w->ptrs = get_inode_block_ptrs(w->img, w->i, w->lblk, &(w->ptrs_left));
+			if (w->ptrs_left == 0) {
+				w->lblk = w->end; /* EFBIG */
+				break;
+			}
+			/* Start on the next indirect block while these are used */
+			next = w->lblk + w->ptrs_left;
+			if (next < w->end && next >= EXT2_NUM_SINGLE 
+					&& (ptr = get_inode_block_ptr(w->img, w->i, next, false)) != NULL) {
+				advise_bytes(ptr, sizeof(uint));
+			}
+		}
+		if (w->ptrs == NULL) { /* Hole */
+			w->lblk += w->ptrs_left;
+			w->ptrs_left = 0;
+			continue;
+		}
+		if ((block = *(w->ptrs)) != 0) {
+			e = (w->used == 0 ? NULL 
+					: &(w->found[(w->first + w->used - 1) % EXT2_WALK_EXTENTS]));
+			if (e != NULL && e->block + e->count == block && e->lblk + e->count == w->lblk) {
+				e->count++;
+			} else if (w->used == EXT2_WALK_EXTENTS) {
+				break; /* Full, this one waits */
+			} else {
+				advise_last_extent(w);
+				e = &(w->found[(w->first + w->used++) % EXT2_WALK_EXTENTS]);
+				e->lblk = w->lblk;
+				e->block = block;
+				e->count = 1;
+				w->advised = 0;
+			}
+			w->ahead++;
+		}
+		w->ptrs++;
+		w->ptrs_left--;
+		w->lblk++;
+	}
+	advise_last_extent(w);
+}
+
+/* Gets the next extent of a walk, in logical order. Holes are skipped.
+ * Return false once there are none left.
+ */
+bool next_block_extent(block_walker *w, block_extent *e) {
+	fill_block_walk(w);
+	if (w->used == 0) {
+		return false;
+	}
+	*e = w->found[w->first];
+	w->first = (w->first + 1) % EXT2_WALK_EXTENTS;
+	w->ahead -= e->count;
+	if (--(w->used) == 0) {
+		w->advised = 0;
+	}
+	return true;
+}
+
+/* Returns the number of blocks needed to hold num_blocks data blocks,
+ * including the indirect blocks that point to them.
+ */
+uint get_total_blocks(image *img, uint num_blocks) {
+	uint total = num_blocks, bits = 0;
+	uint level, count, j;
+	
+	for (level = 0; level < EXT2_NUM_TYPES && num_blocks > 0; level++) {
+		/* Data blocks addressed at this level */
+		count = ((num_blocks >> bits) >= TYPES[level] ? TYPES[level] << bits : num_blocks);
+		num_blocks -= count;
+		/* One indirect block per span of pointers at each depth */
+		for (j = bits; j > 0; j -= img->ptr_bits) {
+			total += ((count - 1) >> j) + 1;
+		}
+		bits += img->ptr_bits;
+	}
+	return total;
+}
+
+/* Allocates a new data block at logical block lblk of an inode.
+ * Returns the block index if successful. Otherwise, return 0.
+ */
+uint add_block_at(image *img, inode *i, uint lblk) {
+	uint new_block;
+	uint *block_ptr = get_inode_block_ptr(img, i, lblk, true);
+	
+	if (block_ptr == NULL 
+			|| (new_block = find_free_block(img, find_goal_block(img, i, lblk))) == 0) {
+		return 0; /* ENOSPC */
+	}
+	assert(*block_ptr == 0); /* Must be uninitialized */
+	initialize_block(img, new_block, i, true);
+	
+	*block_ptr = new_block;
+	return new_block;
+}
+
+/* Finds the direct child of a parent inode. */
+uint find_direct_child(image *img, uint parent, char *file) {
+	inode *in;
+	uint ret;
+	
+	if (parent == 0) {
+		return 0;
+	}
+	lock_inode(img, parent, false);
+	if ((in = get_valid_inode(img, parent)) == NULL || !IS(in->i_mode, EXT2_S_IFDIR)) {
+		ret = 0;
+	} else if (file == NULL || strlen(file) == 0 || strcmp(file, DELIMITER) == 0) {
+		/* Referring to root? */
+		ret = parent;
+	} else {
+		ret = perform_on_children(img, in, NULL, file, NULL);
+	}
+	unlock_inode(img, parent, false);
+	return ret;
+}
+
+/* Looks up a symlink in the resolution cache. Return 0 on a miss. */
+static uint get_cached_link(image *img, uint link, uint dir) {
+	link_cache *c = &(img->links[link % EXT2_LINK_CACHE_SIZE]);
+	uint ret;
+	
+	pthread_mutex_lock(&(img->links_lock));
+	ret = (c->link == link && c->dir == dir ? c->target : 0);
+	pthread_mutex_unlock(&(img->links_lock));
+	return ret;
+}
+
+/* Remembers what a symlink in directory dir resolved to. */
+static void set_cached_link(image *img, uint link, uint dir, uint target) {
+	link_cache *c = &(img->links[link % EXT2_LINK_CACHE_SIZE]);
+	
+	pthread_mutex_lock(&(img->links_lock));
+	c->link = link;
+	c->dir = dir;
+	c->target = target;
+	img->links_used = true;
+	pthread_mutex_unlock(&(img->links_lock));
+}
+
+/* Forgets every cached symlink, after anything that changes names. */
+void clear_link_cache(image *img) {
+	pthread_mutex_lock(&(img->links_lock));
+	if (img->links_used) {
+		memset(img->links, 0, sizeof(img->links));
+		img->links_used = false;
+	}
+	pthread_mutex_unlock(&(img->links_lock));
+}
+
+static uint walk_path(image *img, const char *path, uint len, uint start, uint except,
+						uint depth, char *last);
+
+/* Resolves the symlink at index, found in directory dir, to the inode
+ * it points to. Nested symlinks are followed up to EXT2_MAX_SYMLINKS deep.
+ * Return 0 if the target does not exist, with errno ELOOP if too deep.
+ */
+static uint follow_symlink(image *img, uint index, uint dir, uint depth) {
+	char name[EXT2_NAME_LEN + 1];
+	char buf[PATH_MAX];
+	inode *node = get_valid_inode(img, index);
+	const char *target;
+	uint parent, ret, lblk, size, *ptr;
+	
+	if (depth >= EXT2_MAX_SYMLINKS) {
+		errno = ELOOP;
+		return 0;
+	}
+	if ((ret = get_cached_link(img, index, dir)) != 0) {
+		return ret;
+	}
+	
+	/* Read the target in place, from the inode or its only block */
+	if (is_fast_symlink(node)) {
+		target = (const char *)node->i_block;
+	} else if (node->i_size <= img->block_size 
+			&& (ptr = get_inode_block_ptr(img, node, 0, false)) != NULL && *ptr != 0) {
+		target = (const char *)get_valid_block(img, *ptr);
+	} else if (node->i_size <= PATH_MAX) {
+		/* Spans several blocks, gather it on the stack */
+		for (lblk = 0; lblk * img->block_size < node->i_size; lblk++) {
+			size = node->i_size - lblk * img->block_size;
+			if (size > img->block_size) {
+				size = img->block_size;
+			}
+			if ((ptr = get_inode_block_ptr(img, node, lblk, false)) == NULL || *ptr == 0) {
+				return 0;
+			}
+			memcpy(buf + lblk * img->block_size, get_valid_block(img, *ptr), size);
+		}
+		target = buf;
+	} else {
+		return 0; /* ENAMETOOLONG */
+	}
+	
+	parent = walk_path(img, target, node->i_size, dir, 0, depth + 1, name);
+	ret = find_direct_child(img, parent, name);
+	if (ret != 0 && IS_TYPE(get_valid_inode(img, ret)->i_mode, EXT2_S_IFLNK)) {
+		ret = follow_symlink(img, ret, parent, depth + 1);
+	}
+	if (ret != 0) {
+		set_cached_link(img, index, dir, ret);
+	}
+	return ret;
+}
+
+/* Gets the parent inode of the len bytes of path, which need not end in
+ * a null byte. Relative paths start at the directory start. Symlinks in
+ * intermediate components are followed; depth counts those already
+ * followed. The last component is copied into last.
+ * If some intermediate path does not exist, return 0.
+ * If except is found in the path, return 0.
+ * If any component is longer than EXT2_NAME_LEN, return 0 with errno
+ * ENAMETOOLONG.
+ */
+static uint walk_path(image *img, const char *path, uint len, uint start, uint except,
+						uint depth, char *last) {
+	uint curr, parent, temp, pos, end;
+	inode *out;
+	
+	curr = (len > 0 && path[0] == DELIMITER[0] ? EXT2_ROOT_INO : start);
+	parent = curr;
+	last[0] = '\0';
+	
+	for (pos = 0; pos < len; pos = end) {
+		/* Find the next component */
+		while (pos < len && path[pos] == DELIMITER[0]) {
+			pos++;
+		}
+		end = pos;
+		while (end < len && path[end] != DELIMITER[0] && path[end] != '\0') {
+			end++;
+		}
+		if (end == pos) {
+			break;
+		}
+		
+		/* Dereference what is at "curr" */
+		if (curr == except || curr == 0
+				|| (out = get_valid_inode(img, curr)) == NULL) {
+			return 0;
+		}
+		if (IS_TYPE(out->i_mode, EXT2_S_IFLNK)) {
+			curr = follow_symlink(img, curr, parent, depth);
+			if (curr == 0 || !IS_TYPE(get_valid_inode(img, curr)->i_mode, EXT2_S_IFDIR)) {
+				/* The symlink itself is wrong */
+				return 0;
+			}
+		} else if (!IS_TYPE(out->i_mode, EXT2_S_IFDIR)) {
+			return 0;
+		}
+		
+		if (end - pos > EXT2_NAME_LEN) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		memcpy(last, path + pos, end - pos);
+		last[end - pos] = '\0';
+		
+		temp = find_direct_child(img, curr, last);
+		if (temp != curr) {
+			parent = curr;
+			curr = temp;
+		}
+	}
+	return parent;
+}
+
+/* Gets the parent inode of the absolute path provided. 
+ * If some intermediate path does not exist, return 0.
+ * If except is found in the path, return 0.
+ */
+uint get_parent_inode_at_path_except(image *img, char *path, uint except) {
+	TRACE_SPAN(EXT2_TRACE_RESOLVE);
+	char last[EXT2_NAME_LEN + 1];
+	
+	errno = 0; /* So callers can tell ELOOP apart */
+	return walk_path(img, path, strlen(path), EXT2_ROOT_INO, except, 0, last);
+}
+
+
+/* Gets the parent inode of the absolute path provided. 
+ * If some intermediate path does not exist, return 0
+ */
+uint get_parent_inode_at_path(image *img, char *path) {
+	return get_parent_inode_at_path_except(img, path, 0);
 }
 
 /* Gets the inode at the absolute path provided. 
  * If some intermediate path does not exist, return 0
  */
-uint get_inode_name_at_path_except(char *path, char *last_token, uint except) {
-	return find_direct_child(get_parent_inode_at_path_except(path, except), 
+uint get_inode_name_at_path_except(image *img, char *path, char *last_token, 
+						uint except) {
+	return find_direct_child(img, get_parent_inode_at_path_except(img, path, except), 
 								last_token);
 }
 
 /* Gets the inode at the absolute path provided. 
  * If some intermediate path does not exist, return 0
  */
-uint get_inode_at_path_except(char *path, uint except) {
-	uint parent = get_parent_inode_at_path_except(path, except);					
+uint get_inode_at_path_except(image *img, char *path, uint except) {
+	uint parent = get_parent_inode_at_path_except(img, path, except);					
 	char *last_token = find_last_token(path);
-	return find_direct_child(parent, last_token);
+	return find_direct_child(img, parent, last_token);
 }
 
 /* Gets the inode at the absolute path provided. 
  * If some intermediate path does not exist, return 0
  */
-uint get_inode_name_at_path(char *path, char *last_token) {
-	return get_inode_name_at_path_except(path, last_token, 0);
+uint get_inode_name_at_path(image *img, char *path, char *last_token) {
+	return get_inode_name_at_path_except(img, path, last_token, 0);
 }
 
 /* Gets the inode at the absolute path provided. 
  * If some intermediate path does not exist, return 0
  */
-uint get_inode_at_path(char *path) {
-	return get_inode_at_path_except(path, 0);
+uint get_inode_at_path(image *img, char *path) {
+	return get_inode_at_path_except(img, path, 0);
 }
 
-/* Adds a directory entry to an inode.
+/* Adds a directory entry to an inode, whose lock the caller holds.
  * Return true on success, false if no space left.
  */
-bool add_dir_entry(inode *p, uint index, ubyte file_type, char *name) {
+static bool insert_dir_entry(image *img, inode *p, uint index, ubyte file_type, 
+								char *name) {
 	uint str_len = strlen(name);
-	uint *block, block_index;
+	uint block_index;
 	dir_entry *d, *new_d;
 	uint dir_size, other_dir_size;
 	ushort old_location;
 	ubyte len;
 	ubyte *block_ptr;
-	inode *v = get_valid_inode(index);
+	inode *v = get_valid_inode(img, index);
 	
 	/* Must be a directory */
 	assert(is_inode_valid(p) && v != NULL && IS(p->i_mode, EXT2_S_IFDIR));
@@ -746,26 +2267,17 @@ bool add_dir_entry(inode *p, uint index, ubyte file_type, char *name) {
 	}
 	dir_size = len + EXT2_DIR_DEFAULT_SIZE;
 	/* Check if we have space */
-	block = get_free_block_ptr(p, dir_size, has_free_dir_entry);
-	if (block == NULL) {
+	if ((block_index = find_dir_block(img, p, dir_size)) == 0) {
 		return false; /* ENOSPC */
 	}
-	block_index = *block;
-	if (block_index == 0 || !get_block_bitmap(block_index)) { 
-		/* Uninitialized block */
-		block_index = add_new_block_to_inode(p);
-		if (block_index == 0) { /* No room, ENOSPC */
-			return false;
-		}
-	}
-	block_ptr = get_valid_block(block_index);
+	block_ptr = get_valid_block(img, block_index);
 	
-	d = get_free_dir_entry(block_index, dir_size);
+	d = get_free_dir_entry(img, block_index, dir_size);
 	
 	if (d->inode == 0) { /* Uninitialized, we just use this one */
 		new_d = d;
 		/* Go to end of block */
-		new_d->rec_len = (EXT2_BLOCK_SIZE - ((ubyte *)new_d - block_ptr));
+		new_d->rec_len = (img->block_size - ((ubyte *)new_d - block_ptr));
 	} else { /* Set rec_len to appropriate value, align to 4 bytes */
 		other_dir_size = d->name_len + EXT2_DIR_DEFAULT_SIZE;
 		old_location = d->rec_len; /* Save where it pointed */
@@ -775,67 +2287,116 @@ bool add_dir_entry(inode *p, uint index, ubyte file_type, char *name) {
 		new_d->rec_len = old_location - d->rec_len;
 	}
 	
+	clear_link_cache(img);
 	new_d->inode = index;
 	new_d->file_type = file_type;
 	new_d->name_len = len;
 	strncpy(new_d->name, name, new_d->name_len);
 	
-	/* New link to this inode */
-	v->i_links_count++;
-	v->i_mtime = curr_time;
+	/* New link to this inode, which other directories may be linking too */
+	ADD_COUNT(v->i_links_count, 1);
+	v->i_mtime = img->curr_time;
+	update_inode_summary(img, v);
 	return true;
 }
 
-/* Finds and initializes a new inode. Return NULL if not enough space. */
-inode *new_inode(uint parent, uint num_blocks, ushort mode, char *name) {
+/* Adds a directory entry to an inode, holding its lock.
+ * Return true on success. Otherwise, return false with errno EEXIST if
+ * the name is taken, ENOENT if the directory is gone, or ENOSPC.
+ */
+bool add_dir_entry(image *img, inode *p, uint index, ubyte file_type, char *name) {
+	uint parent = get_inode_index(img, p);
+	bool ret = false;
+	
+	lock_inode(img, parent, true);
+	if (!get_inode_bitmap(img, parent) || !is_inode_valid(p)) {
+		errno = ENOENT; /* Removed before we got the lock */
+	} else if (perform_on_children(img, p, NULL, name, NULL) != 0) {
+		errno = EEXIST;
+	} else if (!(ret = insert_dir_entry(img, p, index, file_type, name))) {
+		errno = ENOSPC;
+	}
+	unlock_inode(img, parent, true);
+	return ret;
+}
+
+/* Finds and initializes a new inode, then adds it to the parent.
+ * Return NULL if not enough space, with errno as for add_dir_entry().
+ */
+inode *new_inode(image *img, uint parent, uint num_blocks, ushort mode, char *name) {
+	TRACE_SPAN(EXT2_TRACE_NEW_INODE);
 	uint index;
 	inode *i;
-	inode *p = get_valid_inode(parent);
+	inode *p = get_valid_inode(img, parent);
 	
 	/* If directory, needs a block */
 	assert(num_blocks > 0 || !IS(mode, EXT2_S_IFDIR));
 	
-	if (p == NULL || !IS(p->i_mode, EXT2_S_IFDIR) || !has_space(1, num_blocks)) {
+	errno = ENOSPC;
+	if (p == NULL || !IS(p->i_mode, EXT2_S_IFDIR) 
+			|| !has_space(img, 1, get_total_blocks(img, num_blocks))
+			|| (index = find_free_inode(img, parent, IS(mode, EXT2_S_IFDIR))) == 0) {
 		return NULL;
 	}
 	
-	index = find_free_inode();
-	assert(index != 0);
-	
-	initialize_inode(index, true);
+	initialize_inode(img, index, true);
 	
-	i = get_valid_inode(index);
+	i = get_valid_inode(img, index);
 	assert (i != NULL);
 	
-	/* Add to parent */
-	if (!add_dir_entry(p, index, to_dir_type(mode), name)) {
-		return NULL;
-	}
 	i->i_mode = mode;
 	if (IS(mode, EXT2_S_IFDIR)) {
-		/* Add . and .. */
-		if (!add_dir_entry(i, index, EXT2_FT_DIR, ".") 
-				|| !add_dir_entry(i, parent, EXT2_FT_DIR, "..")) {
+		/* Add . and .. while no other thread can see the directory */
+		set_dir_hint(img, index, 0);
+		if (!insert_dir_entry(img, i, index, EXT2_FT_DIR, ".") 
+				|| !insert_dir_entry(img, i, parent, EXT2_FT_DIR, "..")) {
 			return NULL;
 		}
 		/* One more used directory count */
-		gd->bg_used_dirs_count++;
+		ADD_COUNT(get_inode_group(img, index)->bg_used_dirs_count, 1);
 	}
 	
-	
+	/* Add to parent */
+	if (!add_dir_entry(img, p, index, to_dir_type(mode), name)) {
+		/* Give the inode back */
+		if (IS(mode, EXT2_S_IFDIR)) {
+			ADD_COUNT(p->i_links_count, -1);
+			update_inode_summary(img, p);
+		}
+		i->i_links_count = 0;
+		initialize_inode(img, index, false);
+		return NULL;
+	}
+	update_inode_summary(img, i);
 	return i;
 }
 
+/* Frees the data blocks of an inode below lblk, and empties it, after
+ * a write into it ran out of space partway.
+ */
+static void unwrite_file_data(image *img, inode *i, uint lblk) {
+	while (lblk > 0) {
+		unset_block_at(img, i, --lblk);
+	}
+	i->i_size = 0;
+	update_inode_summary(img, i);
+}
+
 /* Writes a buffer into an inode.
- * Assumes that num_blocks free blocks are needed and checked for already.
+ * Assumes that num_blocks free blocks are needed and checked for already,
+ * but other writers sharing the image may take them meanwhile.
+ * Return false if they did, with errno set to ENOSPC and the inode left
+ * empty.
  */
-void write_file_data(inode *i, uint num_blocks, uint len, char *data) {
-	uint index, written;
+bool write_file_data(image *img, inode *i, uint num_blocks, uint len, char *data) {
+	TRACE_SPAN(EXT2_TRACE_WRITE);
+	uint index, written, lblk;
 	ubyte *ptr;
 	
 	/* Must be a file */
 	assert(!IS(i->i_mode, EXT2_S_IFDIR));
 	
+	i->i_size = len;
 	if (len > 0) {
 		if (num_blocks == 0) {
 			/* Store into blocks */
@@ -843,42 +2404,426 @@ void write_file_data(inode *i, uint num_blocks, uint len, char *data) {
 			
 			memcpy((char *)(i->i_block), data, len);
 		} else {
-			while (len > 0 && num_blocks > 0) {
-				index = add_new_block_to_inode(i);
-				ptr = get_valid_block(index);
-				
-				if (len > EXT2_BLOCK_SIZE) {
-					written = EXT2_BLOCK_SIZE;
+			for (lblk = 0; len > 0 && lblk < num_blocks; lblk++) {
+				if (len > img->block_size) {
+					written = img->block_size;
 				} else {
 					written = len;
 				}
-				memcpy((char *)ptr, data, written);
+				/* Whole blocks of zeros are left as holes */
+				if (written < img->block_size || !is_zero_block(img, (ubyte *)data)) {
+					if ((index = add_block_at(img, i, lblk)) == 0) {
+						unwrite_file_data(img, i, lblk);
+						errno = ENOSPC;
+						return false;
+					}
+					ptr = get_valid_block(img, index);
+					memcpy((char *)ptr, data, written);
+				}
 				len -= written;
 				data += written;
-				num_blocks--;
 			}
 		}
 	}
-	i->i_size = len;
+	update_inode_summary(img, i);
+	return true;
+}
+
+/* Sets the size of regular file i, whose lock the caller holds. Blocks
+ * past the new end are freed, from the last one back, along with the
+ * indirect blocks they leave empty, and the rest of the new last block
+ * is zeroed. Growing leaves a hole. Only the blocks between the old and
+ * new ends are looked at, however big the file is.
+ */
+void set_file_size(image *img, inode *i, uint size) {
+	uint keep = (uint)(((unsigned long long)size + img->block_size - 1) >> img->block_bits);
+	uint lblk = (uint)(((unsigned long long)i->i_size + img->block_size - 1) 
+							>> img->block_bits);
+	uint off = size & (img->block_size - 1), *ptr;
+	
+	assert(IS_TYPE(i->i_mode, EXT2_S_IFREG));
+	
+	if (size < i->i_size) {
+		for (; lblk > keep; lblk--) {
+			unset_block_at(img, i, lblk - 1);
+		}
+		/* So the bytes past the end read as zeros if it grows again */
+		if (off != 0 && (ptr = get_inode_block_ptr(img, i, keep - 1, false)) != NULL 
+				&& *ptr != 0) {
+			memset(get_block(img, *ptr) + off, 0, img->block_size - off);
+		}
+	}
+	i->i_size = size;
+	i->i_mtime = img->curr_time;
+	i->i_ctime = img->curr_time;
+	update_inode_summary(img, i);
+}
+
+/* Truncates or extends regular file index to size bytes, holding its
+ * lock. See set_file_size().
+ * Return false if it is not a regular file, with errno set.
+ */
+bool truncate_file(image *img, uint index, uint size) {
+	inode *i;
+	bool ret = false;
+	
+	lock_inode(img, index, true);
+	if ((i = get_valid_inode(img, index)) == NULL) {
+		errno = ENOENT;
+	} else if (!IS_TYPE(i->i_mode, EXT2_S_IFREG)) {
+		errno = (IS(i->i_mode, EXT2_S_IFDIR) ? EISDIR : EINVAL);
+	} else {
+		set_file_size(img, i, size);
+		ret = true;
+	}
+	unlock_inode(img, index, true);
+	return ret;
+}
+
+/* Rewrites the blocks of regular file i that differ from the next n
+ * blocks of buf, starting at lblk. Blocks that become all zeros are
+ * freed to holes, and holes only get blocks if data lands in them.
+ * Return the number of blocks changed, or -1 with errno set to ENOSPC.
+ */
+static int update_blocks(image *img, inode *i, const ubyte *buf, uint lblk, uint n) {
+	const ubyte *data;
+	uint k, block, *ptr;
+	int changed = 0;
+	
+	for (k = 0; k < n; k++, lblk++, buf += img->block_size) {
+		ptr = get_inode_block_ptr(img, i, lblk, false);
+		if (ptr == NULL || *ptr == 0) {
+			if (is_zero_block(img, buf)) {
+				continue; /* Still a hole */
+			}
+			if ((block = add_block_at(img, i, lblk)) == 0) {
+				errno = ENOSPC;
+				return -1;
+			}
+			memcpy(get_block(img, block), buf, img->block_size);
+		} else {
+			data = get_block(img, *ptr);
+			if (is_same_block(img, buf, data)) {
+				continue;
+			}
+			if (is_zero_block(img, buf)) {
+				unset_block_at(img, i, lblk);
+			} else {
+				memcpy((ubyte *)data, buf, img->block_size);
+			}
+		}
+		changed++;
+	}
+	return changed;
+}
+
+/* Updates regular file index in place to hold the len bytes of the host
+ * file src, holding its lock. Each block is compared with the host file,
+ * and only blocks that differ are written; blocks are only allocated or
+ * freed where the file grows, shrinks, or gains or loses a hole. If it
+ * runs out of space part way, the blocks already compared are updated.
+ * Return the number of blocks changed, or -1 on failure with errno set.
+ */
+int update_file(image *img, uint index, int src, uint len) {
+	uint num_blocks = DIV_UP(len, img->block_size), lblk, n, bytes, off;
+	ubyte *buf;
+	inode *i;
+	int changed = 0, ret;
+	
+	if ((buf = malloc((size_t)EXT2_WALK_AHEAD * img->block_size)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	lock_inode(img, index, true);
+	if ((i = get_valid_inode(img, index)) == NULL) {
+		errno = ENOENT;
+		changed = -1;
+	} else if (!IS_TYPE(i->i_mode, EXT2_S_IFREG)) {
+		errno = (IS(i->i_mode, EXT2_S_IFDIR) ? EISDIR : EINVAL);
+		changed = -1;
+	} else if (i->i_size != len) {
+		/* Frees what is past the end, or leaves a hole to fill */
+		set_file_size(img, i, len);
+	}
+	for (lblk = 0; changed >= 0 && lblk < num_blocks; lblk += n) {
+		n = (num_blocks - lblk < EXT2_WALK_AHEAD ? num_blocks - lblk : EXT2_WALK_AHEAD);
+		off = lblk * img->block_size;
+		bytes = (len - off < n * img->block_size ? len - off : n * img->block_size);
+		if (pread(src, buf, bytes, (off_t)off) != (ssize_t)bytes) {
+			errno = EIO;
+			changed = -1;
+			break;
+		}
+		/* Past the end of the file reads as zeros */
+		memset(buf + bytes, 0, (size_t)n * img->block_size - bytes);
+		if ((ret = update_blocks(img, i, buf, lblk, n)) < 0) {
+			changed = -1;
+		} else {
+			changed += ret;
+		}
+	}
+	if (i != NULL && IS_TYPE(i->i_mode, EXT2_S_IFREG) && changed != 0) {
+		i->i_mtime = img->curr_time;
+		i->i_ctime = img->curr_time;
+		update_inode_summary(img, i);
+	}
+	unlock_inode(img, index, true);
+	free(buf);
+	return changed;
+}
+
+/* Hashes the first len bytes of a file on the image, a block at a time
+ * like hash_source(). Holes hash as zeros.
+ */
+static unsigned long long hash_inode_data(image *img, inode *i, uint len) {
+	static const ubyte zeros[EXT2_MAX_BLOCK_SIZE];
+	unsigned long long hash = 0;
+	uint num_blocks = DIV_UP(len, img->block_size), lblk = 0, end, n;
+	block_walker w;
+	block_extent e;
+	bool more = true;
+	
+	start_block_walk(img, i, 0, num_blocks, true, &w);
+	while (more) {
+		more = next_block_extent(&w, &e);
+		end = (more ? e.lblk + e.count : num_blocks);
+		for (; lblk < end; lblk++) {
+			n = (len - lblk * img->block_size < img->block_size 
+					? len - lblk * img->block_size : img->block_size);
+			hash = hash_data((more && lblk >= e.lblk 
+								? get_block(img, e.block + (lblk - e.lblk)) : zeros), n, hash);
+		}
+	}
+	return hash;
+}
+
+/* Hashes the first len bytes of a native file, a block at a time.
+ * Return false if it could not be read.
+ */
+static bool hash_source(image *img, int src, uint len, unsigned long long *hash) {
+	ubyte buf[EXT2_MAX_BLOCK_SIZE];
+	uint lblk, n;
+	
+	*hash = 0;
+	for (lblk = 0; (size_t)lblk * img->block_size < len; lblk++) {
+		n = (len - lblk * img->block_size < img->block_size 
+				? len - lblk * img->block_size : img->block_size);
+		if (pread(src, buf, n, (off_t)lblk * img->block_size) != (ssize_t)n) {
+			return false;
+		}
+		*hash = hash_data(buf, n, *hash);
+	}
+	return true;
+}
+
+/* Return true if a file on the image holds the same len bytes as src. */
+static bool is_same_data(image *img, inode *i, int src, uint len) {
+	static const ubyte zeros[EXT2_MAX_BLOCK_SIZE];
+	ubyte buf[EXT2_MAX_BLOCK_SIZE];
+	const ubyte *data;
+	uint lblk, n, *ptr;
+	
+	for (lblk = 0; (size_t)lblk * img->block_size < len; lblk++) {
+		n = (len - lblk * img->block_size < img->block_size 
+				? len - lblk * img->block_size : img->block_size);
+		if (pread(src, buf, n, (off_t)lblk * img->block_size) != (ssize_t)n) {
+			return false;
+		}
+		ptr = get_inode_block_ptr(img, i, lblk, false);
+		data = (ptr == NULL || *ptr == 0 ? zeros : get_block(img, *ptr));
+		if (n == img->block_size ? !is_same_block(img, buf, data) : memcmp(buf, data, n) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Adds a regular file to the duplicate index, under dups_lock.
+ * Return false if out of memory.
+ */
+static bool add_dup_file(image *img, uint index, uint size, uint mtime, 
+							unsigned long long hash) {
+	dup_file *d;
+	uint bucket = size % EXT2_DUP_BUCKETS;
+	
+	if (img->dups_used == img->dups_size) {
+		d = realloc(img->dups, (img->dups_size * 2 + 64) * sizeof(dup_file));
+		if (d == NULL) {
+			return false;
+		}
+		img->dups = d;
+		img->dups_size = img->dups_size * 2 + 64;
+	}
+	d = &(img->dups[img->dups_used++]);
+	d->index = index;
+	d->size = size;
+	d->mtime = mtime;
+	d->hash = hash;
+	d->next = img->dup_buckets[bucket];
+	img->dup_buckets[bucket] = img->dups_used;
+	return true;
+}
+
+/* Indexes the regular files on the image by size, the first time it is
+ * needed, under dups_lock. Contents are only hashed once a file of the
+ * same size is copied in. Return false if out of memory.
+ */
+static bool index_dup_files(image *img) {
+	inode_summary *s = NULL;
+	ushort mode, links;
+	uint index, size;
+	inode *i;
+	
+	if (img->dup_buckets != NULL) {
+		return true;
+	}
+	if ((img->dup_buckets = calloc(EXT2_DUP_BUCKETS, sizeof(uint))) == NULL) {
+		return false;
+	}
+	/* Entries are checked again when linking, so the summary will do */
+	if (build_inode_summary(img)) {
+		s = img->summary;
+	}
+	for (index = img->sb->s_first_ino; index <= img->sb->s_inodes_count; index++) {
+		if (!is_inode_live(img, index)) {
+			continue;
+		}
+		if (s != NULL) {
+			mode = s->mode[index];
+			links = s->links[index];
+			size = s->size[index];
+		} else {
+			i = get_inode(img, index);
+			mode = i->i_mode;
+			links = i->i_links_count;
+			size = i->i_size;
+		}
+		if (IS_TYPE(mode, EXT2_S_IFREG) && links > 0 && size > 0 
+				&& !add_dup_file(img, index, size, 0, 0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Takes an extra link on a regular file, so that it is not freed while
+ * being compared and linked. Return false if it is gone.
+ */
+static bool pin_file(image *img, uint index) {
+	inode *i = get_inode(img, index);
+	bool ret;
+	
+	lock_inode(img, index, true);
+	ret = get_inode_bitmap(img, index) && is_inode_valid(i) 
+			&& IS_TYPE(i->i_mode, EXT2_S_IFREG) && i->i_links_count > 0;
+	if (ret) {
+		ADD_COUNT(i->i_links_count, 1);
+		update_inode_summary(img, i);
+	}
+	unlock_inode(img, index, true);
+	return ret;
+}
+
+/* Drops the link taken by pin_file(), freeing the file if it was the
+ * last one.
+ */
+static void unpin_file(image *img, uint index) {
+	lock_inode(img, index, true);
+	if (ADD_COUNT(get_inode(img, index)->i_links_count, -1) == 0) {
+		initialize_inode(img, index, false);
+	} else {
+		update_inode_summary(img, get_inode(img, index));
+	}
+	unlock_inode(img, index, true);
+}
+
+/* Links name in directory parent to a regular file on the image that
+ * holds the same len bytes as src, if there is one, instead of copying.
+ * Candidates are found by size and hash, then compared byte for byte.
+ * Also sets hash to the hash of src, for remember_file().
+ * Return the inode linked, or 0 if there is no duplicate (or it could
+ * not be linked, with errno as for add_dir_entry()).
+ */
+uint link_duplicate(image *img, uint parent, int src, uint len, 
+						char *name, unsigned long long *hash) {
+	inode *p = get_valid_inode(img, parent);
+	dup_file *d;
+	inode *i;
+	uint next, ret = 0;
+	
+	errno = ENOENT;
+	if (len == 0 || p == NULL || !hash_source(img, src, len, hash)) {
+		return 0;
+	}
+	pthread_mutex_lock(&(img->dups_lock));
+	if (!index_dup_files(img)) {
+		pthread_mutex_unlock(&(img->dups_lock));
+		errno = ENOMEM;
+		return 0;
+	}
+	for (next = img->dup_buckets[len % EXT2_DUP_BUCKETS]; next != 0 && ret == 0; 
+						next = d->next) {
+		d = &(img->dups[next - 1]);
+		if (d->size != len || !pin_file(img, d->index)) {
+			continue;
+		}
+		i = get_inode(img, d->index);
+		if (i->i_size == len && (d->hash == 0 || d->mtime != i->i_mtime)) {
+			/* Not hashed yet, or changed since */
+			d->mtime = i->i_mtime;
+			d->hash = hash_inode_data(img, i, len);
+		}
+		if (i->i_size == len && d->hash == *hash && is_same_data(img, i, src, len)
+				&& add_dir_entry(img, p, d->index, EXT2_FT_REG_FILE, name)) {
+			ret = d->index;
+		}
+		unpin_file(img, d->index);
+	}
+	pthread_mutex_unlock(&(img->dups_lock));
+	return ret;
+}
+
+/* Remembers a regular file just copied in, whose contents hash to hash,
+ * so later copies of it can be linked to it.
+ */
+void remember_file(image *img, inode *i, unsigned long long hash) {
+	pthread_mutex_lock(&(img->dups_lock));
+	if (img->dup_buckets != NULL && i->i_size > 0) {
+		add_dup_file(img, get_inode_index(img, i), i->i_size, i->i_mtime, hash);
+	}
+	pthread_mutex_unlock(&(img->dups_lock));
 }
 
 /* Removes a directory entry from an inode. */
-bool remove_dir_entry(inode *parent, char *name) {
+bool remove_dir_entry(image *img, inode *parent, char *name) {
 	dir_entry *prev, *ret;
-	uint block = get_block_with_entry(parent, name);
+	uint block = get_block_with_entry(img, parent, name);
+	name_key key;
+	uint dir, lblk, *ptr;
 	
 	if (block == 0) {
 		return false; /* No directory entry exists */
 	}
+	/* Room opens up in this block, so inserts look at it again */
+	dir = get_inode_index(img, parent);
+	for (lblk = 0; lblk < get_dir_hint(img, dir); lblk++) {
+		ptr = get_inode_block_ptr(img, parent, lblk, false);
+		if (ptr != NULL && *ptr == block) {
+			set_dir_hint(img, dir, lblk);
+			break;
+		}
+	}
 	/* block is a direct block index */
 	/* Get the directory entries before and this one too */
-	prev = search_inner_block(parent, block, NULL, name, 0, NULL, true);
-	ret = search_inner_block(parent, block, NULL, name, 0, NULL, false);
+	make_name_key(name, &key);
+	prev = search_inner_block(img, parent, block, NULL, &key, 0, NULL, true);
+	ret = search_inner_block(img, parent, block, NULL, &key, 0, NULL, false);
 	if (prev != NULL) { 
 		/* Skip over ret entirely */
 		prev->rec_len += ret->rec_len;
 	}
 	/* Zero out the entries */
+	clear_link_cache(img);
 	ret->inode = 0;
 	memset(ret->name, 0, ret->name_len);
 	ret->name_len = 0;
@@ -886,94 +2831,530 @@ bool remove_dir_entry(inode *parent, char *name) {
 	return true;
 }
 
-/* Removes a child from a parent inode. */
-void remove_child(dir_entry *entry, inode *parent) {
-	char *dup = strndup(entry->name, entry->name_len);
-	if (!is_special_dir(entry)) {
-		remove_entry(entry->inode, dup, parent);
-	} else {
-		remove_dir_entry(parent, dup);
+/* Gets the next live entry of the directory a walk is at, skipping
+ * holes, and moves past it. Return NULL once there are none left.
+ */
+static dir_entry *next_tree_entry(image *img, tree_frame *t) {
+	inode *d = get_inode(img, t->dir);
+	dir_entry *entry;
+	uint *ptr;
+	
+	while (t->lblk < d->i_size >> img->block_bits) {
+		if (t->block == NULL && t->off == 0 
+				&& (ptr = get_inode_block_ptr(img, d, t->lblk, false)) != NULL && *ptr != 0) {
+			t->block = get_block(img, *ptr);
+		}
+		entry = (dir_entry *)(t->block + t->off);
+		if (t->block == NULL || t->off >= img->block_size 
+				|| entry->rec_len < (uint)EXT2_DIR_DEFAULT_SIZE + entry->name_len
+				|| t->off + entry->rec_len > img->block_size) {
+			/* Done with this block, or it is a hole or corrupt */
+			t->lblk++;
+			t->off = 0;
+			t->block = NULL;
+			continue;
+		}
+		t->off += entry->rec_len;
+		if ((entry->inode == EXT2_ROOT_INO || (entry->inode >= img->sb->s_first_ino
+					&& entry->inode <= img->sb->s_inodes_count))
+				&& get_inode_bitmap(img, entry->inode)
+				&& is_inode_valid(get_inode(img, entry->inode))) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Adds a level to a walk, for directory dir reached through entry,
+ * locking it unless it is the top. Return false if out of memory, or
+ * the walk is deeper than there are inodes (so the tree has a loop).
+ */
+static bool push_tree_frame(tree_walk *w, uint dir, dir_entry *entry) {
+	tree_frame *frames, *t;
+	size_t len = (w->depth == 0 ? 0 : w->frames[w->depth - 1].path_len);
+	char *path;
+	
+	if (w->depth >= w->img->sb->s_inodes_count) {
+		errno = ELOOP;
+		return false;
+	}
+	if (w->depth == w->size) {
+		if ((frames = realloc(w->frames, w->size * 2 * sizeof(tree_frame))) == NULL) {
+			return false;
+		}
+		w->frames = frames;
+		w->size *= 2;
+	}
+	/* The path, plus / and the name, plus the terminator */
+	if (entry != NULL && len + entry->name_len + 2 > w->path_size) {
+		if ((path = realloc(w->path, (len + entry->name_len + 2) * 2)) == NULL) {
+			return false;
+		}
+		w->path = path;
+		w->path_size = (len + entry->name_len + 2) * 2;
+	}
+	if (entry != NULL) {
+		if (len == 0 || w->path[len - 1] != '/') {
+			w->path[len++] = '/';
+		}
+		memcpy(w->path + len, entry->name, entry->name_len);
+		len += entry->name_len;
+		w->path[len] = '\0';
+		lock_inode(w->img, dir, w->exclusive);
+	}
+	t = &(w->frames[w->depth++]);
+	memset(t, 0, sizeof(tree_frame));
+	t->dir = dir;
+	t->entry = entry;
+	t->path_len = len;
+	return true;
+}
+
+/* Removes the deepest level of a walk, unlocking it unless it is the top. */
+static void pop_tree_frame(tree_walk *w) {
+	tree_frame *t = &(w->frames[--w->depth]);
+	
+	if (w->depth > 0) {
+		unlock_inode(w->img, t->dir, w->exclusive);
+		w->path[w->frames[w->depth - 1].path_len] = '\0';
+	}
+}
+
+/* Walks the tree under directory top, whose path is path, depth first
+ * and without recursing, calling f on:
+ *	EXT2_VISIT_DIR with each directory and the entry leading to it (NULL
+ *		for top), before its entries. EXT2_WALK_SKIP skips them.
+ *	EXT2_VISIT_ENTRY with each live entry and the directory holding it.
+ *		Unless EXT2_WALK_SKIP is returned, the walk then goes into it, if
+ *		it still refers to a directory and is not . or ..
+ *	EXT2_VISIT_LEAVE with each directory and the entry leading to it,
+ *		once everything below it was visited.
+ * The walk's path is that of the directory at hand throughout. Entries
+ * are handed over in place, so f may change them, but not move them.
+ * The caller holds the lock on top; directories below it are locked
+ * (exclusively if exclusive is true) while they are walked.
+ * Return false if the walk was stopped, or could not go on.
+ */
+bool walk_tree(image *img, uint top, const char *path, bool exclusive,
+			tree_step (*f)(tree_walk *, tree_visit, uint, dir_entry *, void *), void *arg) {
+	tree_walk w;
+	tree_frame *t;
+	dir_entry *entry;
+	tree_step step;
+	uint child;
+	bool ret;
+	
+	memset(&w, 0, sizeof(w));
+	w.img = img;
+	w.exclusive = exclusive;
+	w.f = f;
+	w.arg = arg;
+	w.size = EXT2_WALK_FRAMES;
+	w.path_size = strlen(path) + 1;
+	if ((w.frames = malloc(w.size * sizeof(tree_frame))) == NULL
+			|| (w.path = strdup(path)) == NULL) {
+		print_error(img->err, "malloc");
+		free(w.frames);
+		return false;
+	}
+	push_tree_frame(&w, top, NULL);
+	w.frames[0].path_len = w.path_size - 1;
+	step = f(&w, EXT2_VISIT_DIR, top, NULL, arg);
+	
+	while (w.depth > 0 && step != EXT2_WALK_STOP) {
+		t = &(w.frames[w.depth - 1]);
+		if (step == EXT2_WALK_SKIP || (entry = next_tree_entry(img, t)) == NULL) {
+			/* Nothing more below this one */
+			step = f(&w, EXT2_VISIT_LEAVE, t->dir, t->entry, arg);
+			pop_tree_frame(&w);
+			continue;
+		}
+		child = entry->inode; /* f may clear it */
+		step = f(&w, EXT2_VISIT_ENTRY, t->dir, entry, arg);
+		if (step != EXT2_WALK_CONTINUE || is_special_dir(entry) || entry->inode != child
+				|| !IS_TYPE(get_inode_mode(img, child), EXT2_S_IFDIR)) {
+			step = (step == EXT2_WALK_STOP ? step : EXT2_WALK_CONTINUE);
+			continue;
+		}
+		if (!push_tree_frame(&w, child, entry)) {
+			print_error(img->err, "walk_tree");
+			step = EXT2_WALK_STOP;
+			break;
+		}
+		step = f(&w, EXT2_VISIT_DIR, child, entry, arg);
+	}
+	
+	/* Stopped partway, so let go of the levels still walked */
+	ret = (w.depth == 0);
+	while (w.depth > 0) {
+		pop_tree_frame(&w);
+	}
+	free(w.frames);
+	free(w.path);
+	return ret;
+}
+
+/* Removes everything under directory top, for walk_tree(). Files lose
+ * a link, and directories are freed once emptied. Their entries are
+ * cleared in place, since their blocks go with them, so they are not
+ * looked up again by name.
+ */
+static tree_step remove_tree_entry(tree_walk *w, tree_visit visit, uint dir, 
+										dir_entry *entry, void *arg) {
+	image *img = w->img;
+	inode *i;
+	
+	(void)arg;
+	if (visit == EXT2_VISIT_DIR || entry == NULL) {
+		return EXT2_WALK_CONTINUE; /* The top is freed by the caller */
 	}
-	free(dup);
+	if (visit == EXT2_VISIT_LEAVE) {
+		/* Every link to it was from the tree, so it goes with it */
+		get_inode(img, dir)->i_links_count = 0;
+		initialize_inode(img, dir, false);
+	} else if (!is_special_dir(entry)) {
+		i = get_inode(img, entry->inode);
+		if (IS_TYPE(i->i_mode, EXT2_S_IFDIR)) {
+			return EXT2_WALK_CONTINUE; /* Cleared once left */
+		}
+		/* Files are locked too, see unlink_entry() */
+		lock_inode(img, entry->inode, true);
+		if (ADD_COUNT(i->i_links_count, -1) == 0 || IS_TYPE(i->i_mode, EXT2_S_IFLNK)) {
+			i->i_links_count = 0;
+			initialize_inode(img, entry->inode, false);
+		} else {
+			update_inode_summary(img, i);
+		}
+		unlock_inode(img, entry->inode, true);
+	}
+	entry->inode = 0;
+	return EXT2_WALK_CONTINUE;
 }
 
-/* Removes an entry from parent. */
-bool remove_entry(uint curr, char *name, inode *p) {
-	inode *s = get_valid_inode(curr);
+/* Removes an entry from parent, whose lock the caller holds.
+ * A directory stays locked until it is freed, so that nothing is 
+ * added to it meanwhile.
+ */
+static bool unlink_entry(image *img, uint curr, char *name, inode *p) {
+	inode *s = get_valid_inode(img, curr);
+	bool dir, ret = false;
 	
 	assert(s != NULL && p != NULL);
 	
-	/* If directory, recurse */
-	if (IS(s->i_mode, EXT2_S_IFDIR)) {
-		perform_on_children(s, NULL, NULL, remove_child);
+	/* Files are locked too, so the last link is not dropped while
+	 * link_duplicate() takes another */
+	lock_inode(img, curr, true);
+	
+	/* If directory, empty it first */
+	if ((dir = IS_TYPE(s->i_mode, EXT2_S_IFDIR))) {
+		clear_link_cache(img);
+		if (!walk_tree(img, curr, name, true, remove_tree_entry, NULL)) {
+			unlock_inode(img, curr, true);
+			return false;
+		}
 	}
 	
+	if (remove_dir_entry(img, p, name)) {
+		if (dir) {
+			/* Its .. no longer links to p */
+			ADD_COUNT(p->i_links_count, -1);
+			update_inode_summary(img, p);
+		}
+		if (dir || ADD_COUNT(s->i_links_count, -1) == 0 
+					|| IS_TYPE(s->i_mode, EXT2_S_IFLNK)) {
+			/* Must remove inode */
+			s->i_links_count = 0;
+			initialize_inode(img, curr, false);
+		} else {
+			update_inode_summary(img, s);
+		}
+		ret = true;
+	}
 	
-	if (!remove_dir_entry(p, name)) {
-		return false;
+	unlock_inode(img, curr, true);
+	return ret;
+}
+
+/* Calls f on every entry of directory p, live or not, along with the
+ * directory block holding it. Stops early if f returns false.
+ */
+static void for_each_dir_entry(image *img, inode *p, 
+						bool (*f)(image *, dir_entry *, uint, void *), void *arg) {
+	uint lblk, off, *ptr;
+	dir_entry *entry;
+	ubyte *block;
+	
+	for (lblk = 0; lblk < p->i_size >> img->block_bits; lblk++) {
+		ptr = get_inode_block_ptr(img, p, lblk, false);
+		if (ptr == NULL || *ptr == 0) {
+			continue;
+		}
+		block = get_block(img, *ptr);
+		for (off = 0; off < img->block_size; off += entry->rec_len) {
+			entry = (dir_entry *)(block + off);
+			if (entry->rec_len == 0 || !f(img, entry, lblk, arg)) {
+				break;
+			}
+		}
 	}
+}
+
+/* Gets the bytes a directory entry takes once packed. */
+static uint get_packed_size(dir_entry *entry) {
+	uint size = EXT2_DIR_DEFAULT_SIZE + entry->name_len;
 	
-	s->i_links_count--;
+	return size + (EXT2_ALIGN - (size % EXT2_ALIGN));
+}
+
+/* Adds up the bytes live entries need packed, for for_each_dir_entry(). */
+static bool add_live_size(image *img, dir_entry *entry, uint lblk, void *arg) {
+	(void)img;
+	(void)lblk;
+	if (entry->inode != 0) {
+		*(uint *)arg += get_packed_size(entry);
+	}
+	return true;
+}
+
+/* Where compact_dir_locked() is writing entries back to */
+typedef struct {
+	ubyte *entries;		/* Live entries, packed one after the other */
+	uint len;
+} packed_dir;
+
+/* Copies a live entry, packed, for for_each_dir_entry(). */
+static bool pack_live_entry(image *img, dir_entry *entry, uint lblk, void *arg) {
+	packed_dir *d = arg;
+	
+	(void)img;
+	(void)lblk;
+	if (entry->inode != 0) {
+		memcpy(d->entries + d->len, entry, EXT2_DIR_DEFAULT_SIZE + entry->name_len);
+		((dir_entry *)(d->entries + d->len))->rec_len = get_packed_size(entry);
+		d->len += get_packed_size(entry);
+	}
+	return true;
+}
+
+/* Gets the first block of directory p at or after lblk that is not a
+ * hole, setting block to it. Return blocks if there is none.
+ */
+static uint skip_dir_holes(image *img, inode *p, uint lblk, uint blocks, uint *block) {
+	uint *ptr;
 	
-	if (IS(s->i_mode, EXT2_S_IFLNK) || IS(s->i_mode, EXT2_S_IFDIR) 
-				|| s->i_links_count == 0) {
-		/* Must remove inode */
-		initialize_inode(curr, false);
+	for (; lblk < blocks; lblk++) {
+		if ((ptr = get_inode_block_ptr(img, p, lblk, false)) != NULL && *ptr != 0) {
+			*block = *ptr;
+			break;
+		}
+	}
+	return lblk;
+}
+
+/* Repacks the live entries of directory p, whose lock the caller holds,
+ * into as few blocks as they fit in, in the same order, and frees the
+ * blocks left over (and indirect blocks left empty). 
+ * Return false if out of memory.
+ */
+static bool compact_dir_locked(image *img, inode *p) {
+	uint dir = get_inode_index(img, p), blocks = p->i_size >> img->block_bits;
+	uint lblk = 0, off = 0, size, pos, index = 0;
+	dir_entry *last = NULL;
+	packed_dir d;
+	ubyte *block = NULL;
+	
+	d.len = 0;
+	if ((d.entries = malloc(p->i_size + img->block_size)) == NULL) {
+		return false;
 	}
+	for_each_dir_entry(img, p, pack_live_entry, &d);
+	
+	/* Entries cannot span blocks, so each block ends where the next
+	 * entry would not fit, with the last one taking the rest */
+	for (pos = 0; pos < d.len; pos += size) {
+		size = ((dir_entry *)(d.entries + pos))->rec_len;
+		if (off + size > img->block_size) {
+			last->rec_len += img->block_size - off;
+			lblk++;
+			off = 0;
+		}
+		if (off == 0) {
+			/* Holes are skipped; the entries came from fewer blocks */
+			lblk = skip_dir_holes(img, p, lblk, blocks, &index);
+			assert(lblk < blocks);
+			block = get_block(img, index);
+			memset(block, 0, img->block_size);
+		}
+		memcpy(block + off, d.entries + pos, size);
+		last = (dir_entry *)(block + off);
+		off += size;
+	}
+	if (last != NULL) {
+		last->rec_len += img->block_size - off;
+	}
+	free(d.entries);
 	
+	/* Give back the blocks after the last one used */
+	for (blocks--; blocks > lblk; blocks--) {
+		unset_block_at(img, p, blocks);
+	}
+	p->i_size = (lblk + 1) * img->block_size;
+	p->i_mtime = img->curr_time;
+	set_dir_hint(img, dir, lblk);
+	update_inode_summary(img, p);
 	return true;
 }
 
+/* Compacts a directory, holding its lock, like after removing entries.
+ * Return false if it is not a directory, or out of memory.
+ */
+bool compact_dir(image *img, uint dir) {
+	inode *p = get_valid_inode(img, dir);
+	bool ret = false;
+	
+	if (p == NULL || !IS(p->i_mode, EXT2_S_IFDIR)) {
+		return false;
+	}
+	lock_inode(img, dir, true);
+	if (get_inode_bitmap(img, dir) && is_inode_valid(p)) {
+		ret = compact_dir_locked(img, p);
+	}
+	unlock_inode(img, dir, true);
+	return ret;
+}
+
+/* Compacts directory p, whose lock the caller holds, if its live
+ * entries would fit in EXT2_COMPACT_PERCENT of its blocks.
+ */
+static void maybe_compact_dir(image *img, inode *p) {
+	uint blocks = p->i_size >> img->block_bits, live = 0;
+	
+	if (blocks <= 1) {
+		return;
+	}
+	for_each_dir_entry(img, p, add_live_size, &live);
+	if (DIV_UP(live, img->block_size) * 100 <= blocks * EXT2_COMPACT_PERCENT) {
+		compact_dir_locked(img, p);
+	}
+}
+
+/* Removes an entry from parent, holding the parent's lock. If that
+ * leaves its block empty, the parent may be compacted.
+ * Return false if name no longer refers to curr by then.
+ */
+bool remove_entry(image *img, uint curr, char *name, inode *p) {
+	TRACE_SPAN(EXT2_TRACE_REMOVE);
+	uint parent = get_inode_index(img, p), block;
+	dir_entry *first;
+	bool ret = false;
+	
+	lock_inode(img, parent, true);
+	if (get_inode_bitmap(img, parent) && is_inode_valid(p)
+			&& perform_on_children(img, p, NULL, name, NULL) == curr) {
+		block = get_block_with_entry(img, p, name);
+		if ((ret = unlink_entry(img, curr, name, p)) && block != 0) {
+			first = (dir_entry *)get_block(img, block);
+			if (first->inode == 0 && first->rec_len == img->block_size) {
+				maybe_compact_dir(img, p);
+			}
+		}
+	}
+	unlock_inode(img, parent, true);
+	return ret;
+}
+
 /* Prints the name of a directory entry. */
-void print_dir_entry(dir_entry *entry, inode *parent) {
-	if (entry->inode > 0 && get_valid_inode(entry->inode) != NULL
-				&& parent != NULL) {
-		printf("%.*s\n", entry->name_len, entry->name);
+void print_dir_entry(image *img, dir_entry *entry, inode *parent) {
+	if (entry->inode > 0 && is_inode_live(img, entry->inode) && parent != NULL) {
+		fprintf(img->out, "%.*s\n", entry->name_len, entry->name);
 	}
 }
 
 /* Prints the name of directory entries except .. and . */
-void print_dir_entry_except(dir_entry *entry, inode *parent) {
+void print_dir_entry_except(image *img, dir_entry *entry, inode *parent) {
 	if (!is_special_dir(entry)) {
-		print_dir_entry(entry, parent);
+		print_dir_entry(img, entry, parent);
 	}
 }
 
 /* Performs listing on a directory.
  * If "all" is true, also list the "." and "..".
  */
-void print_dir_contents(uint curr, char *name, bool all) {
-	inode *in = get_valid_inode(curr);
+void print_dir_contents(image *img, uint curr, char *name, bool all) {
+	inode *in;
 	
-	if (in == NULL) {
-		return;
+	lock_inode(img, curr, false);
+	if ((in = get_valid_inode(img, curr)) != NULL) {
+		if (!IS(in->i_mode, EXT2_S_IFDIR)) {
+			fprintf(img->out, "%s\n", name);
+		} else if (all) {
+			perform_on_children(img, in, NULL, NULL, print_dir_entry);
+		} else {
+			perform_on_children(img, in, NULL, NULL, print_dir_entry_except);
+		}
 	}
-	if (!IS(in->i_mode, EXT2_S_IFDIR)) {
-		printf("%s\n", name);
-	} else if (all) {
-		perform_on_children(in, NULL, NULL, print_dir_entry);
-	} else {
-		perform_on_children(in, NULL, NULL, print_dir_entry_except);
+	unlock_inode(img, curr, false);
+}
+
+/* Prints each directory of a tree for walk_tree(), like ls -R: its path,
+ * then its entries (with . and .. if arg points to true), with a blank
+ * line between directories. Directories below follow, in order.
+ */
+static tree_step print_tree_dir(tree_walk *w, tree_visit visit, uint dir, 
+									dir_entry *entry, void *arg) {
+	inode *in;
+	
+	if (visit != EXT2_VISIT_DIR) {
+		return EXT2_WALK_CONTINUE;
 	}
+	if ((in = get_valid_inode(w->img, dir)) == NULL) {
+		return EXT2_WALK_SKIP;
+	}
+	fprintf(w->img->out, "%s%s:\n", (entry == NULL ? "" : "\n"), w->path);
+	perform_on_children(w->img, in, NULL, NULL, 
+				(*(bool *)arg ? print_dir_entry : print_dir_entry_except));
+	return EXT2_WALK_CONTINUE;
+}
+
+/* Performs a recursive listing of the tree under a directory, whose
+ * path is path and name is name. If "all" is true, also list the "."
+ * and "..". Return false if the tree could not be walked.
+ */
+bool print_dir_tree(image *img, uint curr, char *path, char *name, bool all) {
+	inode *in;
+	bool ret = true;
+	
+	lock_inode(img, curr, false);
+	if ((in = get_valid_inode(img, curr)) != NULL) {
+		if (!IS(in->i_mode, EXT2_S_IFDIR)) {
+			fprintf(img->out, "%s\n", name);
+		} else {
+			ret = walk_tree(img, curr, path, false, print_tree_dir, &all);
+		}
+	}
+	unlock_inode(img, curr, false);
+	return ret;
 }
 
 /* Frees any memory associated with the memory mapping.
+ * The handle can't be used afterwards. If it was changed, the write time
+ * is set and the mount count goes up, as each load that changes the disk
+ * counts as a mount: together they tell an overlay its base changed,
+ * where the file's mtime also moves when only access times are written.
  * Return true on success.
  */
-bool unload_disk(bool changed) {
-	assert(disk != NULL);
+bool unload_disk(image *img, bool changed) {
+	TRACE_SPAN(EXT2_TRACE_UNLOAD);
+	assert(img->disk != NULL);
 	if (changed) {
-		sb->s_wtime = curr_time;
+		img->sb->s_wtime = img->curr_time;
+		img->sb->s_mnt_count++;
 	}
-    if (munmap(disk, EXT2_SIMPLE * EXT2_BLOCK_SIZE) < 0) {
-		perror("munmap");
-		return false;
-    }
-    if (close(fd) < 0) {
-		perror("close");
-		return false;
-    }
-	disk = NULL;
-	fd = -1;
-	return true;
+	if (img->retained) {
+		/* Stays mapped for the next load, but an overlay's changes are kept */
+		img->out = stdout;
+		img->err = stderr;
+		return !changed || !img->overlay || flush_overlay(img);
+	}
+	return free_disk(img);
 }
\ No newline at end of file
@@ -15,13 +15,21 @@ typedef enum { false, true } bool;
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <errno.h>
 #include <libgen.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 #include "ext2.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* EXT2 Typedefs */
 typedef struct ext2_super_block super_block;
@@ -29,15 +37,216 @@ typedef struct ext2_group_desc group_desc;
 typedef struct ext2_inode inode;
 typedef struct ext2_dir_entry_2 dir_entry;
 
+/* A resolved symlink, remembered while the disk is loaded */
+typedef struct {
+	uint link;		/* Symlink inode */
+	uint dir;		/* Directory it was found in */
+	uint target;	/* Inode it resolved to */
+} link_cache;
+
+/* A regular file on the image, remembered to find duplicates of it */
+typedef struct {
+	uint index;
+	uint size;
+	uint mtime;					/* When hash was taken */
+	unsigned long long hash;	/* Of the contents, 0 until needed */
+	uint next;					/* Next file in the same bucket, plus 1 */
+} dup_file;
+
+/* A host file read into memory once, to copy onto many images from.
+ * See load_host_file().
+ */
+typedef struct {
+	char *path;		/* As given */
+	char *data;
+	uint len;
+} host_file;
+
+/* What scans need of every inode, one array per field indexed by inode
+ * number, so a scan reads only the fields it uses. See 
+ * build_inode_summary().
+ */
+typedef struct {
+	unsigned long long *live;	/* Bit per inode, set if in use */
+	ushort *mode;
+	uint *size;
+	ushort *links;
+	uint *first_block;			/* i_block[0] */
+} inode_summary;
+
+/* Constants for path resolution */
+#define EXT2_MAX_SYMLINKS		8	/* Nested symlinks followed before ELOOP */
+#define EXT2_LINK_CACHE_SIZE	64	/* Resolved symlinks remembered */
+
+/* Constants for directories */
+#define EXT2_DIR_HINTS	64		/* Directories whose free room is tracked */
+#define EXT2_COMPACT_PERCENT	50	/* Compact dirs whose entries fit in this much */
+
+/* Operations timed when tracing */
+typedef enum {
+	EXT2_TRACE_LOAD,
+	EXT2_TRACE_RESOLVE,
+	EXT2_TRACE_NEW_INODE,
+	EXT2_TRACE_WRITE,
+	EXT2_TRACE_REMOVE,
+	EXT2_TRACE_UNLOAD,
+	EXT2_TRACE_SPANS
+} trace_span;
+
+/* A span being timed, see TRACE_SPAN() */
+typedef struct {
+	trace_span span;
+	unsigned long long start;	/* 0 if tracing is off */
+} trace_scope;
+
+/* An open disk image. Every function below that takes one only touches
+ * that image, so different images can be used from different threads.
+ * Threads and processes may also share one image: allocation works on
+ * the mapped bitmaps atomically, and directories are locked one inode
+ * at a time.
+ */
+typedef struct {
+	ubyte *disk;		/* The mapped image */
+	size_t size;
+	super_block *sb;
+	group_desc *gd;		/* One per group */
+	uint groups;
+	int fd;
+	
+	/* Block size, from the superblock, and what follows from it */
+	uint block_size;
+	uint block_bits;		/* block_size, as a shift */
+	uint ptrs_per_block;	/* Block pointers per indirect block */
+	uint ptr_bits;			/* ptrs_per_block, as a shift */
+	uint curr_time;		/* Time the disk was loaded */
+	
+	/* Symlink resolution cache, valid while the disk is loaded */
+	link_cache links[EXT2_LINK_CACHE_SIZE];
+	bool links_used;
+	pthread_mutex_t links_lock;
+	
+	/* Lock words for each inode, see lock_inode() */
+	uint *locks;
+	
+	/* Per directory, the first block that may have room */
+	unsigned long long dir_hints[EXT2_DIR_HINTS];
+	
+	/* Regular files by size, see link_duplicate() */
+	dup_file *dups;
+	uint dups_used, dups_size;
+	uint *dup_buckets;		/* First file in each, plus 1, once indexed */
+	pthread_mutex_t dups_lock;
+	
+	/* Summary of every inode, once built */
+	inode_summary *summary;
+	pthread_mutex_t summary_lock;
+	
+	/* Where what the library prints about the disk goes, see load_disk() */
+	FILE *out, *err;
+	
+	/* Identifies the image file, for retained disks */
+	dev_t dev;
+	ino_t ino;
+	off_t file_size;
+	uint blocks_count, inodes_count;	/* When mapped */
+	bool retained;
+	bool overlay;	/* Mapped privately over a base, see create_overlay() */
+} image;
+
+/* Constants for the block walker */
+#define EXT2_WALK_AHEAD		256		/* Data blocks found ahead of a walk */
+#define EXT2_WALK_EXTENTS	32		/* Extents found ahead, at most */
+
+/* Physically contiguous data blocks of an inode */
+typedef struct {
+	uint lblk;		/* First logical block */
+	uint block;		/* First block on the disk */
+	uint count;
+} block_extent;
+
+/* Walks the data blocks of an inode in logical order, a run of block
+ * pointers at a time, while the kernel reads ahead what comes next.
+ * See start_block_walk().
+ */
+typedef struct {
+	image *img;
+	inode *i;
+	uint lblk;			/* Next logical block to look at */
+	uint end;			/* Logical blocks to walk */
+	bool read_ahead;	/* Whether data blocks are read ahead, or only pointers */
+	uint *ptrs;			/* Entries from lblk on, NULL if their indirect is a hole */
+	uint ptrs_left;		/* How many */
+	
+	/* Ring of extents found but not returned yet */
+	block_extent found[EXT2_WALK_EXTENTS];
+	uint first, used;
+	uint ahead;			/* Blocks in them */
+	uint advised;		/* Blocks of the last one read ahead already */
+} block_walker;
+
+/* Constants for tree walks */
+#define EXT2_WALK_FRAMES	16		/* Levels a tree walk starts with room for */
+
+/* What walk_tree() is visiting */
+typedef enum {
+	EXT2_VISIT_DIR,		/* A directory, before its entries */
+	EXT2_VISIT_ENTRY,	/* One of its entries, . and .. included */
+	EXT2_VISIT_LEAVE	/* A directory, after everything below it */
+} tree_visit;
+
+/* What a visitor wants the walk to do next */
+typedef enum {
+	EXT2_WALK_CONTINUE,	/* Go on, into the entry if it is a directory */
+	EXT2_WALK_SKIP,		/* Do not go into this entry or directory */
+	EXT2_WALK_STOP
+} tree_step;
+
+/* A directory being walked, one per level of the walk */
+typedef struct {
+	uint dir;
+	dir_entry *entry;	/* Leading to it, in the level above (NULL at the top) */
+	uint lblk, off;		/* Next entry to look at */
+	ubyte *block;		/* Holding it, once looked up */
+	uint path_len;		/* Of its path, in the walk's path */
+} tree_frame;
+
+/* A walk down a directory tree, see walk_tree(). The stack of levels is
+ * on the heap, so the depth of a tree is bounded by its inodes, not by
+ * the C stack.
+ */
+typedef struct tree_walk {
+	image *img;
+	bool exclusive;		/* Whether directories below the top are locked to write */
+	tree_frame *frames;
+	uint depth, size;
+	char *path;			/* Of the directory being visited */
+	size_t path_size;
+	tree_step (*f)(struct tree_walk *, tree_visit, uint, dir_entry *, void *);
+	void *arg;
+} tree_walk;
+
 /* General helpers */
 #define BITS_PER_BYTE	8
 #define	IS(i, b)	(i & b) != 0
+#define IS_TYPE(i, t)	(((i) & EXT2_S_IFMT) == (t))
 #define DIV_UP(a, b)	((a + b - 1) / b)
 
 /* Constants for EXT2 */
 #define EXT2_SB_OFFSET	1024	/* Superblock offset */
 #define EXT2_SB_SIZE	1024	/* Superblock size is constant */
-#define EXT2_SIMPLE		128		/* Number of blocks in our simple file */
+#define EXT2_SUPER_MAGIC	0xEF53	/* s_magic of every EXT2 superblock */
+#define EXT2_SECTOR_SIZE	512		/* Unit of i_blocks */
+#define EXT2_MIN_BLOCK_BITS	10		/* EXT2_BLOCK_SIZE, the smallest, as a shift */
+#define EXT2_MAX_LOG_BLOCK_SIZE	2	/* Largest s_log_block_size, for 4096 */
+#define EXT2_MAX_BLOCK_SIZE	(EXT2_BLOCK_SIZE << EXT2_MAX_LOG_BLOCK_SIZE)
+#define EXT2_LPF_INO	11			/* lost+found, the first unreserved inode */
+#define EXT2_GOOD_OLD_FIRST_INO	11
+#define EXT2_VALID_FS	1			/* s_state when cleanly unmounted */
+#define EXT2_ERRORS_CONTINUE	1	/* s_errors to keep going */
+#define EXT2_DYNAMIC_REV	1		/* s_rev_level with variable inode sizes */
+#define EXT2_FEATURE_COMPAT_DIR_PREALLOC	0x0001	/* s_prealloc_dir_blocks is set */
+#define EXT2_FEATURE_INCOMPAT_FILETYPE	0x0002	/* file_type in dir entries */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001	/* Fewer superblock copies */
 
 #define EXT2_DIR_DEFAULT_SIZE	8	/* How big a dir entry is, without name */
 #define EXT2_ALIGN	4			/* Bytes to align directory entries */
@@ -48,6 +257,135 @@ typedef struct ext2_dir_entry_2 dir_entry;
 #define EXT2_NUM_DOUBLE	1		/* Number of indirect pointers */
 #define EXT2_NUM_TRIPLE	1
 #define EXT2_NUM_QUAD	1
+#define EXT2_S_IFMT		0xF000		/* File type bits of i_mode */
+
+/* Constants for hashing, see hash_data() */
+#define EXT2_HASH_PRIME1	0x9E3779B185EBCA87ULL
+#define EXT2_HASH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define EXT2_HASH_PRIME3	0x165667B19E3779F9ULL
+#define EXT2_HASH_PRIME4	0x85EBCA77C2B2AE63ULL
+#define EXT2_HASH_PRIME5	0x27D4EB2F165667C5ULL
+
+/* Constants for locking */
+#define EXT2_LOCK_WRITER	0x80000000U	/* Lock word bit for a writer */
+#define EXT2_LOCK_PENDING	0x40000000U	/* Range lock being taken or dropped */
+
+/* Constants for the inode summary */
+#define EXT2_SUMMARY_BITS	64		/* Inodes per word of live bits */
+
+/* Constants for deduplication */
+#define EXT2_DUP_BUCKETS	1024	/* Buckets of files by size */
+
+/* Constants for ext2_mkfs */
+#define EXT2_MKFS_INODE_RATIO	8192	/* Default bytes per inode */
+#define EXT2_MKFS_MIN_INODES	16		/* Fewest inodes in a group */
+#define EXT2_MKFS_MIN_FREE	50			/* Fewest free blocks in the last group */
+#define EXT2_MKFS_LPF_SIZE	(12 * 1024)	/* Bytes set aside for lost+found */
+#define EXT2_MKFS_PREALLOC_DIR	8		/* Blocks added at once to growing dirs */
+
+/* Constants for ext2_diff */
+#define EXT2_DIFF_CHUNK	4096	/* Blocks compared per task, dividing a group */
+
+/* Constants for ext2_export and ext2_import */
+#define EXT2_EXPORT_MAGIC	"EXT2EXP1"	/* Starts every export */
+#define EXT2_EXPORT_CHUNK	256		/* Blocks packed (and compressed) together */
+#define EXT2_EXPORT_WINDOW	4		/* Chunks packed ahead, per thread */
+
+/* An export is a header, then chunks each made of an export_chunk,
+ * its runs of blocks, and their data, zlib compressed if that is
+ * smaller than raw_length. A chunk with no runs ends the export.
+ */
+typedef struct {
+	char magic[8];
+	uint block_size;
+	uint blocks;				/* s_blocks_count */
+	unsigned long long size;	/* Of the image file */
+} export_header;
+
+typedef struct {
+	uint runs;
+	uint raw_length;	/* Bytes in the runs */
+	uint length;		/* Bytes stored */
+} export_chunk;
+
+typedef struct {
+	uint start;
+	uint count;
+} export_run;
+
+/* Constants for ext2_archive */
+#define EXT2_ARCHIVE_MAGIC	"EXT2ARC1"	/* Starts every manifest */
+#define EXT2_ARCHIVE_BLOCKS	"blocks"	/* Unique blocks, in the archive */
+#define EXT2_ARCHIVE_HASHES	"hashes"	/* Hash of each of them */
+#define EXT2_ARCHIVE_IMAGES	"images"	/* One manifest per image */
+#define EXT2_ARCHIVE_CHUNK	4096		/* Blocks hashed per task */
+#define EXT2_ARCHIVE_BATCH	1024		/* New blocks written at once */
+
+/* A manifest is an archive_header, its runs of blocks, then for each
+ * block in them, its number in the archive's blocks file.
+ */
+typedef struct {
+	char magic[8];
+	uint block_size;
+	uint blocks;				/* s_blocks_count */
+	unsigned long long size;	/* Of the image file */
+	uint runs;
+	uint refs;					/* Blocks in the runs */
+} archive_header;
+
+/* Constants for ext2_imagerd */
+#define EXT2_MAX_RETAINED	16			/* Disks kept mapped at once */
+#define EXT2_IMAGERD_ENV	"EXT2_IMAGERD_SOCKET"	/* Socket path variable */
+#define EXT2_IMAGERD_MSG	(64 * 1024)	/* Largest request */
+
+/* A command that ext2_imagerd and ext2_fleet can run, see find_command().
+ * It prints to the two streams it is given, in place of stdout and stderr.
+ */
+typedef struct {
+	const char *name;
+	int (*run)(int, char **, FILE *, FILE *);
+} command;
+
+/* Constants for overlays, see create_overlay() */
+#define EXT2_OVERLAY_MAGIC	"EXT2OVL"
+#define EXT2_OVERLAY_HEADER	4096	/* Bytes after the blocks of an overlay */
+#define EXT2_OVERLAY_PAGEMAP	4096	/* Pagemap entries read at once */
+#define EXT2_PAGE_PRESENT	(1ULL << 63)	/* Pagemap bits, see proc(5) */
+#define EXT2_PAGE_SWAPPED	(1ULL << 62)
+#define EXT2_PAGE_FILE		(1ULL << 61)
+
+/* Whether a page of a private mapping was written to, from its pagemap
+ * entry: it was then copied, so it is swapped or no longer file backed.
+ */
+#define IS_PAGE_CHANGED(entry) (((entry) & EXT2_PAGE_SWAPPED) \
+		|| ((entry) & (EXT2_PAGE_PRESENT | EXT2_PAGE_FILE)) == EXT2_PAGE_PRESENT)
+
+/* The header of an overlay, after as many bytes as its base image holds.
+ * Blocks changed since the base are data there, the rest are holes.
+ */
+typedef struct {
+	char magic[8];
+	unsigned long long size;		/* Of the base image */
+	uint wtime, writes;			/* Of the base, when made, see unload_disk() */
+	long long reserved;
+	char base[EXT2_OVERLAY_HEADER - 32];	/* Absolute path of the base */
+} overlay_header;
+
+/* Constants for ext2_fleet */
+#define EXT2_FLEET_ARGS	64	/* Most arguments to one command in a script */
+
+/* Constants for tracing, see TRACE_SPAN() */
+#define EXT2_TRACE_ENV	"EXT2_TRACE"		/* Set to time spans */
+#define EXT2_TRACE_FILE_ENV	"EXT2_TRACE_FILE"	/* Trace event file to write */
+#define EXT2_TRACE_SUB_BITS	5				/* Buckets per power of two, as bits */
+#define EXT2_TRACE_SUB	(1U << EXT2_TRACE_SUB_BITS)
+#define EXT2_TRACE_BUCKETS	((65 - EXT2_TRACE_SUB_BITS) * EXT2_TRACE_SUB)
+#define EXT2_TRACE_MAX_EVENTS	(1U << 20)	/* Spans kept for the trace file */
+
+/* Constants for the io_uring backend */
+#define EXT2_URING_DEPTH	32			/* Default queue depth */
+#define EXT2_URING_CHUNK	(64 * 1024)	/* Bytes per registered buffer */
+#define EXT2_URING_RUNS		256			/* Runs walked ahead of a transfer */
 
 /* ext2_imager.c extern functions and variables  
   ------------------------------------------------- */
@@ -56,30 +394,130 @@ typedef struct ext2_dir_entry_2 dir_entry;
 
 /* General helpers */
 extern char *find_last_token(char *path);
-extern bool has_space(uint inodes, uint blocks);
+extern void print_error(FILE *err, const char *what);
+extern bool has_space(image *img, uint inodes, uint blocks);
 
 /* Loading and unloading */
-extern bool load_simple_disk(char *file);
-extern bool unload_disk(bool changed);
+extern image *load_simple_disk(char *file);
+extern image *load_disk(char *file, FILE *out, FILE *err);
+extern bool unload_disk(image *img, bool changed);
+extern void retain_disks(bool retain);
+extern bool load_host_file(char *path);
+extern const host_file *find_host_file(char *path);
+extern void free_host_files(void);
+extern bool create_overlay(char *base, char *path);
+extern bool commit_overlay(char *path);
+extern bool discard_overlay(char *path);
+extern bool copy_file_data(int src, int dest, off_t size);
+
+/* Blocks */
+extern ubyte *get_block(image *img, uint index);
+extern uint get_total_blocks(image *img, uint num_blocks);
+extern uint *get_inode_block_ptr(image *img, inode *i, uint lblk, bool alloc);
+extern uint add_block_at(image *img, inode *i, uint lblk);
+extern bool unset_block_at(image *img, inode *i, uint lblk);
+extern void start_block_walk(image *img, inode *i, uint first, uint num_blocks, 
+								bool read_ahead, block_walker *w);
+extern bool next_block_extent(block_walker *w, block_extent *e);
+extern bool is_zero_block(image *img, const ubyte *ptr);
+extern bool is_same_block(image *img, const ubyte *a, const ubyte *b);
+extern unsigned long long hash_data(const void *data, size_t len, 
+								unsigned long long seed);
+extern bool get_block_bitmap(image *img, uint index);
 
 /* inode traversal */
-extern inode *get_valid_inode(uint index);
-extern uint find_direct_child(uint parent, char *file);
-extern uint get_parent_inode_at_path(char *path);
-extern uint get_inode_at_path_except(char *path, uint except);
-extern uint get_inode_at_path(char *path);
-extern uint get_inode_name_at_path(char *path, char *last_token);
+extern inode *get_inode(image *img, uint index);
+extern uint get_inode_index(image *img, inode *ptr);
+extern bool get_inode_bitmap(image *img, uint index);
+extern bool is_inode_valid(inode *ptr);
+extern inode *get_valid_inode(image *img, uint index);
+extern bool is_fast_symlink(inode *ptr);
+extern bool build_inode_summary(image *img);
+extern void update_inode_summary(image *img, inode *i);
+extern bool is_inode_live(image *img, uint index);
+extern ushort get_inode_mode(image *img, uint index);
+extern uint find_direct_child(image *img, uint parent, char *file);
+extern uint get_parent_inode_at_path(image *img, char *path);
+extern uint get_inode_at_path_except(image *img, char *path, uint except);
+extern uint get_inode_at_path(image *img, char *path);
+extern uint get_inode_name_at_path(image *img, char *path, char *last_token);
+extern void clear_link_cache(image *img);
+extern bool is_special_dir(dir_entry *entry);
+extern bool walk_tree(image *img, uint top, const char *path, bool exclusive,
+			tree_step (*f)(tree_walk *, tree_visit, uint, dir_entry *, void *), void *arg);
+
+/* Locking */
+extern void lock_inode(image *img, uint index, bool exclusive);
+extern void unlock_inode(image *img, uint index, bool exclusive);
 
 /* Multi-purpose */
-extern inode *new_inode(uint parent, uint num_blocks, ushort mode, char *name);
-extern bool add_dir_entry(inode *p, uint index, ubyte file_type, char *name);
-extern void write_file_data(inode *i, uint num_blocks, uint len, char *data);
+extern inode *new_inode(image *img, uint parent, uint num_blocks, 
+								ushort mode, char *name);
+extern bool add_dir_entry(image *img, inode *p, uint index, 
+								ubyte file_type, char *name);
+extern bool write_file_data(image *img, inode *i, uint num_blocks, 
+								uint len, char *data);
+
+/* for cp */
+extern uint link_duplicate(image *img, uint parent, int src, uint len, 
+								char *name, unsigned long long *hash);
+extern void remember_file(image *img, inode *i, unsigned long long hash);
+extern int update_file(image *img, uint index, int src, uint len);
+
+/* for append and truncate */
+extern void set_file_size(image *img, inode *i, uint size);
+extern bool truncate_file(image *img, uint index, uint size);
 
 /* for ls */
-extern void print_dir_contents(uint curr, char *name, bool all);
+extern void print_dir_contents(image *img, uint curr, char *name, bool all);
+extern bool print_dir_tree(image *img, uint curr, char *path, char *name, bool all);
 
 /* for rm */
-extern bool remove_entry(uint curr, char *name, inode *parent);
+extern bool remove_entry(image *img, uint curr, char *name, inode *parent);
+extern bool compact_dir(image *img, uint dir);
+
+/* ext2_client.c extern functions
+  ------------------------------------------------- */
+
+extern int run_on_daemon(int argc, char **argv);
+
+/* Commands, run in-process by ext2_imagerd and ext2_fleet
+  ------------------------------------------------- */
+
+extern const command *find_command(char *path);
+
+extern int ext2_ls(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_cp(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_mkdir(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_ln(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_rm(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_rm_bonus(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_append(int argc, char **argv, FILE *out, FILE *err);
+extern int ext2_truncate(int argc, char **argv, FILE *out, FILE *err);
+
+/* ext2_trace.c extern functions
+  ------------------------------------------------- */
+
+extern trace_scope begin_span(trace_span span);
+extern void end_span(trace_scope *scope);
+
+/* Times the rest of the enclosing block as one span, however it is left.
+ * Spans are only timed if EXT2_TRACE or EXT2_TRACE_FILE is set.
+ */
+#define TRACE_SPAN(span) \
+	trace_scope trace_scope_ __attribute__((cleanup(end_span))) = begin_span(span)
+
+/* ext2_uring.c extern functions
+  ------------------------------------------------- */
+
+/* Bulk copy-in and copy-out, falling back to synchronous I/O */
+extern bool write_file_data_async(image *img, inode *i, uint num_blocks, 
+								uint len, int src, uint depth);
+extern bool read_file_data_async(image *img, inode *i, int dest, uint depth);
+extern bool append_file(image *img, uint index, int src, uint len, uint depth);
+
+/* Sparse copy-in */
+extern uint get_host_data_blocks(image *img, int src, uint num_blocks);
 
 #endif 
 /* __EXT2_IMAGER_H__ */
\ No newline at end of file
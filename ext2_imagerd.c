@@ -0,0 +1,170 @@
+#include "ext2_imager.h"
+#include <signal.h>
+
+#define EXT2_IMAGERD_ARGS	64	/* Most arguments in a request */
+
+static volatile sig_atomic_t running = 1;
+
+/* Stops accepting requests. */
+static void stop(int sig) {
+	(void)sig;
+	running = 0;
+}
+
+/* Runs a command with stdout and stderr pointed at the client's.
+ * Return its exit status.
+ */
+static int run_command(const command *cmd, int argc, char **argv, int *fds) {
+	int saved[2], status;
+	
+	fflush(stdout);
+	fflush(stderr);
+	saved[0] = dup(STDOUT_FILENO);
+	saved[1] = dup(STDERR_FILENO);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	
+	status = cmd->run(argc, argv, stdout, stderr);
+	
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved[0], STDOUT_FILENO);
+	dup2(saved[1], STDERR_FILENO);
+	close(saved[0]);
+	close(saved[1]);
+	return status;
+}
+
+/* Receives one request on conn, runs it from the client's working
+ * directory, and replies with its exit status.
+ */
+static void serve(int conn, int home) {
+	char buf[EXT2_IMAGERD_MSG + 1];
+	char *argv[EXT2_IMAGERD_ARGS + 1];
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[2] = {-1, -1};
+	const command *cmd;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t len, pos;
+	int argc, status = EXIT_FAILURE;
+	
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = EXT2_IMAGERD_MSG;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if ((len = recvmsg(conn, &msg, 0)) <= 0) {
+		return;
+	}
+	buf[len] = '\0';
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		return; /* Not from run_on_daemon() */
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	
+	/* Split into the working directory and arguments */
+	argc = 0;
+	for (pos = strlen(buf) + 1; pos < len && argc < EXT2_IMAGERD_ARGS; 
+						pos += strlen(buf + pos) + 1) {
+		argv[argc++] = buf + pos;
+	}
+	argv[argc] = NULL;
+	
+	if (argc == 0 || (cmd = find_command(argv[0])) == NULL) {
+		dprintf(fds[1], "ext2_imagerd: unknown command\n");
+	} else if (chdir(buf) < 0) {
+		dprintf(fds[1], "ext2_imagerd: chdir: %s\n", strerror(errno));
+	} else {
+		status = run_command(cmd, argc, argv, fds);
+		if (fchdir(home) < 0) {
+			perror("fchdir");
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+	send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+/* Keeps EXT2 images mapped and runs ext2_* commands on them, sent over
+ * a Unix domain socket by the tools when EXT2_IMAGERD_SOCKET is set.
+ * Images listed on the command line are loaded up front; any others are
+ * loaded on first use.
+ */
+int main (int argc, char **argv) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	image *img;
+	int sock, conn, home, i;
+	mode_t mask;
+	
+	/* Check arguments */
+	if (argc < 2 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_imagerd \
+<socket path> [<image> ...]\n");
+		return EXIT_FAILURE;
+	}
+	if ((home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop; /* No SA_RESTART, so accept() returns */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[1]);
+	unlink(argv[1]); /* Left over from a previous run */
+	mask = umask(S_IRWXG | S_IRWXO); /* Only we may connect */
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 
+			|| listen(sock, SOMAXCONN) < 0) {
+		perror("bind");
+		return EXIT_FAILURE;
+	}
+	umask(mask);
+	
+	retain_disks(true);
+	for (i = 2; i < argc; i++) {
+		if ((img = load_simple_disk(argv[i])) == NULL) {
+			fprintf(stderr, "Failed to load the disk %s.\n", argv[i]);
+			continue;
+		}
+		unload_disk(img, false);
+	}
+	
+	while (running) {
+		if ((conn = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+		serve(conn, home);
+		close(conn);
+	}
+	
+	/* Cleanup */
+	retain_disks(false);
+	close(sock);
+	unlink(argv[1]);
+	close(home);
+	return EXIT_SUCCESS;
+}
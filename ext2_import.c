@@ -0,0 +1,185 @@
+#include "ext2_imager.h"
+#include <zlib.h>
+
+/* Reads len bytes into buf. Return false at the end of input, or on
+ * an error.
+ */
+static bool read_all(int fd, void *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len)) <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				perror("read");
+			}
+			return false;
+		}
+		buf = (ubyte *)buf + n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Writes len bytes of buf at off in the image. Return true on success. */
+static bool write_at(int fd, const void *buf, size_t len, off_t off) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("pwrite");
+			return false;
+		}
+		buf = (const ubyte *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* Returns true if the runs of a chunk fit in the image and add up to
+ * its raw length.
+ */
+static bool are_runs_valid(export_header *header, export_chunk *chunk,
+								export_run *runs) {
+	unsigned long long bytes = 0;
+	uint i;
+
+	for (i = 0; i < chunk->runs; i++) {
+		if (runs[i].count == 0 || runs[i].start >= header->blocks
+				|| runs[i].count > header->blocks - runs[i].start) {
+			return false;
+		}
+		bytes += (unsigned long long)runs[i].count * header->block_size;
+	}
+	return bytes == chunk->raw_length && chunk->length <= chunk->raw_length;
+}
+
+/* Restores chunks from src into the image at fd until the empty chunk
+ * that ends the export. Only blocks in the export are written, so the
+ * rest stay holes.
+ *	If the export is cut short or malformed, return EINVAL.
+ *	If the image cannot be written, return EIO.
+ */
+static int import_chunks(int src, int fd, export_header *header) {
+	export_chunk chunk;
+	export_run runs[EXT2_EXPORT_CHUNK];
+	ubyte *stored = NULL, *raw = NULL;
+	uLongf length;
+	off_t off;
+	uint i;
+	int ret = EXIT_SUCCESS;
+
+	/* Chunks never hold more than EXT2_EXPORT_CHUNK blocks */
+	if ((stored = malloc(EXT2_EXPORT_CHUNK * header->block_size)) == NULL
+			|| (raw = malloc(EXT2_EXPORT_CHUNK * header->block_size)) == NULL) {
+		perror("malloc");
+		free(stored);
+		return EXIT_FAILURE;
+	}
+	while (ret == EXIT_SUCCESS) {
+		if (!read_all(src, &chunk, sizeof(chunk)) || chunk.runs > EXT2_EXPORT_CHUNK) {
+			ret = EINVAL;
+			break;
+		}
+		if (chunk.runs == 0) {
+			break; /* The end */
+		}
+		if (!read_all(src, runs, chunk.runs * sizeof(export_run))
+				|| !are_runs_valid(header, &chunk, runs)
+				|| chunk.raw_length > EXT2_EXPORT_CHUNK * header->block_size
+				|| !read_all(src, stored, chunk.length)) {
+			ret = EINVAL;
+			break;
+		}
+		if (chunk.length < chunk.raw_length) {
+			/* Compressed */
+			length = chunk.raw_length;
+			if (uncompress(raw, &length, stored, chunk.length) != Z_OK
+					|| length != chunk.raw_length) {
+				ret = EINVAL;
+				break;
+			}
+		} else {
+			memcpy(raw, stored, chunk.raw_length);
+		}
+		for (i = 0, off = 0; i < chunk.runs && ret == EXIT_SUCCESS; i++) {
+			if (!write_at(fd, raw + off, (size_t)runs[i].count * header->block_size,
+							(off_t)runs[i].start * header->block_size)) {
+				ret = EIO;
+			}
+			off += (off_t)runs[i].count * header->block_size;
+		}
+	}
+	free(stored);
+	free(raw);
+	return ret;
+}
+
+/* Restores an EXT2 image made by ext2_export, as a sparse file holding
+ * only the exported blocks. A source of - reads from standard input.
+ *	If the export is cut short or malformed, return EINVAL.
+ */
+int ext2_import(int argc, char **argv) {
+	export_header header;
+	int src, fd, ret;
+
+	/* Check arguments */
+	if (argc != 3) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_import \
+<export file, or - for standard input> <image>\n");
+		return EXIT_FAILURE;
+	}
+	if (strcmp(argv[1], "-") == 0) {
+		src = STDIN_FILENO;
+	} else if ((src = open(argv[1], O_RDONLY)) < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (!read_all(src, &header, sizeof(header))
+			|| memcmp(header.magic, EXT2_EXPORT_MAGIC, sizeof(header.magic)) != 0
+			|| header.block_size < EXT2_BLOCK_SIZE
+			|| header.block_size % EXT2_BLOCK_SIZE != 0
+			|| (unsigned long long)header.blocks * header.block_size > header.size) {
+		fprintf(stderr, "%s is not an EXT2 export\n", argv[1]);
+		if (src != STDIN_FILENO) {
+			close(src);
+		}
+		return EINVAL;
+	}
+
+	/* Start from an image of holes, then fill in what was exported */
+	if ((fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		if (src != STDIN_FILENO) {
+			close(src);
+		}
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(fd, (off_t)header.size) < 0) {
+		perror("ftruncate");
+		ret = EIO;
+	} else if ((ret = import_chunks(src, fd, &header)) == EINVAL) {
+		fprintf(stderr, "%s is cut short or corrupt\n", argv[1]);
+	}
+
+	/* Cleanup */
+	if (src != STDIN_FILENO) {
+		close(src);
+	}
+	if (close(fd) < 0) {
+		perror("close");
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+int main (int argc, char **argv) {
+	return ext2_import(argc, argv);
+}
\ No newline at end of file
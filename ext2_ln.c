@@ -2,11 +2,14 @@
 
 /* Links a file on the EXT2 disk.
  *	If source file does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
  *  If link already exists as a file or link, return EEXIST.
  *  If source or link already exists and is a directory, return EISDIR.
  * Argument: If -s is provided, create a symlink instead.
  */
-int main (int argc, char **argv) {
+int ext2_ln(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
 	uint curr, parent, src;
 	char *last_token = NULL;
 	char *spath, *tpath;
@@ -19,84 +22,103 @@ int main (int argc, char **argv) {
 	/* Check arguments */
 	if (argc != 4 && !sym) {
 		/* Wrong usage */
-		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_ln <image> [-s] \
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_ln <image> [-s] \
 <source file, absolute path on EXT2> <target file, absolute path on EXT2>\n");
 		return EXIT_FAILURE;
 	}
-	if (!load_simple_disk(argv[1])) {
-		fprintf(stderr, "Failed to load the disk.\n");
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
 		return EXIT_FAILURE;
 	}
 	
 	spath = argv[argc - 2];
 	tpath = argv[argc - 1];
 	if (strlen(spath) == 0 || spath[0] != '/' || spath[strlen(spath) - 1] == '/') {
-		fprintf(stderr, "Source path must be absolute (so must start with /) \
+		fprintf(err, "Source path must be absolute (so must start with /) \
 and must refer to a file (so cannot end with /)\n");
-		unload_disk(false);
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	if (strlen(tpath) == 0 || tpath[0] != '/' || tpath[strlen(tpath) - 1] == '/') {
-		fprintf(stderr, "Target path must be absolute (so must start with /) \
+		fprintf(err, "Target path must be absolute (so must start with /) \
 and must refer to a file (so cannot end with /)\n");
-		unload_disk(false);
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	
-	src = get_inode_at_path(spath);
-	parent = get_parent_inode_at_path(tpath);
+	src = get_inode_at_path(img, spath);
+	parent = get_parent_inode_at_path(img, tpath);
 	last_token = find_last_token(tpath);
 	if (src == 0 || parent == 0) {
 		/* Intermediate path does not exist */
-		fprintf(stderr, "Path does not exist\n");
-		unload_disk(false);
-		return ENOENT;
+		fprintf(err, "Path does not exist\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
 	}
 	
-	if ((curr = find_direct_child(parent, last_token)) != 0) {
+	if ((curr = find_direct_child(img, parent, last_token)) != 0) {
 		/* Exists */
-		dir = IS(get_valid_inode(curr)->i_mode, EXT2_S_IFDIR);
-		fprintf(stderr, "Target path exists already\n");
-		unload_disk(false);
+		dir = IS(get_valid_inode(img, curr)->i_mode, EXT2_S_IFDIR);
+		fprintf(err, "Target path exists already\n");
+		unload_disk(img, false);
 		return (dir ? EISDIR : EEXIST);
 	}
 	
-	mode = get_valid_inode(src)->i_mode;
+	mode = get_valid_inode(img, src)->i_mode;
 	if (IS(mode, EXT2_S_IFDIR)) {
 		/* Source is directory */
-		fprintf(stderr, "Source path is a directory\n");
-		unload_disk(false);
+		fprintf(err, "Source path is a directory\n");
+		unload_disk(img, false);
 		return EISDIR;
 	}
 	if (strlen(last_token) > EXT2_NAME_LEN) {
 		/* Too long */
-		fprintf(stderr, "Name %s is too long\n", last_token);
-		unload_disk(false);
+		fprintf(err, "Name %s is too long\n", last_token);
+		unload_disk(img, false);
 		return ENAMETOOLONG;
 	}
 	if (sym) {
 		/* Symbolic link - new inode with path in blocks */
 		len = strlen(spath);
 		if (len >= EXT2_MIN_BLOCK_DATA) {
-			num_blocks = DIV_UP(len, EXT2_BLOCK_SIZE);
+			num_blocks = DIV_UP(len, img->block_size);
 		} else {
 			num_blocks = 0;
 		}
-		if ((i = new_inode(parent, num_blocks, EXT2_S_IFLNK, last_token)) == NULL) {
+		if ((i = new_inode(img, parent, num_blocks, EXT2_S_IFLNK, last_token)) == NULL) {
 			/* No space */
-			fprintf(stderr, "No space found on disk\n");
-			unload_disk(false);
+			fprintf(err, "No space found on disk\n");
+			unload_disk(img, false);
+			return ENOSPC;
+		}
+		if (!write_file_data(img, i, num_blocks, len, spath)) {
+			/* Another writer took the space, so take the link back out */
+			fprintf(err, "No space found on disk\n");
+			remove_entry(img, get_inode_index(img, i), last_token, 
+							get_valid_inode(img, parent));
+			unload_disk(img, true);
 			return ENOSPC;
 		}
-		write_file_data(i, num_blocks, len, spath);
 	} else {
 		/* Write a regular file with same inode and mode as src but different name */
-		add_dir_entry(get_valid_inode(parent), src, mode, last_token);
+		add_dir_entry(img, get_valid_inode(img, parent), src, mode, last_token);
 	}
 	
-	if (!unload_disk(true)) {
-		fprintf(stderr, "Failed to unload the disk.\n");
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_ln(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
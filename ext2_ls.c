@@ -2,52 +2,88 @@
 
 /* Prints all files and directories in a given absolute path in the EXT2 disk. 
  * Argument: If -a is specified, print . and .. as well.
+ *			If -R is specified, list the directories below it too.
  *	If the path does not exist, return ENOENT and print "No such file or directory".
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
  *	If the path is a file or link, simply print the file name (without . or ..)
  */
-int main (int argc, char **argv) {
+int ext2_ls(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
 	uint curr, parent;
 	char *last_token = NULL;
 	char *path = argv[argc - 1];
-	bool all = (argc == 4 && strcmp(argv[2], "-a") == 0);
+	bool all = false, recursive = false;
 	bool mustBeDir;
+	int arg;
 	
 	/* Check arguments */
-	if (argc != 3 && !all) {
+	for (arg = 2; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "-a") == 0) {
+			all = true;
+		} else if (strcmp(argv[arg], "-R") == 0) {
+			recursive = true;
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 1) {
 		/* Wrong usage */
-		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_ls <image> \
-[-a] <absolute path on EXT2>\n");
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_ls <image> \
+[-a] [-R] <absolute path on EXT2>\n");
 		return EXIT_FAILURE;
 	}
-	if (!load_simple_disk(argv[1])) {
-		fprintf(stderr, "Failed to load the disk.\n");
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
 		return EXIT_FAILURE;
 	}
 	if (strlen(path) == 0 || path[0] != '/') {
-		fprintf(stderr, "Path must be absolute (so must start with /)\n");
-		unload_disk(false);
+		fprintf(err, "Path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	mustBeDir = path[strlen(path) - 1] == '/';
-	parent = get_parent_inode_at_path(path);					
+	parent = get_parent_inode_at_path(img, path);					
 	last_token = find_last_token(path);
-	curr = find_direct_child(parent,  last_token);
+	curr = find_direct_child(img, parent,  last_token);
 	if (curr == 0) { 
-		fprintf(stderr, "No such file or directory\n");
-		unload_disk(false);
-		return ENOENT;
+		fprintf(err, "No such file or directory\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
 	}
-	if (!IS(get_valid_inode(curr)->i_mode, EXT2_S_IFDIR) && mustBeDir) {
+	if (!IS(get_valid_inode(img, curr)->i_mode, EXT2_S_IFDIR) && mustBeDir) {
 		/* Should be a directory, but isn't */
-		fprintf(stderr, "Path refers to a file or link, but ends in /, which is invalid\n");
-		unload_disk(false);
+		fprintf(err, "Path refers to a file or link, but ends in /, which is invalid\n");
+		unload_disk(img, false);
 		return ENOENT;
 	}
-	print_dir_contents(curr, last_token, all);
+	if (recursive) {
+		/* Entries are then checked without reading their inodes, if built */
+		build_inode_summary(img);
+	}
+	if (!recursive) {
+		print_dir_contents(img, curr, last_token, all);
+	} else if (!print_dir_tree(img, curr, path, last_token, all)) {
+		fprintf(err, "Could not list everything below %s\n", path);
+		unload_disk(img, false);
+		return (errno == ELOOP ? ELOOP : ENOMEM);
+	}
 
-	if (!unload_disk(false)) {
-		fprintf(stderr, "Failed to unload the disk.\n");
+	if (!unload_disk(img, false)) {
+		fprintf(err, "Failed to unload the disk.\n");
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_ls(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
@@ -2,9 +2,12 @@
 
 /* Makes a directory on the EXT2 disk.
  *	If any intermediate path does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
  *  If the directory already exists, return EEXIST.
  */
-int main (int argc, char **argv) {
+int ext2_mkdir(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
 	uint parent;
 	char *last_token = NULL;
 	char *path = argv[argc - 1];
@@ -12,50 +15,62 @@ int main (int argc, char **argv) {
 	/* Check arguments */
 	if (argc != 3) {
 		/* Wrong usage */
-		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_mkdir <image> \
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_mkdir <image> \
 <absolute path on EXT2>\n");
 		return EXIT_FAILURE;
 	}
-	if (!load_simple_disk(argv[1])) {
-		fprintf(stderr, "Failed to load the disk.\n");
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
 		return EXIT_FAILURE;
 	}
 	if (strlen(path) == 0 || path[0] != '/') {
-		fprintf(stderr, "Path must be absolute (so must start with /)\n");
-		unload_disk(false);
+		fprintf(err, "Path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
-	parent = get_parent_inode_at_path(path);
+	parent = get_parent_inode_at_path(img, path);
 	last_token = find_last_token(path);
 	if (parent == 0) {
 		/* Intermediate path does not exist */
-		fprintf(stderr, "No directory found\n");
-		unload_disk(false);
-		return ENOENT;
+		fprintf(err, "No directory found\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
 	}
 	
-	if (find_direct_child(parent, last_token) != 0) {
+	if (find_direct_child(img, parent, last_token) != 0) {
 		/* Directory exists */
-		fprintf(stderr, "%s exists already\n", last_token);
-		unload_disk(false);
+		fprintf(err, "%s exists already\n", last_token);
+		unload_disk(img, false);
 		return EEXIST;
 	}
 	if (strlen(last_token) > EXT2_NAME_LEN) {
 		/* Too long */
-		fprintf(stderr, "Name %s is too long\n", last_token);
-		unload_disk(false);
+		fprintf(err, "Name %s is too long\n", last_token);
+		unload_disk(img, false);
 		return ENAMETOOLONG;
 	}
-    if (new_inode(parent, 1, EXT2_S_IFDIR, last_token) == NULL) {
+    if (new_inode(img, parent, 1, EXT2_S_IFDIR, last_token) == NULL) {
 		/* No space */
-		fprintf(stderr, "No space found on disk\n");
-		unload_disk(false);
+		fprintf(err, "No space found on disk\n");
+		unload_disk(img, false);
 		return ENOSPC;
 	}
 	
-	if (!unload_disk(true)) {
-		fprintf(stderr, "Failed to unload the disk.\n");
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_mkdir(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include "ext2_imager.h"
+
+/* Returns true if group g keeps a copy of the superblock and group
+ * descriptors. With sparse_super, only groups 0, 1 and powers of 3, 5
+ * and 7 do.
+ */
+static bool has_super(uint g) {
+	uint base, n;
+
+	if (g <= 1) {
+		return true;
+	}
+	for (base = 3; base <= 7; base += 2) {
+		for (n = base; n < g; n *= base);
+		if (n == g) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Parses a size in bytes, with an optional K, M, G or T suffix.
+ * Return 0 if it is not a size.
+ */
+static off_t parse_size(const char *arg) {
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 10);
+	const char *units = "KMGT";
+	const char *unit;
+
+	if (end == arg) {
+		return 0;
+	}
+	if (*end != '\0') {
+		if ((unit = strchr(units, *end)) == NULL || end[1] != '\0') {
+			return 0;
+		}
+		size <<= 10 * (unit - units + 1);
+	}
+	return (off_t)size;
+}
+
+/* Writes len bytes of buf at off in the image. Return true on success. */
+static bool write_at(int fd, const void *buf, size_t len, off_t off) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("pwrite");
+			return false;
+		}
+		buf = (const ubyte *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* Sets bits from start up to, not including, end in a bitmap. */
+static void set_bits(ubyte *bitmap, uint start, uint end) {
+	for (; start < end; start++) {
+		bitmap[start / BITS_PER_BYTE] |= (1 << (start % BITS_PER_BYTE));
+	}
+}
+
+/* Fills in a directory entry, spanning rec_len bytes.
+ * Return the entry following it.
+ */
+static dir_entry *set_dir_entry(dir_entry *d, uint index, ubyte type,
+								const char *name, uint rec_len) {
+	d->inode = index;
+	d->rec_len = rec_len;
+	d->name_len = strlen(name);
+	d->file_type = type;
+	memcpy(d->name, name, d->name_len);
+	return (dir_entry *)((ubyte *)d + rec_len);
+}
+
+/* Fills in a new directory inode with blocks starting at block. */
+static void set_dir_inode(inode *i, ushort mode, ushort links, uint block,
+							uint blocks, uint block_size, uint now) {
+	uint b;
+
+	memset(i, 0, sizeof(inode));
+	i->i_mode = EXT2_S_IFDIR | mode;
+	i->i_size = blocks * block_size;
+	i->i_atime = i->i_ctime = i->i_mtime = now;
+	i->i_links_count = links;
+	i->i_blocks = blocks * (block_size / EXT2_SECTOR_SIZE);
+	for (b = 0; b < blocks; b++) {
+		i->i_block[b] = block + b;
+	}
+}
+
+/* Makes a new EXT2 image file, with a root directory and lost+found.
+ * The file is sparse: only the superblocks, group descriptors, bitmaps
+ * and the first few inodes and directory blocks are written. Inode
+ * tables stay holes, which read as unused inodes until first written.
+ *	If the size, block size or inode ratio is not usable, return EINVAL.
+ *	If the image is too big for 32-bit block numbers, return EFBIG.
+ *	If the image is too small to hold a file system, return ENOSPC.
+ * Argument: If -b is provided, use that block size (1024, 2048 or 4096).
+ *			If -i is provided, make one inode per that many bytes.
+ */
+int ext2_mkfs(int argc, char **argv) {
+	super_block sb;
+	group_desc *gd;
+	ubyte *buf;
+	dir_entry *d;
+	inode root, lpf;
+	off_t size;
+	unsigned long long count;
+	uint block_size = EXT2_BLOCK_SIZE, ratio = EXT2_MKFS_INODE_RATIO;
+	uint g, groups, start, len, overhead, gdt_blocks, table_blocks, ipg;
+	uint lpf_blocks, dir_block, now = (uint)time(NULL);
+	int fd, arg, rnd;
+	bool ok = true;
+
+	/* Check arguments */
+	for (arg = 2; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc - 1) {
+			block_size = (uint)atoi(argv[++arg]);
+		} else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc - 1) {
+			ratio = (uint)atoi(argv[++arg]);
+		} else {
+			break;
+		}
+	}
+	if (argc < 3 || arg != argc - 1) {
+		/* Wrong usage */
+		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_mkfs <image> \
+[-b <block size>] [-i <bytes per inode>] <size>[K|M|G|T]\n");
+		return EXIT_FAILURE;
+	}
+	if ((size = parse_size(argv[argc - 1])) == 0) {
+		fprintf(stderr, "Invalid size %s\n", argv[argc - 1]);
+		return EINVAL;
+	}
+	if ((block_size != 1024 && block_size != 2048 && block_size != 4096)
+			|| ratio < block_size) {
+		fprintf(stderr, "Block size must be 1024, 2048 or 4096, \
+and at most the bytes per inode\n");
+		return EINVAL;
+	}
+
+	/* Lay out the groups */
+	memset(&sb, 0, sizeof(sb));
+	if ((count = size / block_size) > UINT_MAX) {
+		fprintf(stderr, "Image is too big for %u byte blocks\n", block_size);
+		return EFBIG;
+	}
+	sb.s_blocks_count = (uint)count;
+	sb.s_first_data_block = (block_size == 1024 ? 1 : 0);
+	sb.s_log_block_size = sb.s_log_frag_size = (block_size == 1024 ? 0
+											: (block_size == 2048 ? 1 : 2));
+	sb.s_blocks_per_group = sb.s_frags_per_group = block_size * BITS_PER_BYTE;
+	if (sb.s_blocks_count <= sb.s_first_data_block) {
+		fprintf(stderr, "Image is too small\n");
+		return ENOSPC;
+	}
+	groups = DIV_UP(sb.s_blocks_count - sb.s_first_data_block, sb.s_blocks_per_group);
+
+	/* Enough inodes for the ratio, filling whole inode table blocks */
+	count = DIV_UP((unsigned long long)sb.s_blocks_count * block_size / ratio, groups);
+	len = block_size / sizeof(inode); /* Inodes per block */
+	ipg = DIV_UP((uint)count, len) * len;
+	if (ipg < EXT2_MKFS_MIN_INODES) {
+		ipg = EXT2_MKFS_MIN_INODES;
+	}
+	if (ipg > sb.s_blocks_per_group) {
+		ipg = sb.s_blocks_per_group; /* All one inode bitmap holds */
+	}
+	table_blocks = ipg / len;
+
+	/* A last group too small to hold its own tables is dropped */
+	gdt_blocks = DIV_UP(groups * sizeof(group_desc), block_size);
+	start = sb.s_first_data_block + (groups - 1) * sb.s_blocks_per_group;
+	overhead = (has_super(groups - 1) ? 1 + gdt_blocks : 0) + 2 + table_blocks;
+	if (sb.s_blocks_count - start < overhead + EXT2_MKFS_MIN_FREE && groups > 1) {
+		groups--;
+		sb.s_blocks_count = start;
+		gdt_blocks = DIV_UP(groups * sizeof(group_desc), block_size);
+	}
+	lpf_blocks = EXT2_MKFS_LPF_SIZE / block_size;
+	if (lpf_blocks > EXT2_NUM_SINGLE) {
+		lpf_blocks = EXT2_NUM_SINGLE;
+	}
+	if (sb.s_blocks_count - sb.s_first_data_block <
+			1 + gdt_blocks + 2 + table_blocks + 1 + lpf_blocks) {
+		fprintf(stderr, "Image is too small\n");
+		return ENOSPC;
+	}
+
+	sb.s_inodes_per_group = ipg;
+	sb.s_inodes_count = ipg * groups;
+	sb.s_r_blocks_count = sb.s_blocks_count / 20; /* 5% for root */
+	sb.s_wtime = sb.s_lastcheck = now;
+	sb.s_max_mnt_count = (ushort)-1;
+	sb.s_magic = EXT2_SUPER_MAGIC;
+	sb.s_state = EXT2_VALID_FS;
+	sb.s_errors = EXT2_ERRORS_CONTINUE;
+	sb.s_rev_level = EXT2_DYNAMIC_REV;
+	sb.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	sb.s_inode_size = sizeof(inode);
+	sb.s_feature_compat = EXT2_FEATURE_COMPAT_DIR_PREALLOC;
+	sb.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+	sb.s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	sb.s_prealloc_dir_blocks = EXT2_MKFS_PREALLOC_DIR;
+	if ((rnd = open("/dev/urandom", O_RDONLY)) < 0
+			|| read(rnd, sb.s_uuid, sizeof(sb.s_uuid)) != sizeof(sb.s_uuid)) {
+		srand(now ^ getpid());
+		for (g = 0; g < sizeof(sb.s_uuid); g++) {
+			sb.s_uuid[g] = rand();
+		}
+	}
+	if (rnd >= 0) {
+		close(rnd);
+	}
+
+	if ((gd = calloc(groups, sizeof(group_desc))) == NULL
+			|| (buf = calloc(1, block_size)) == NULL) {
+		perror("calloc");
+		free(gd);
+		return EXIT_FAILURE;
+	}
+
+	/* Sparse file of the full size, so untouched blocks read as zeros */
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		free(gd);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(fd, (off_t)sb.s_blocks_count * block_size) < 0) {
+		perror("ftruncate");
+		ok = false;
+	}
+
+	/* Group descriptors and block bitmaps */
+	for (g = 0; ok && g < groups; g++) {
+		start = sb.s_first_data_block + g * sb.s_blocks_per_group;
+		len = sb.s_blocks_count - start;
+		if (len > sb.s_blocks_per_group) {
+			len = sb.s_blocks_per_group;
+		}
+		overhead = (has_super(g) ? 1 + gdt_blocks : 0);
+		gd[g].bg_block_bitmap = start + overhead;
+		gd[g].bg_inode_bitmap = start + overhead + 1;
+		gd[g].bg_inode_table = start + overhead + 2;
+		overhead += 2 + table_blocks;
+		gd[g].bg_free_blocks_count = len - overhead;
+		gd[g].bg_free_inodes_count = ipg;
+		if (g == 0) {
+			/* Root and lost+found go right after the first inode table */
+			overhead += 1 + lpf_blocks;
+			gd[g].bg_free_blocks_count -= 1 + lpf_blocks;
+			gd[g].bg_free_inodes_count -= EXT2_GOOD_OLD_FIRST_INO;
+			gd[g].bg_used_dirs_count = 2;
+		}
+		sb.s_free_blocks_count += gd[g].bg_free_blocks_count;
+		sb.s_free_inodes_count += gd[g].bg_free_inodes_count;
+
+		/* Blocks past the end of a short last group are marked used */
+		memset(buf, 0, block_size);
+		set_bits(buf, 0, overhead);
+		set_bits(buf, len, block_size * BITS_PER_BYTE);
+		ok = write_at(fd, buf, block_size, (off_t)gd[g].bg_block_bitmap * block_size);
+
+		/* As are inodes past the end of each group */
+		memset(buf, 0, block_size);
+		set_bits(buf, ipg, block_size * BITS_PER_BYTE);
+		if (g == 0) {
+			set_bits(buf, 0, EXT2_GOOD_OLD_FIRST_INO); /* Reserved and lost+found */
+		}
+		ok = ok && write_at(fd, buf, block_size,
+							(off_t)gd[g].bg_inode_bitmap * block_size);
+	}
+
+	/* Superblock and descriptor copies */
+	for (g = 0; ok && g < groups; g++) {
+		if (!has_super(g)) {
+			continue;
+		}
+		start = sb.s_first_data_block + g * sb.s_blocks_per_group;
+		sb.s_block_group_nr = g;
+		ok = write_at(fd, &sb, sizeof(sb),
+						(g == 0 ? EXT2_SB_OFFSET : (off_t)start * block_size))
+				&& write_at(fd, gd, groups * sizeof(group_desc),
+						(off_t)(start + 1) * block_size);
+	}
+
+	/* Root, then lost+found */
+	dir_block = gd[0].bg_inode_table + table_blocks;
+	set_dir_inode(&root, 0755, 3, dir_block, 1, block_size, now);
+	set_dir_inode(&lpf, 0700, 2, dir_block + 1, lpf_blocks, block_size, now);
+	if (ok) {
+		memset(buf, 0, block_size);
+		d = set_dir_entry((dir_entry *)buf, EXT2_ROOT_INO, EXT2_FT_DIR, ".", 12);
+		d = set_dir_entry(d, EXT2_ROOT_INO, EXT2_FT_DIR, "..", 12);
+		set_dir_entry(d, EXT2_LPF_INO, EXT2_FT_DIR, "lost+found", block_size - 24);
+		ok = write_at(fd, buf, block_size, (off_t)dir_block * block_size);
+	}
+	for (g = 0; ok && g < lpf_blocks; g++) {
+		memset(buf, 0, block_size);
+		if (g == 0) {
+			d = set_dir_entry((dir_entry *)buf, EXT2_LPF_INO, EXT2_FT_DIR, ".", 12);
+			set_dir_entry(d, EXT2_ROOT_INO, EXT2_FT_DIR, "..", block_size - 12);
+		} else {
+			((dir_entry *)buf)->rec_len = block_size; /* Empty */
+		}
+		ok = write_at(fd, buf, block_size, (off_t)(dir_block + 1 + g) * block_size);
+	}
+	ok = ok && write_at(fd, &root, sizeof(inode), (off_t)gd[0].bg_inode_table * block_size
+										+ (EXT2_ROOT_INO - 1) * sizeof(inode))
+			&& write_at(fd, &lpf, sizeof(inode), (off_t)gd[0].bg_inode_table * block_size
+										+ (EXT2_LPF_INO - 1) * sizeof(inode));
+
+	/* Cleanup */
+	free(gd);
+	free(buf);
+    if (close(fd) < 0) {
+		perror("close");
+		return EXIT_FAILURE;
+    }
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s\n", argv[1]);
+		return EIO;
+	}
+	return EXIT_SUCCESS;
+}
+
+int main (int argc, char **argv) {
+	return ext2_mkfs(argc, argv);
+}
\ No newline at end of file
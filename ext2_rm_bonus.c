@@ -2,11 +2,14 @@
 
 /* Removes a file or link, or recursively removes a directory on the EXT2 disk.
  *	If file does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
  *  If file is a directory, return EISDIR.
  * Argument: If -r is provided, remove a directory instead.
  *			If a file or link is provided, ignore the -r.
  */
-int main (int argc, char **argv) {
+int ext2_rm_bonus(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
 	bool dir = (argc == 4 && strcmp(argv[2], "-r") == 0);
 	char *path = argv[argc - 1], *last_token;
 	uint curr, parent;
@@ -14,58 +17,70 @@ int main (int argc, char **argv) {
 	/* Check arguments */
 	if (argc != 3 && !dir) {
 		/* Wrong usage */
-		fprintf(stderr, "Incorrect parameters. Usage: ./ext2_rm_bonus \
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_rm_bonus \
 <image> [-r] <absolute path on EXT2>\n");
 		return EXIT_FAILURE;
 	}
-	if (!load_simple_disk(argv[1])) {
-		fprintf(stderr, "Failed to load the disk.\n");
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
 		return EXIT_FAILURE;
 	}
 	if (strlen(path) == 0 || path[0] != '/') {
-		fprintf(stderr, "Path must be absolute (so must start with /)\n");
-		unload_disk(false);
+		fprintf(err, "Path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
-	parent = get_parent_inode_at_path(path);
+	parent = get_parent_inode_at_path(img, path);
 	last_token = find_last_token(path);
-	curr = find_direct_child(parent, last_token);
+	curr = find_direct_child(img, parent, last_token);
 	if (curr == 0) {
 		/* Intermediate path does not exist */
-		fprintf(stderr, "Path does not exist\n");
-		unload_disk(false);
-		return ENOENT;
+		fprintf(err, "Path does not exist\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
 	}
 	if (curr == parent || curr == EXT2_ROOT_INO) {
 		/* Trying to delete root */
-		fprintf(stderr, "Cannot delete special directory\n");
-		unload_disk(false);
+		fprintf(err, "Cannot delete special directory\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	if (!dir) {
 		if (path[strlen(path) - 1] == '/') {
-			fprintf(stderr, "Path must refer to a file (so cannot end with /)\n");
-			unload_disk(false);
+			fprintf(err, "Path must refer to a file (so cannot end with /)\n");
+			unload_disk(img, false);
 			return EINVAL;
 		}
-		if (IS(get_valid_inode(curr)->i_mode, EXT2_S_IFDIR)) {
+		if (IS(get_valid_inode(img, curr)->i_mode, EXT2_S_IFDIR)) {
 			/* Source is directory */
-			fprintf(stderr, "Path is a directory\n");
-			unload_disk(false);
+			fprintf(err, "Path is a directory\n");
+			unload_disk(img, false);
 			return EISDIR;
 		}
 	}
 	
-	if (!remove_entry(curr, last_token, get_valid_inode(parent))) {
+	if (!remove_entry(img, curr, last_token, get_valid_inode(img, parent))) {
 		/* Source is directory */
-		fprintf(stderr, "Unknown error...\n");
-		unload_disk(false);
+		fprintf(err, "Unknown error...\n");
+		unload_disk(img, false);
 		return EINVAL;
 	}
 	
-	if (!unload_disk(true)) {
-		fprintf(stderr, "Failed to unload the disk.\n");
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_rm_bonus(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include "ext2_imager.h"
+#include <sys/syscall.h>
+
+/* One finished span, kept for the trace file */
+typedef struct {
+	unsigned long long start;	/* Nanoseconds since tracing started */
+	unsigned long long length;
+	uint tid;
+	trace_span span;
+} trace_event;
+
+/* Names of the spans, as reported and in the trace file */
+static const char *SPAN_NAMES[EXT2_TRACE_SPANS] = {"load_simple_disk",
+	"get_parent_inode_at_path", "new_inode", "write_file_data",
+	"remove_entry", "unload_disk"};
+
+/* Whether tracing is on, from the environment, once looked at */
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static bool tracing = false;
+static unsigned long long trace_epoch;
+static char *trace_file;
+
+/* Per span, how many took each bucket's range of nanoseconds */
+static unsigned long long histograms[EXT2_TRACE_SPANS][EXT2_TRACE_BUCKETS];
+static unsigned long long longest[EXT2_TRACE_SPANS];
+static unsigned long long totals[EXT2_TRACE_SPANS];
+
+/* Spans kept for the trace file, if one was asked for */
+static trace_event *events;
+static uint events_used, events_size, events_dropped;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Gets the time in nanoseconds, from a clock that only goes forward. */
+static unsigned long long get_time_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Gets the histogram bucket for a span of ns nanoseconds. Buckets are
+ * exact below 2 * EXT2_TRACE_SUB, then each power of two is split into
+ * EXT2_TRACE_SUB buckets, so any value is within 1 / EXT2_TRACE_SUB of
+ * its bucket's bounds, however large.
+ */
+static uint get_bucket(unsigned long long ns) {
+	uint shift;
+
+	if (ns < 2 * EXT2_TRACE_SUB) {
+		return (uint)ns;
+	}
+	shift = 63 - __builtin_clzll(ns) - EXT2_TRACE_SUB_BITS;
+	return shift * EXT2_TRACE_SUB + (uint)(ns >> shift);
+}
+
+/* Gets the largest value that falls in a bucket. */
+static unsigned long long get_bucket_max(uint bucket) {
+	uint shift;
+
+	if (bucket < 2 * EXT2_TRACE_SUB) {
+		return bucket;
+	}
+	shift = bucket / EXT2_TRACE_SUB - 1;
+	return ((unsigned long long)(bucket % EXT2_TRACE_SUB + EXT2_TRACE_SUB + 1)
+				<< shift) - 1;
+}
+
+/* Gets the value under which a fraction of the spans in a histogram
+ * fall, no larger than the longest span seen.
+ */
+static unsigned long long get_percentile(trace_span span, unsigned long long count,
+											double fraction) {
+	unsigned long long seen = 0, target = (unsigned long long)(count * fraction);
+	uint bucket;
+
+	for (bucket = 0; bucket < EXT2_TRACE_BUCKETS; bucket++) {
+		seen += histograms[span][bucket];
+		if (seen > target || seen == count) {
+			break;
+		}
+	}
+	if (bucket == EXT2_TRACE_BUCKETS || get_bucket_max(bucket) > longest[span]) {
+		return longest[span];
+	}
+	return get_bucket_max(bucket);
+}
+
+/* Writes every span kept to the trace file, in the Chrome trace event
+ * format, which trace viewers like Perfetto open directly.
+ */
+static void write_trace_file(void) {
+	FILE *f;
+	uint i;
+
+	if ((f = fopen(trace_file, "w")) == NULL) {
+		perror("fopen");
+		return;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = 0; i < events_used; i++) {
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,"
+					"\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%u}", (i == 0 ? "" : ","),
+					SPAN_NAMES[events[i].span], events[i].start / 1000,
+					events[i].start % 1000, events[i].length / 1000,
+					events[i].length % 1000, (int)getpid(), events[i].tid);
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0) {
+		perror("fclose");
+	}
+	if (events_dropped > 0) {
+		fprintf(stderr, "%u spans left out of %s, past the first %u\n",
+					events_dropped, trace_file, EXT2_TRACE_MAX_EVENTS);
+	}
+}
+
+/* Prints a histogram summary of every span that was timed, and writes
+ * the trace file if one was asked for. Run at exit.
+ */
+static void report_spans(void) {
+	unsigned long long count;
+	uint span, bucket;
+
+	fprintf(stderr, "%-26s %9s %12s %10s %10s %10s %10s %10s\n", "span (us)",
+				"count", "total", "p50", "p90", "p99", "p99.9", "max");
+	for (span = 0; span < EXT2_TRACE_SPANS; span++) {
+		count = 0;
+		for (bucket = 0; bucket < EXT2_TRACE_BUCKETS; bucket++) {
+			count += histograms[span][bucket];
+		}
+		if (count == 0) {
+			continue;
+		}
+		fprintf(stderr, "%-26s %9llu %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+					SPAN_NAMES[span], count, totals[span] / 1000.0,
+					get_percentile(span, count, 0.5) / 1000.0,
+					get_percentile(span, count, 0.9) / 1000.0,
+					get_percentile(span, count, 0.99) / 1000.0,
+					get_percentile(span, count, 0.999) / 1000.0,
+					longest[span] / 1000.0);
+	}
+	if (trace_file != NULL) {
+		write_trace_file();
+	}
+	free(events);
+}
+
+/* Turns tracing on if EXT2_TRACE is set to anything but 0, or a trace
+ * file is named in EXT2_TRACE_FILE.
+ */
+static void start_tracing(void) {
+	char *on = getenv(EXT2_TRACE_ENV);
+
+	trace_file = getenv(EXT2_TRACE_FILE_ENV);
+	if (trace_file != NULL && strlen(trace_file) == 0) {
+		trace_file = NULL;
+	}
+	if ((on != NULL && strlen(on) > 0 && strcmp(on, "0") != 0) || trace_file != NULL) {
+		trace_epoch = get_time_ns();
+		tracing = (atexit(report_spans) == 0);
+	}
+}
+
+/* Keeps a finished span for the trace file, up to EXT2_TRACE_MAX_EVENTS. */
+static void keep_event(trace_span span, unsigned long long start,
+						unsigned long long length) {
+	static __thread uint tid;
+	trace_event *bigger;
+	uint size;
+
+	if (tid == 0) {
+		tid = (uint)syscall(SYS_gettid);
+	}
+	pthread_mutex_lock(&events_lock);
+	if (events_used == events_size && events_size < EXT2_TRACE_MAX_EVENTS) {
+		size = (events_size == 0 ? 1024 : events_size * 2);
+		if (size > EXT2_TRACE_MAX_EVENTS) {
+			size = EXT2_TRACE_MAX_EVENTS;
+		}
+		if ((bigger = realloc(events, size * sizeof(trace_event))) != NULL) {
+			events = bigger;
+			events_size = size;
+		}
+	}
+	if (events_used < events_size) {
+		events[events_used].start = start - trace_epoch;
+		events[events_used].length = length;
+		events[events_used].tid = tid;
+		events[events_used++].span = span;
+	} else {
+		events_dropped++;
+	}
+	pthread_mutex_unlock(&events_lock);
+}
+
+/* Starts timing a span, if tracing is on. See TRACE_SPAN(). */
+trace_scope begin_span(trace_span span) {
+	trace_scope scope;
+
+	pthread_once(&trace_once, start_tracing);
+	scope.span = span;
+	scope.start = (tracing ? get_time_ns() : 0);
+	return scope;
+}
+
+/* Ends a span begun by begin_span(), adding it to its histogram. */
+void end_span(trace_scope *scope) {
+	unsigned long long length, prev;
+
+	if (scope->start == 0) {
+		return; /* Not tracing */
+	}
+	length = get_time_ns() - scope->start;
+	__atomic_add_fetch(&histograms[scope->span][get_bucket(length)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals[scope->span], length, __ATOMIC_RELAXED);
+	prev = __atomic_load_n(&longest[scope->span], __ATOMIC_RELAXED);
+	while (length > prev && !__atomic_compare_exchange_n(&longest[scope->span], &prev,
+								length, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* prev was reloaded, try again */
+	}
+	if (trace_file != NULL) {
+		keep_event(scope->span, scope->start, length);
+	}
+}
@@ -0,0 +1,72 @@
+#include "ext2_imager.h"
+
+/* Sets the size of a file on the EXT2 disk. Shrinking frees only the blocks
+ * past the new end; growing leaves a hole, reading as zeros.
+ *	If the path does not exist, return ENOENT.
+ *  If the path loops through symlinks, return ELOOP.
+ *  If a name in the path is too long, return ENAMETOOLONG.
+ *  If the path is a directory, return EISDIR.
+ *  If the size is not a number below 4G, return EINVAL.
+ */
+int ext2_truncate(int argc, char **argv, FILE *out, FILE *err) {
+	image *img;
+	char *path = argv[argc - 1], *end;
+	unsigned long long size;
+	uint index;
+	int ret;
+	
+	/* Check arguments */
+	if (argc != 4) {
+		/* Wrong usage */
+		fprintf(err, "Incorrect parameters. Usage: ./ext2_truncate <image> \
+<size in bytes> <absolute path on EXT2>\n");
+		return EXIT_FAILURE;
+	}
+	errno = 0;
+	size = strtoull(argv[2], &end, 10);
+	if (end == argv[2] || *end != '\0' || errno != 0 || size > UINT_MAX
+			|| argv[2][0] == '-') {
+		fprintf(err, "Invalid size %s\n", argv[2]);
+		return EINVAL;
+	}
+	if ((img = load_disk(argv[1], out, err)) == NULL) {
+		fprintf(err, "Failed to load the disk.\n");
+		return EXIT_FAILURE;
+	}
+	if (strlen(path) == 0 || path[0] != '/') {
+		fprintf(err, "Path must be absolute (so must start with /)\n");
+		unload_disk(img, false);
+		return EINVAL;
+	}
+	if ((index = get_inode_at_path(img, path)) == 0) {
+		fprintf(err, "No such file or directory\n");
+		unload_disk(img, false);
+		return (errno == ELOOP || errno == ENAMETOOLONG ? errno : ENOENT);
+	}
+	
+	if (!truncate_file(img, index, (uint)size)) {
+		ret = errno;
+		fprintf(err, (ret == EISDIR ? "Path is a directory\n" 
+							: "Path is not a regular file\n"));
+		unload_disk(img, false);
+		return ret;
+	}
+	
+	if (!unload_disk(img, true)) {
+		fprintf(err, "Failed to unload the disk.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#ifndef EXT2_IMAGERD
+int main (int argc, char **argv) {
+	int ret;
+	
+	/* Let a running ext2_imagerd serve this, if there is one */
+	if ((ret = run_on_daemon(argc, argv)) >= 0) {
+		return ret;
+	}
+	return ext2_truncate(argc, argv, stdout, stderr);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,542 @@
+#include "ext2_imager.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* A minimal io_uring instance, driven through the raw system calls. */
+typedef struct {
+	int fd;
+	uint depth;
+	bool fixed;			/* Whether bufs are registered with the kernel */
+	uint *sq_tail, *sq_mask, *sq_array;
+	uint *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+	ubyte *bufs;		/* depth buffers of EXT2_URING_CHUNK bytes */
+} uring;
+
+/* One transfer between a host file and physically contiguous blocks. */
+typedef struct {
+	uint block;			/* First block on the disk */
+	uint len;			/* Bytes to transfer */
+	off_t off;			/* Offset in the host file */
+} io_run;
+
+/* Unmaps and closes everything owned by the ring. */
+static void uring_close(uring *r) {
+	if (r->bufs != NULL) {
+		munmap(r->bufs, (size_t)r->depth * EXT2_URING_CHUNK);
+	}
+	if (r->sqes != NULL) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_size);
+	}
+	if (r->sq_ring != NULL) {
+		munmap(r->sq_ring, r->sq_size);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+}
+
+/* Sets up a ring with depth entries and registers its buffers.
+ * Return false if io_uring is unavailable.
+ */
+static bool uring_open(uring *r, uint depth) {
+	struct io_uring_params p;
+	struct iovec *iov;
+	ubyte *sq, *cq;
+	uint i;
+
+	memset(r, 0, sizeof(uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (r->fd < 0) {
+		return false;
+	}
+	r->depth = p.sq_entries;
+
+	/* Map the submission and completion rings */
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (IS(p.features, IORING_FEAT_SINGLE_MMAP) && r->cq_size > r->sq_size) {
+		r->sq_size = r->cq_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		uring_close(r);
+		return false;
+	}
+	if (IS(p.features, IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			uring_close(r);
+			return false;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		uring_close(r);
+		return false;
+	}
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_tail = (uint *)(sq + p.sq_off.tail);
+	r->sq_mask = (uint *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (uint *)(sq + p.sq_off.array);
+	r->cq_head = (uint *)(cq + p.cq_off.head);
+	r->cq_tail = (uint *)(cq + p.cq_off.tail);
+	r->cq_mask = (uint *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* One staging buffer per entry, registered so the kernel pins them once */
+	r->bufs = mmap(NULL, (size_t)r->depth * EXT2_URING_CHUNK,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->bufs == MAP_FAILED) {
+		r->bufs = NULL;
+		uring_close(r);
+		return false;
+	}
+	if ((iov = malloc(r->depth * sizeof(struct iovec))) != NULL) {
+		for (i = 0; i < r->depth; i++) {
+			iov[i].iov_base = r->bufs + (size_t)i * EXT2_URING_CHUNK;
+			iov[i].iov_len = EXT2_URING_CHUNK;
+		}
+		/* Without registration (e.g. RLIMIT_MEMLOCK) use plain reads/writes */
+		r->fixed = syscall(__NR_io_uring_register, r->fd,
+						IORING_REGISTER_BUFFERS, iov, r->depth) == 0;
+		free(iov);
+	}
+	return true;
+}
+
+/* Transfers runs synchronously, one pread/pwrite per run. */
+static bool transfer_runs_sync(image *img, int host, io_run *runs, 
+								uint num_runs, bool in) {
+	uint i, done;
+	ssize_t ret;
+	ubyte *ptr;
+
+	for (i = 0; i < num_runs; i++) {
+		ptr = get_block(img, runs[i].block);
+		for (done = 0; done < runs[i].len; done += ret) {
+			if (in) {
+				ret = pread(host, ptr + done, runs[i].len - done,
+							runs[i].off + done);
+			} else {
+				ret = pwrite(host, ptr + done, runs[i].len - done,
+							runs[i].off + done);
+			}
+			if (ret <= 0) {
+				if (ret < 0 && errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				print_error(img->err, in ? "pread" : "pwrite");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* Transfers runs through the ring, keeping up to depth of them in flight.
+ * If in is true, reads the host file into the disk; otherwise writes out.
+ */
+static bool transfer_runs_ring(image *img, uring *r, int host, io_run *runs,
+								uint num_runs, bool in) {
+	uint owner[r->depth], free_slots[r->depth];
+	uint num_free, next, inflight, pending, queued;
+	uint slot, tail, head;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	io_run *run;
+	ubyte *buf;
+	bool ok = true;
+	int ret;
+
+	for (num_free = 0; num_free < r->depth; num_free++) {
+		free_slots[num_free] = num_free;
+	}
+	next = 0;
+	inflight = 0;
+	pending = 0;
+	while ((ok && next < num_runs) || inflight > 0) {
+		/* Fill every free buffer with a new request */
+		tail = *r->sq_tail;
+		for (queued = 0; ok && next < num_runs && num_free > 0; queued++) {
+			slot = free_slots[--num_free];
+			owner[slot] = next;
+			run = &runs[next++];
+			buf = r->bufs + (size_t)slot * EXT2_URING_CHUNK;
+			if (!in) {
+				memcpy(buf, get_block(img, run->block), run->len);
+			}
+
+			sqe = &r->sqes[tail & *r->sq_mask];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			if (r->fixed) {
+				sqe->opcode = in ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+				sqe->buf_index = slot;
+			} else {
+				sqe->opcode = in ? IORING_OP_READ : IORING_OP_WRITE;
+			}
+			sqe->fd = host;
+			sqe->addr = (unsigned long)buf;
+			sqe->len = run->len;
+			sqe->off = run->off;
+			sqe->user_data = slot;
+			r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+			tail++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+		pending += queued;
+
+		/* Submit everything queued and wait for at least one completion */
+		ret = syscall(__NR_io_uring_enter, r->fd, pending, 1,
+						IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error(img->err, "io_uring_enter");
+			return false;
+		}
+		pending -= ret;
+		inflight += ret;
+
+		/* Reap completions and hand their buffers back */
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			slot = (uint)cqe->user_data;
+			run = &runs[owner[slot]];
+			if (cqe->res != (int)run->len) {
+				/* Short transfers only happen if the host file changed */
+				errno = (cqe->res < 0 ? -cqe->res : EIO);
+				print_error(img->err, in ? "read" : "write");
+				ok = false;
+			} else if (in) {
+				memcpy(get_block(img, run->block),
+						r->bufs + (size_t)slot * EXT2_URING_CHUNK, run->len);
+			}
+			free_slots[num_free++] = slot;
+			inflight--;
+			head++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return ok;
+}
+
+/* Groups the data blocks of a walk into runs of physically contiguous
+ * blocks, up to EXT2_URING_CHUNK bytes each, until max runs are found.
+ * Of a file len bytes long, whose byte skew is at the start of the host
+ * file. e holds what is left of the extent being split, carried over
+ * between calls.
+ * Return the number of runs, 0 once the walk is done.
+ */
+static uint get_runs(block_walker *w, block_extent *e, uint len, off_t skew,
+						io_run *runs, uint max) {
+	image *img = w->img;
+	uint chunk = EXT2_URING_CHUNK >> img->block_bits, count, num_runs = 0;
+	off_t off;
+	io_run *run;
+
+	while (num_runs < max && (e->count > 0 || next_block_extent(w, e))) {
+		count = (e->count < chunk ? e->count : chunk);
+		off = (off_t)e->lblk << img->block_bits;
+		run = &runs[num_runs++];
+		run->block = e->block;
+		run->off = off - skew;
+		run->len = count << img->block_bits;
+		if (off + run->len > len) {
+			run->len = len - off; /* Ends partway through the last block */
+		}
+		e->lblk += count;
+		e->block += count;
+		e->count -= count;
+	}
+	return num_runs;
+}
+
+/* Transfers num_blocks data blocks of an inode from first, of a file len
+ * bytes long, to or from the host file, where byte skew of the inode is
+ * at its start. Uses a ring of the given depth, or synchronous I/O if
+ * depth is 0 or io_uring is unavailable. The blocks are walked as they
+ * are transferred, a batch of EXT2_URING_RUNS runs at a time, so the
+ * walk reads ahead of the transfer.
+ * If in is true, reads the host file into the disk; otherwise writes out.
+ */
+static bool transfer_file(image *img, inode *i, int host, uint first, uint num_blocks,
+							uint len, off_t skew, bool in, uint depth) {
+	io_run runs[EXT2_URING_RUNS];
+	block_walker w;
+	block_extent e;
+	uring r;
+	uint num_runs;
+	bool ring, ok = true;
+
+	if (depth > EXT2_URING_RUNS) {
+		depth = EXT2_URING_RUNS;
+	}
+	if (depth > num_blocks) {
+		depth = num_blocks;
+	}
+	ring = (depth > 0 && uring_open(&r, depth));
+	
+	/* Blocks being read in are about to be overwritten, so not read ahead */
+	start_block_walk(img, i, first, num_blocks, !in, &w);
+	e.count = 0;
+	while (ok && (num_runs = get_runs(&w, &e, len, skew, runs, EXT2_URING_RUNS)) > 0) {
+		ok = (ring ? transfer_runs_ring(img, &r, host, runs, num_runs, in)
+					: transfer_runs_sync(img, host, runs, num_runs, in));
+	}
+	if (ring) {
+		uring_close(&r);
+	}
+	return ok;
+}
+
+/* Marks which of the first num_blocks blocks of the host file src hold
+ * any data, using SEEK_DATA/SEEK_HOLE. If the host filesystem can't
+ * report holes, every block is marked.
+ */
+static void get_data_blocks(image *img, int src, uint num_blocks, ubyte *has_data) {
+	off_t data, hole = 0;
+	off_t end = (off_t)num_blocks << img->block_bits;
+	uint lblk;
+	
+	memset(has_data, false, num_blocks);
+	while (hole < end) {
+		if ((data = lseek(src, hole, SEEK_DATA)) < 0) {
+			if (errno != ENXIO) { /* No hole support */
+				memset(has_data, true, num_blocks);
+			}
+			return; /* Otherwise, the rest is a hole */
+		}
+		if ((hole = lseek(src, data, SEEK_HOLE)) < 0 || hole > end) {
+			hole = end;
+		}
+		for (lblk = data >> img->block_bits; lblk < DIV_UP(hole, img->block_size); lblk++) {
+			has_data[lblk] = true;
+		}
+	}
+}
+
+/* Returns how many blocks a copy of the first num_blocks blocks of the
+ * host file src needs, not counting holes. This is what new_inode()
+ * expects for num_blocks.
+ */
+uint get_host_data_blocks(image *img, int src, uint num_blocks) {
+	ubyte *has_data;
+	uint lblk, count = 0;
+	
+	if (num_blocks == 0 || (has_data = malloc(num_blocks)) == NULL) {
+		return num_blocks;
+	}
+	get_data_blocks(img, src, num_blocks, has_data);
+	for (lblk = 0; lblk < num_blocks; lblk++) {
+		count += has_data[lblk];
+	}
+	free(has_data);
+	
+	if (count == num_blocks) {
+		return num_blocks;
+	}
+	/* The indirect blocks of a dense file bound those of a sparse one */
+	return count + get_total_blocks(img, num_blocks) - num_blocks;
+}
+
+/* Writes len bytes of the host file src into a new inode.
+ * Holes in src, and blocks that turn out to be all zeros, are left as
+ * holes in the inode.
+ * Assumes that num_blocks free blocks are needed and checked for already,
+ * but other writers sharing the image may take them meanwhile.
+ * Return true on success. If the space was taken, return false with
+ * errno set to ENOSPC and the inode left empty.
+ */
+bool write_file_data_async(image *img, inode *i, uint num_blocks, uint len,
+							int src, uint depth) {
+	TRACE_SPAN(EXT2_TRACE_WRITE);
+	ubyte *has_data;
+	uint lblk;
+	uint *ptr;
+	bool ret = false;
+
+	/* Must be a file */
+	assert(!IS(i->i_mode, EXT2_S_IFDIR));
+
+	i->i_size = len;
+	update_inode_summary(img, i);
+	if (len == 0) {
+		return true;
+	}
+	if ((has_data = malloc(num_blocks)) == NULL) {
+		print_error(img->err, "malloc");
+		return false;
+	}
+	
+	/* Allocate everything first so contiguous blocks batch together */
+	get_data_blocks(img, src, num_blocks, has_data);
+	for (lblk = 0; lblk < num_blocks; lblk++) {
+		if (has_data[lblk] && add_block_at(img, i, lblk) == 0) {
+			/* Another writer took the space meanwhile */
+			while (lblk > 0) {
+				unset_block_at(img, i, --lblk);
+			}
+			i->i_size = 0;
+			update_inode_summary(img, i);
+			free(has_data);
+			errno = ENOSPC;
+			return false;
+		}
+	}
+	if (transfer_file(img, i, src, 0, num_blocks, len, 0, true, depth)) {
+		/* Data regions may still contain whole blocks of zeros */
+		for (lblk = 0; lblk < num_blocks; lblk++) {
+			ptr = get_inode_block_ptr(img, i, lblk, false);
+			if (ptr != NULL && *ptr != 0 && is_zero_block(img, get_block(img, *ptr))) {
+				unset_block_at(img, i, lblk);
+			}
+		}
+		ret = true;
+	}
+	update_inode_summary(img, i);
+	free(has_data);
+	return ret;
+}
+
+/* Writes the contents of an inode out to the host file dest.
+ * Return true on success.
+ */
+bool read_file_data_async(image *img, inode *i, int dest, uint depth) {
+	/* Must be a file */
+	assert(!IS(i->i_mode, EXT2_S_IFDIR));
+
+	if (ftruncate(dest, i->i_size) < 0) {
+		print_error(img->err, "ftruncate");
+		return false;
+	}
+	if (is_fast_symlink(i)) {
+		/* Stored in the inode itself */
+		return pwrite(dest, i->i_block, i->i_size, 0) == (ssize_t)i->i_size;
+	}
+	return transfer_file(img, i, dest, 0, DIV_UP(i->i_size, img->block_size), 
+							i->i_size, 0, false, depth);
+}
+
+/* Appends len bytes of the host file src to the end of regular file
+ * i, whose lock the caller holds. The rest of its last block is filled
+ * first, then new blocks are added after it, so nothing already in the
+ * file is read or written again. Blocks of zeros are left as holes.
+ * Return false on failure, with errno set, leaving the file as it was.
+ */
+static bool append_file_data(image *img, inode *i, int src, uint len, uint depth) {
+	uint old = i->i_size, size = old + len, off = old & (img->block_size - 1);
+	uint old_blocks = DIV_UP(old, img->block_size), new_blocks, head, lblk, block;
+	uint *ptr;
+	bool filled = false;	/* Whether the last block was a hole filled here */
+
+	if ((unsigned long long)old + len > UINT_MAX - img->block_size) {
+		errno = EFBIG;
+		return false;
+	}
+	new_blocks = DIV_UP(size, img->block_size);
+	if (!has_space(img, 0, get_total_blocks(img, new_blocks) 
+							- get_total_blocks(img, old_blocks) + (off != 0))) {
+		errno = ENOSPC;
+		return false;
+	}
+
+	/* The rest of the last block, which may be a hole */
+	head = (off == 0 ? 0 : img->block_size - off);
+	if (head > len) {
+		head = len;
+	}
+	if (head > 0) {
+		ptr = get_inode_block_ptr(img, i, old_blocks - 1, false);
+		filled = (ptr == NULL || *ptr == 0);
+		block = (filled ? add_block_at(img, i, old_blocks - 1) : *ptr);
+		if (block == 0 || pread(src, get_block(img, block) + off, head, 0) != (ssize_t)head) {
+			errno = (block == 0 ? ENOSPC : EIO);
+			if (filled && block != 0) {
+				unset_block_at(img, i, old_blocks - 1);
+			}
+			return false;
+		}
+	}
+
+	/* Then new blocks, allocated first so contiguous ones batch together */
+	for (lblk = old_blocks; lblk < new_blocks; lblk++) {
+		if (add_block_at(img, i, lblk) == 0) {
+			/* Another writer took the space meanwhile */
+			i->i_size = size;
+			set_file_size(img, i, old);
+			if (filled) {
+				unset_block_at(img, i, old_blocks - 1);
+			}
+			update_inode_summary(img, i);
+			errno = ENOSPC;
+			return false;
+		}
+	}
+	if (!transfer_file(img, i, src, old_blocks, new_blocks - old_blocks, size, 
+						(off_t)old, true, depth)) {
+		i->i_size = size;
+		set_file_size(img, i, old);
+		if (filled) {
+			unset_block_at(img, i, old_blocks - 1);
+		}
+		update_inode_summary(img, i);
+		errno = EIO;
+		return false;
+	}
+	/* Including a last block that was a hole, if it still holds only zeros */
+	for (lblk = old_blocks - filled; lblk < new_blocks; lblk++) {
+		ptr = get_inode_block_ptr(img, i, lblk, false);
+		if (ptr != NULL && *ptr != 0 && is_zero_block(img, get_block(img, *ptr))) {
+			unset_block_at(img, i, lblk);
+		}
+	}
+	i->i_size = size;
+	i->i_mtime = img->curr_time;
+	i->i_ctime = img->curr_time;
+	update_inode_summary(img, i);
+	return true;
+}
+
+/* Appends len bytes of the host file src to regular file index, holding
+ * its lock, with an io_uring queue of the given depth (0 for none). The
+ * cost depends on len, not on how big the file already is.
+ * Return false on failure, with errno set.
+ */
+bool append_file(image *img, uint index, int src, uint len, uint depth) {
+	inode *i;
+	bool ret = false;
+
+	lock_inode(img, index, true);
+	if ((i = get_valid_inode(img, index)) == NULL) {
+		errno = ENOENT;
+	} else if (!IS_TYPE(i->i_mode, EXT2_S_IFREG)) {
+		errno = (IS(i->i_mode, EXT2_S_IFDIR) ? EISDIR : EINVAL);
+	} else {
+		ret = (len == 0 || append_file_data(img, i, src, len, depth));
+	}
+	unlock_inode(img, index, true);
+	return ret;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Reading an overlay's base image must leave the overlay usable, and
+# changing the base must make it stale. Run from the top of the tree
+# after make.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+./ext2_mkfs "$dir/base.img" 8M > /dev/null
+./ext2_mkdir "$dir/base.img" /d
+./ext2_clone "$dir/base.img" -o "$dir/overlay.img" > /dev/null
+
+# Reads write access times through the base, but do not change it
+./ext2_ls "$dir/base.img" / > /dev/null
+./ext2_ls "$dir/overlay.img" /d
+./ext2_mkdir "$dir/overlay.img" /e
+./ext2_clone "$dir/overlay.img" -c
+./ext2_ls "$dir/base.img" /e
+
+# A change to the base, even in the same second, does
+./ext2_clone "$dir/base.img" -o "$dir/overlay.img" > /dev/null
+./ext2_mkdir "$dir/base.img" /f
+if ./ext2_ls "$dir/overlay.img" / > /dev/null 2>&1; then
+	echo "FAILED: overlay of a changed base still opens"
+	exit 1
+fi
+echo "ok"